@@ -0,0 +1,2 @@
+#Script to build the batch DHT decoder benchmark, runs on the build host
+gcc -O2 -g -I./dht ./dht/dht_batch_decode.c ./dht/common_dht_read.c dht_batch_bench.c -o dht_batch_bench.out -lpthread
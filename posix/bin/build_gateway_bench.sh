@@ -0,0 +1,4 @@
+#Script to build the gateway runtime benchmark
+# Target library, ARCH=x86 builds for the host
+ARCH=${ARCH:-arm}
+gcc -O2 -g -I../include -I../lib/$ARCH -I./dht -I./client ./dht/common_dht_read.c ./client/gateway.c ./client/log_sink.c gateway_bench.c -o gateway_bench.out -Wl,-Bstatic -L../lib/$ARCH -ldeviceclient -Wl,-Bdynamic -lssl -lcrypto -lm -lrt -lpthread
\ No newline at end of file
@@ -1,4 +1,7 @@
 #Script to build the iotclient with Adafruit sensor
 export IOTCS_OS_NAME="Raspbian GNU/Linux"
 export IOTCS_OS_VERSION="8"
-gcc -g -I../include -I../lib/arm -I./dht ./dht/pi_2_dht_read.c ./dht/common_dht_read.c ./dht/pi_2_mmio.c iotclient.c -o iotclient.out -Wl,-Bstatic -L../lib/arm -ldeviceclient -Wl,-Bdynamic -lssl -lcrypto -lm -lrt -lpthread
\ No newline at end of file
+# Target library, ARCH=x86 builds for the host (use DHT_SIM=1 to run without a sensor)
+ARCH=${ARCH:-arm}
+# TRACE=1 builds in the tracepoints, see dht/dht_trace.h
+gcc -g ${TRACE:+-DDHT_TRACE} -I../include -I../lib/$ARCH -I./dht -I./client ./dht/pi_2_dht_read.c ./dht/common_dht_read.c ./dht/pi_2_mmio.c ./dht/gpiochip_dht_read.c ./dht/dht_sim.c ./dht/dht_trace.c ./client/acquisition.c ./client/event_loop.c ./client/uploader.c ./client/reading_ring.c ./client/uplink_batch.c ./client/deadband.c ./client/spool.c ./client/netready.c ./client/startup_timing.c ./client/warm_start.c ./client/adaptive_rate.c ./client/log_sink.c ./client/tsdb.c ./client/rollup.c ./client/query_server.c ./client/metrics.c iotclient.c -o iotclient.out -Wl,-Bstatic -L../lib/$ARCH -ldeviceclient -Wl,-Bdynamic -lssl -lcrypto -lm -lrt -lpthread
\ No newline at end of file
@@ -0,0 +1,2 @@
+#Script to build the local query benchmark, runs on the device next to the iotclient
+gcc -O2 -g -I./dht -I./client ./dht/common_dht_read.c query_bench.c -o query_bench.out -lpthread
\ No newline at end of file
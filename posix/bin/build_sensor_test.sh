@@ -1,4 +1,7 @@
 #Byggscript för att skicka temp o fuktvärden till IoTCS
 export IOTCS_OS_NAME="Raspbian GNU/Linux"
 export IOTCS_OS_VERSION="8"
-gcc -g -I../include -I../lib/arm -I./dht ./dht/pi_2_dht_read.c ./dht/common_dht_read.c ./dht/pi_2_mmio.c sensor_test.c -o sensor_test.out -Wl,-Bstatic -L../lib/arm -ldeviceclient -Wl,-Bdynamic -lssl -lcrypto -lm -lrt -lpthread
\ No newline at end of file
+# Target library, ARCH=x86 builds for the host (use DHT_SIM=1 to run without a sensor)
+ARCH=${ARCH:-arm}
+# TRACE=1 builds in the tracepoints, see dht/dht_trace.h
+gcc -g ${TRACE:+-DDHT_TRACE} -I../include -I../lib/$ARCH -I./dht ./dht/pi_2_dht_read.c ./dht/common_dht_read.c ./dht/pi_2_mmio.c ./dht/gpiochip_dht_read.c ./dht/dht_sim.c ./dht/dht_trace.c sensor_test.c -o sensor_test.out -Wl,-Bstatic -L../lib/$ARCH -ldeviceclient -Wl,-Bdynamic -lssl -lcrypto -lm -lrt -lpthread
\ No newline at end of file
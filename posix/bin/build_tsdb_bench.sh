@@ -0,0 +1,2 @@
+#Script to build the reading history store benchmark, runs on the build host
+gcc -O2 -g -I./dht -I./client ./dht/common_dht_read.c ./client/tsdb.c tsdb_bench.c -o tsdb_bench.out -lm -lpthread
\ No newline at end of file
@@ -0,0 +1,200 @@
+/*
+ * Sensor acquisition thread, see acquisition.h
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "acquisition.h"
+#include "dht_trace.h"
+#include "log_sink.h"
+#include "metrics.h"
+#include "pi_2_dht_read.h"
+#include "pi_2_mmio.h"
+
+/* Stack touched at thread start so reads never take a page fault */
+#define ACQUISITION_PREFAULT_STACK (64 * 1024)
+
+static acquisition_config config;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static int running;
+static int requested;
+static int completed;
+static sensor_reading result;
+static int completion_fd = -1;
+
+static void prefault_stack(void) {
+    volatile unsigned char stack[ACQUISITION_PREFAULT_STACK];
+    memset((unsigned char*)stack, 0, sizeof(stack));
+}
+
+static void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not pin sensor thread to CPU %d\n", cpu);
+    }
+}
+
+static void lock_memory(void) {
+    /* Lock what is mapped now, and later allocations only once touched so the
+     * stacks of the library threads are not pinned in full */
+#ifdef MCL_ONFAULT
+    int flags = MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT;
+#else
+    int flags = MCL_CURRENT;
+#endif
+    if (mlockall(flags) != 0) {
+        log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not lock sensor thread memory\n");
+    }
+}
+
+static void drain_completion(void) {
+    uint64_t count;
+    /* Fails with EAGAIN when nothing is pending, which is fine */
+    ssize_t n = read(completion_fd, &count, sizeof(count));
+    (void)n;
+}
+
+static void take_reading(sensor_reading* reading) {
+    struct timespec now;
+    memset(reading, 0, sizeof(*reading));
+    reading->attempts = 1;
+    uint64_t started = monotonic_nanoseconds();
+    reading->result = pi_2_dht_read(config.sensor_type, config.gpio_pin,
+            &reading->humidity, &reading->temperature);
+    reading->sample_ns = monotonic_nanoseconds();
+    metrics_record(METRIC_DHT_READ, reading->sample_ns - started);
+    metrics_count_read(reading->result);
+    if (reading->result == DHT_SUCCESS) {
+        const dht_decode_info* decode = dht_last_decode_info();
+        reading->quality = decode->quality;
+        reading->repaired_bits = decode->repaired_bits;
+        reading->margin_us = decode->min_margin;
+        metrics_record(METRIC_DECODE_MARGIN, (uint64_t)reading->margin_us * 1000);
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    reading->event_time = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void* acquisition_main(void* arg) {
+    (void)arg;
+    TRACE_THREAD("sensor");
+    if (config.cpu >= 0) {
+        pin_to_cpu(config.cpu);
+    }
+    lock_memory();
+    prefault_stack();
+    /* Size the spinning tail of the start pulse delay for this thread, at the
+     * priority it reads with */
+    set_max_priority();
+    precise_delay_calibrate();
+    set_default_priority();
+    /* Map the GPIO registers before the first timing critical read */
+    pi_2_mmio_init();
+    pi_2_dht_set_fast_read(config.fast_read);
+
+    pthread_mutex_lock(&lock);
+    while (running) {
+        if (!requested) {
+            pthread_cond_wait(&changed, &lock);
+            continue;
+        }
+        requested = 0;
+        pthread_mutex_unlock(&lock);
+
+        sensor_reading reading;
+        take_reading(&reading);
+
+        pthread_mutex_lock(&lock);
+        result = reading;
+        completed = 1;
+        pthread_cond_broadcast(&changed);
+        uint64_t one = 1;
+        if (write(completion_fd, &one, sizeof(one)) != sizeof(one)) {
+            log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not signal sensor reading\n");
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int acquisition_start(const acquisition_config* acquisition) {
+    config = *acquisition;
+    completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (completion_fd < 0) {
+        return -1;
+    }
+    running = 1;
+    if (pthread_create(&thread, NULL, acquisition_main, NULL) != 0) {
+        running = 0;
+        close(completion_fd);
+        completion_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void acquisition_read(sensor_reading* reading) {
+    pthread_mutex_lock(&lock);
+    completed = 0;
+    requested = 1;
+    pthread_cond_broadcast(&changed);
+    while (!completed) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    *reading = result;
+    completed = 0;
+    pthread_mutex_unlock(&lock);
+    /* Swallow the completion event meant for acquisition_fd */
+    drain_completion();
+}
+
+void acquisition_request(void) {
+    pthread_mutex_lock(&lock);
+    completed = 0;
+    requested = 1;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+}
+
+int acquisition_fd(void) {
+    return completion_fd;
+}
+
+int acquisition_take(sensor_reading* reading) {
+    int taken = 0;
+    drain_completion();
+    pthread_mutex_lock(&lock);
+    if (completed) {
+        *reading = result;
+        completed = 0;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&lock);
+    return taken;
+}
+
+void acquisition_stop(void) {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    running = 0;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    close(completion_fd);
+    completion_fd = -1;
+}
@@ -0,0 +1,59 @@
+/*
+ * Sensor acquisition thread.
+ *
+ * Reading the DHT needs tight timing, so it is done on a dedicated thread
+ * that is pinned to one CPU core, runs with locked and prefaulted memory,
+ * and is the only thread raised to real-time priority while it reads.
+ * The rest of the client, including the threads of the IoT client library,
+ * stays at normal priority.
+ */
+
+#ifndef ACQUISITION_H
+#define ACQUISITION_H
+
+#include "reading.h"
+
+typedef struct {
+    int sensor_type;        /* DHT11 or DHT22 */
+    int gpio_pin;           /* BCM GPIO number */
+    int cpu;                /* CPU core to pin the thread to, -1 for any */
+    int fast_read;          /* skip the pre-charge when the line is known idle */
+} acquisition_config;
+
+/*
+ * Start the acquisition thread.
+ * Returns 0 on success, -1 if the thread could not be created.
+ */
+int acquisition_start(const acquisition_config* config);
+
+/*
+ * Take one reading on the acquisition thread and wait for the result.
+ * The reading is filled in even if the sensor read failed, check
+ * reading->result.
+ */
+void acquisition_read(sensor_reading* reading);
+
+/*
+ * Ask the acquisition thread for a reading without waiting for it.
+ * acquisition_fd becomes readable when the reading is done.
+ */
+void acquisition_request(void);
+
+/*
+ * Event file descriptor that is readable while a requested reading is
+ * waiting to be collected with acquisition_take.
+ */
+int acquisition_fd(void);
+
+/*
+ * Collect the reading asked for with acquisition_request.
+ * Returns 1 and fills in reading if one was done, 0 otherwise.
+ */
+int acquisition_take(sensor_reading* reading);
+
+/*
+ * Stop and join the acquisition thread.
+ */
+void acquisition_stop(void);
+
+#endif /* ACQUISITION_H */
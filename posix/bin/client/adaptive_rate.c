@@ -0,0 +1,87 @@
+/*
+ * Adaptive sampling period, see adaptive_rate.h
+ */
+
+#include <math.h>
+#include <string.h>
+#include "adaptive_rate.h"
+
+/* Smallest activity considered, keeps the division finite */
+#define ADAPTIVE_RATE_EPSILON 1e-9f
+
+static void track(float value, float last, float dt, float alpha,
+        float* rate, float* mean, float* variance) {
+    float change = fabsf(value - last) / dt;
+    float deviation = value - *mean;
+    *rate = alpha * change + (1.0f - alpha) * *rate;
+    /* Exponentially weighted variance, West's update */
+    *mean += alpha * deviation;
+    *variance = (1.0f - alpha) * (*variance + alpha * deviation * deviation);
+}
+
+/* Period in which the attribute is expected to move one step */
+static float period_for(float step, float rate, float variance, float max_period) {
+    /* Scatter counts as movement spread over the longest period, so a
+     * noisy but flat signal is sampled more often than a quiet one */
+    float activity = rate + sqrtf(variance) / max_period;
+    if (step <= 0) {
+        return max_period;
+    }
+    return step / (activity + ADAPTIVE_RATE_EPSILON);
+}
+
+void adaptive_rate_init(adaptive_rate* rate, const adaptive_rate_config* config) {
+    memset(rate, 0, sizeof(*rate));
+    rate->config = *config;
+    if (rate->config.min_period < ADAPTIVE_RATE_SENSOR_MIN_SECS) {
+        rate->config.min_period = ADAPTIVE_RATE_SENSOR_MIN_SECS;
+    }
+    if (rate->config.max_period < rate->config.min_period) {
+        rate->config.max_period = rate->config.min_period;
+    }
+    if (rate->config.growth < 1.0f) {
+        rate->config.growth = 1.0f;
+    }
+    rate->period = rate->config.max_period;
+}
+
+uint32_t adaptive_rate_update(adaptive_rate* rate, const sensor_reading* reading) {
+    const adaptive_rate_config* config = &rate->config;
+
+    if (!rate->have_last) {
+        rate->have_last = 1;
+        rate->temperature_mean = reading->temperature;
+        rate->humidity_mean = reading->humidity;
+    } else if (reading->sample_ns > rate->last_ns) {
+        float dt = (float)(reading->sample_ns - rate->last_ns) / 1e9f;
+        track(reading->temperature, rate->last_temperature, dt, config->smoothing,
+                &rate->temperature_rate, &rate->temperature_mean, &rate->temperature_variance);
+        track(reading->humidity, rate->last_humidity, dt, config->smoothing,
+                &rate->humidity_rate, &rate->humidity_mean, &rate->humidity_variance);
+
+        float max_period = (float)config->max_period;
+        float target = fminf(
+                period_for(config->temperature_step, rate->temperature_rate, rate->temperature_variance, max_period),
+                period_for(config->humidity_step, rate->humidity_rate, rate->humidity_variance, max_period));
+        /* Speed up at once, slow down a little at a time */
+        float grown = (float)rate->period * config->growth;
+        if (target > grown) {
+            target = grown;
+        }
+        if (target < (float)config->min_period) {
+            target = (float)config->min_period;
+        }
+        if (target > max_period) {
+            target = max_period;
+        }
+        uint32_t period = (uint32_t)(target + 0.5f);
+        if (period != rate->period) {
+            rate->period = period;
+            rate->changes++;
+        }
+    }
+    rate->last_ns = reading->sample_ns;
+    rate->last_temperature = reading->temperature;
+    rate->last_humidity = reading->humidity;
+    return rate->period;
+}
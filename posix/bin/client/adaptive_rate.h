@@ -0,0 +1,57 @@
+/*
+ * Adaptive sampling period.
+ *
+ * Follows how fast temperature and humidity change, and how much they
+ * scatter, and picks the period in which either is expected to move by
+ * about one step. The period shortens at once when the signal picks up
+ * and lengthens gradually when it settles, always within the configured
+ * bounds.
+ */
+
+#ifndef ADAPTIVE_RATE_H
+#define ADAPTIVE_RATE_H
+
+#include <stdint.h>
+#include "reading.h"
+
+/* The DHT22 needs 2 s between reads, no period goes below this */
+#define ADAPTIVE_RATE_SENSOR_MIN_SECS 2
+
+typedef struct {
+    uint32_t min_period;        /* secs, raised to ADAPTIVE_RATE_SENSOR_MIN_SECS */
+    uint32_t max_period;        /* secs */
+    float temperature_step;     /* degrees Celsius worth one sample */
+    float humidity_step;        /* percent relative humidity worth one sample */
+    float smoothing;            /* weight of the newest reading, 0-1 */
+    float growth;               /* most the period may grow per reading, e.g. 1.5 */
+} adaptive_rate_config;
+
+typedef struct {
+    adaptive_rate_config config;
+    int have_last;
+    uint64_t last_ns;
+    float last_temperature;
+    float last_humidity;
+    /* Exponentially weighted rate of change, mean and variance */
+    float temperature_rate;
+    float humidity_rate;
+    float temperature_mean;
+    float humidity_mean;
+    float temperature_variance;
+    float humidity_variance;
+    uint32_t period;            /* secs, current choice */
+    unsigned long changes;      /* times the period changed */
+} adaptive_rate;
+
+/*
+ * Set up rate with config, starting at the max period.
+ */
+void adaptive_rate_init(adaptive_rate* rate, const adaptive_rate_config* config);
+
+/*
+ * Feed a successful reading.
+ * Returns the sampling period in secs to use from now on.
+ */
+uint32_t adaptive_rate_update(adaptive_rate* rate, const sensor_reading* reading);
+
+#endif /* ADAPTIVE_RATE_H */
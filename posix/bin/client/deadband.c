@@ -0,0 +1,83 @@
+/*
+ * Report-by-exception filter, see deadband.h
+ */
+
+#include <math.h>
+#include <string.h>
+#include "deadband.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static int limit_enabled(const deadband_limit* limit) {
+    return limit->absolute > 0 || limit->percent > 0;
+}
+
+static int outside(const deadband_limit* limit, float last, float value) {
+    float change = fabsf(value - last);
+    if (limit->absolute > 0 && change > limit->absolute) {
+        return 1;
+    }
+    if (limit->percent > 0 && change > fabsf(last) * limit->percent / 100.0f) {
+        return 1;
+    }
+    return 0;
+}
+
+void deadband_init(deadband* filter, const deadband_config* config) {
+    memset(filter, 0, sizeof(*filter));
+    filter->config = *config;
+    atomic_init(&filter->reported, 0);
+    atomic_init(&filter->suppressed, 0);
+    atomic_init(&filter->heartbeats, 0);
+    atomic_init(&filter->rate_limited, 0);
+}
+
+int deadband_check(deadband* filter, const sensor_reading* reading) {
+    const deadband_config* config = &filter->config;
+    int changed, heartbeat = 0;
+
+    /* A reading somebody asked for is always reported */
+    if (filter->have_last && !reading->on_demand) {
+        uint64_t silence = reading->sample_ns - filter->last_report_ns;
+        if (!limit_enabled(&config->temperature) && !limit_enabled(&config->humidity)) {
+            changed = 1;
+        } else {
+            changed = (limit_enabled(&config->temperature) &&
+                        outside(&config->temperature, filter->last_temperature, reading->temperature)) ||
+                    (limit_enabled(&config->humidity) &&
+                        outside(&config->humidity, filter->last_humidity, reading->humidity));
+        }
+        if (config->min_interval && silence < config->min_interval * NS_PER_SEC) {
+            if (changed) {
+                atomic_fetch_add(&filter->rate_limited, 1);
+            }
+            atomic_fetch_add(&filter->suppressed, 1);
+            return 0;
+        }
+        if (!changed && config->max_silence && silence >= config->max_silence * NS_PER_SEC) {
+            heartbeat = 1;
+        }
+        if (!changed && !heartbeat) {
+            atomic_fetch_add(&filter->suppressed, 1);
+            return 0;
+        }
+    }
+
+    /* Compare against what was reported, so slow drift adds up and is seen */
+    filter->have_last = 1;
+    filter->last_temperature = reading->temperature;
+    filter->last_humidity = reading->humidity;
+    filter->last_report_ns = reading->sample_ns;
+    atomic_fetch_add(&filter->reported, 1);
+    if (heartbeat) {
+        atomic_fetch_add(&filter->heartbeats, 1);
+    }
+    return 1;
+}
+
+void deadband_get_stats(deadband* filter, deadband_stats* stats) {
+    stats->reported = atomic_load(&filter->reported);
+    stats->suppressed = atomic_load(&filter->suppressed);
+    stats->heartbeats = atomic_load(&filter->heartbeats);
+    stats->rate_limited = atomic_load(&filter->rate_limited);
+}
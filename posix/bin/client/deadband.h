@@ -0,0 +1,66 @@
+/*
+ * Report-by-exception filter for readings.
+ *
+ * A reading is only reported when temperature or humidity moved outside
+ * the deadband around the last reported value. A heartbeat reports anyway
+ * after a long enough silence, and a minimum interval keeps a noisy sensor
+ * from reporting too often.
+ */
+
+#ifndef DEADBAND_H
+#define DEADBAND_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include "reading.h"
+
+typedef struct {
+    float absolute;             /* report when the change exceeds this, 0 = off */
+    float percent;              /* report when the change exceeds this percentage, 0 = off */
+} deadband_limit;
+
+typedef struct {
+    deadband_limit temperature; /* degrees Celsius */
+    deadband_limit humidity;    /* percent relative humidity */
+    uint32_t max_silence;       /* secs, report at least this often, 0 = off */
+    uint32_t min_interval;      /* secs, never report more often, 0 = off */
+} deadband_config;
+
+typedef struct {
+    unsigned long reported;     /* readings passed on */
+    unsigned long suppressed;   /* readings inside the deadband */
+    unsigned long heartbeats;   /* readings passed on only because of max_silence */
+    unsigned long rate_limited; /* changes held back by min_interval */
+} deadband_stats;
+
+typedef struct {
+    deadband_config config;
+    int have_last;
+    float last_temperature;
+    float last_humidity;
+    uint64_t last_report_ns;
+    atomic_ulong reported;
+    atomic_ulong suppressed;
+    atomic_ulong heartbeats;
+    atomic_ulong rate_limited;
+} deadband;
+
+/*
+ * Set up filter with config. With both limits of both attributes off every
+ * reading is reported, subject to min_interval.
+ */
+void deadband_init(deadband* filter, const deadband_config* config);
+
+/*
+ * Decide on a reading, updating the last reported values when it passes.
+ * Readings with on_demand set always pass.
+ * Returns 1 if the reading should be reported, 0 if it is suppressed.
+ */
+int deadband_check(deadband* filter, const sensor_reading* reading);
+
+/*
+ * Copy the counters into stats, safe from any thread.
+ */
+void deadband_get_stats(deadband* filter, deadband_stats* stats);
+
+#endif /* DEADBAND_H */
@@ -0,0 +1,138 @@
+/*
+ * Epoll event loop with timerfd timers, see event_loop.h
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "event_loop.h"
+
+typedef struct {
+    int fd;
+    event_handler handler;
+    void* arg;
+} event_source;
+
+static int epoll_fd = -1;
+static int running;
+static event_source sources[EVENT_LOOP_MAX_SOURCES];
+
+int event_loop_init(void) {
+    int i;
+    for (i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        sources[i].fd = -1;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return epoll_fd < 0 ? -1 : 0;
+}
+
+int event_loop_add(int fd, event_handler handler, void* arg) {
+    int i;
+    for (i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        if (sources[i].fd < 0) {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.ptr = &sources[i];
+            sources[i].fd = fd;
+            sources[i].handler = handler;
+            sources[i].arg = arg;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+                sources[i].fd = -1;
+                return -1;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void event_loop_remove(int fd) {
+    int i;
+    for (i = 0; i < EVENT_LOOP_MAX_SOURCES; i++) {
+        if (sources[i].fd == fd) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            sources[i].fd = -1;
+        }
+    }
+}
+
+void event_loop_run(void) {
+    struct epoll_event events[EVENT_LOOP_MAX_SOURCES];
+    running = 1;
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_SOURCES, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        int i;
+        for (i = 0; i < n && running; i++) {
+            event_source* source = events[i].data.ptr;
+            /* The source may have been removed by an earlier handler */
+            if (source->fd >= 0) {
+                source->handler(source->fd, source->arg);
+            }
+        }
+    }
+}
+
+void event_loop_stop(void) {
+    running = 0;
+}
+
+void event_loop_finalize(void) {
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+}
+
+static void to_timespec(uint64_t ns, struct timespec* ts) {
+    ts->tv_sec = ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+int timer_create_monotonic(void) {
+    return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+int timer_arm(int timer, uint64_t deadline, uint64_t period) {
+    struct itimerspec spec;
+    /* A zero it_value would disarm the timer */
+    to_timespec(deadline ? deadline : 1, &spec.it_value);
+    to_timespec(period, &spec.it_interval);
+    return timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void timer_disarm(int timer) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    timerfd_settime(timer, 0, &spec, NULL);
+}
+
+uint64_t timer_expirations(int timer) {
+    uint64_t count = 0;
+    if (read(timer, &count, sizeof(count)) != sizeof(count)) {
+        return 0;
+    }
+    return count;
+}
+
+uint64_t timer_next_grid_point(uint64_t period) {
+    struct timespec wall, mono;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    uint64_t wall_ns = (uint64_t)wall.tv_sec * 1000000000ULL + wall.tv_nsec;
+    uint64_t mono_ns = (uint64_t)mono.tv_sec * 1000000000ULL + mono.tv_nsec;
+    if (period == 0) {
+        return mono_ns;
+    }
+    return mono_ns + (period - wall_ns % period);
+}
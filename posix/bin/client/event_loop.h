@@ -0,0 +1,84 @@
+/*
+ * Single threaded epoll event loop with absolute deadline timers.
+ *
+ * Timers are timerfds on CLOCK_MONOTONIC armed with absolute deadlines,
+ * so periodic work stays on its grid no matter how long the handlers run.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+
+/* Maximum number of file descriptors the loop can watch */
+#define EVENT_LOOP_MAX_SOURCES 16
+
+/*
+ * Called when fd becomes readable.
+ * @param fd the ready file descriptor
+ * @param arg argument given to event_loop_add
+ */
+typedef void (*event_handler)(int fd, void* arg);
+
+/*
+ * Create the loop. Returns 0 on success, -1 on failure.
+ */
+int event_loop_init(void);
+
+/*
+ * Watch fd for input and call handler when it is readable.
+ * Returns 0 on success, -1 on failure.
+ */
+int event_loop_add(int fd, event_handler handler, void* arg);
+
+/*
+ * Stop watching fd.
+ */
+void event_loop_remove(int fd);
+
+/*
+ * Dispatch events until event_loop_stop is called.
+ */
+void event_loop_run(void);
+
+/*
+ * Make event_loop_run return after the current handler.
+ */
+void event_loop_stop(void);
+
+/*
+ * Release the loop.
+ */
+void event_loop_finalize(void);
+
+/*
+ * Create a timerfd on CLOCK_MONOTONIC, disarmed.
+ * Returns the file descriptor or -1 on failure.
+ */
+int timer_create_monotonic(void);
+
+/*
+ * Arm timer to first expire at the absolute monotonic time deadline (ns)
+ * and then every period ns, or only once if period is 0.
+ */
+int timer_arm(int timer, uint64_t deadline, uint64_t period);
+
+/*
+ * Disarm timer.
+ */
+void timer_disarm(int timer);
+
+/*
+ * Consume a timer expiration. Returns the number of expirations since the
+ * last call, more than one means periods were missed.
+ */
+uint64_t timer_expirations(int timer);
+
+/*
+ * Next point on a period grid aligned to the wall clock, as a monotonic
+ * time: with a 300 s period the grid falls on :00, :05, :10, ... of every
+ * hour.
+ */
+uint64_t timer_next_grid_point(uint64_t period);
+
+#endif /* EVENT_LOOP_H */
@@ -0,0 +1,305 @@
+/*
+ * Gateway runtime, see gateway.h
+ *
+ * Endpoint i belongs to worker i % workers. Each worker has a lock, a
+ * condition variable and a FIFO of endpoint indexes with work to do
+ * (registration or an update). An endpoint is in the FIFO at most once:
+ * a reading for an endpoint already queued just replaces its value.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "iotcs_device.h"
+#include "gateway.h"
+#include "log_sink.h"
+
+typedef struct {
+    char hardware_id[GATEWAY_HARDWARE_ID_SIZE];
+    char endpoint_id[IOTCS_CLIENT_ID_BUFFER_LENGTH];
+    iotcs_virtual_device_handle device;
+    sensor_reading latest;
+    unsigned char registering;  /* registration still to do */
+    unsigned char failed;       /* registration failed, updates are dropped */
+    unsigned char dirty;        /* latest not sent yet */
+    unsigned char queued;       /* in the worker's FIFO */
+} gateway_endpoint;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t* fifo;               /* endpoint indexes, capacity = its endpoints + 1 */
+    size_t capacity;
+    size_t head;
+    size_t count;
+    unsigned long registration_failures;
+    unsigned long submitted;
+    unsigned long updates;
+    unsigned long update_failures;
+    unsigned long coalesced;
+    size_t registered;
+    int running;
+} gateway_worker;
+
+static gateway_config config;
+static gateway_endpoint* endpoints;
+static gateway_worker workers[GATEWAY_MAX_WORKERS];
+static pthread_mutex_t add_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t registered_changed = PTHREAD_COND_INITIALIZER;
+static size_t endpoint_count;
+static size_t settled;          /* endpoints registered or failed, under add_lock */
+
+static gateway_worker* worker_of(size_t endpoint) {
+    return &workers[endpoint % (size_t)config.workers];
+}
+
+/* Queue endpoint on its worker unless it is already, worker lock held */
+static void enqueue(gateway_worker* worker, size_t endpoint) {
+    gateway_endpoint* e = &endpoints[endpoint];
+    if (e->queued) {
+        return;
+    }
+    e->queued = 1;
+    worker->fifo[(worker->head + worker->count) % worker->capacity] = endpoint;
+    worker->count++;
+    pthread_cond_signal(&worker->changed);
+}
+
+static int register_endpoint(gateway_endpoint* e) {
+    static const iotcs_key_value metadata[] = {
+        { IOTCS_METADATA_PROTOCOL, "gpio" },
+        { IOTCS_METADATA_DEVICE_CLASS, "dht" },
+        { NULL, NULL }
+    };
+    const char* models[] = { config.device_urn, NULL };
+    if (iotcs_register_device(config.restricted ? IOTCS_TRUE : IOTCS_FALSE, e->hardware_id, metadata,
+            models, e->endpoint_id) != IOTCS_RESULT_OK) {
+        return -1;
+    }
+    if (iotcs_get_virtual_device_handle(e->endpoint_id, config.device_model, &e->device) != IOTCS_RESULT_OK) {
+        e->device = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int send_update(iotcs_virtual_device_handle device, const sensor_reading* reading) {
+    int rv = 0;
+    iotcs_virtual_device_start_update(device);
+    if (iotcs_virtual_device_set_float(device, "temperature", reading->temperature) != IOTCS_RESULT_OK ||
+            iotcs_virtual_device_set_float(device, "humidity", reading->humidity) != IOTCS_RESULT_OK) {
+        rv = -1;
+    }
+    /* Finished even after a failure so the next update can start */
+    iotcs_virtual_device_finish_update(device);
+    return rv;
+}
+
+static void* worker_main(void* arg) {
+    gateway_worker* worker = arg;
+    pthread_mutex_lock(&worker->lock);
+    for (;;) {
+        if (worker->count == 0) {
+            if (!worker->running) {
+                break;
+            }
+            pthread_cond_wait(&worker->changed, &worker->lock);
+            continue;
+        }
+        size_t index = worker->fifo[worker->head];
+        worker->head = (worker->head + 1) % worker->capacity;
+        worker->count--;
+        gateway_endpoint* e = &endpoints[index];
+        e->queued = 0;
+
+        if (e->registering) {
+            pthread_mutex_unlock(&worker->lock);
+            int rv = register_endpoint(e);
+            pthread_mutex_lock(&worker->lock);
+            e->registering = 0;
+            if (rv == 0) {
+                worker->registered++;
+            } else {
+                e->failed = 1;
+                worker->registration_failures++;
+                log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not register %s\n", e->hardware_id);
+            }
+            pthread_mutex_lock(&add_lock);
+            settled++;
+            pthread_cond_broadcast(&registered_changed);
+            pthread_mutex_unlock(&add_lock);
+            /* A reading that came in meanwhile goes out now */
+            if (e->dirty && !e->failed) {
+                enqueue(worker, index);
+            }
+            continue;
+        }
+        if (!e->dirty || e->failed) {
+            continue;
+        }
+        sensor_reading reading = e->latest;
+        e->dirty = 0;
+        pthread_mutex_unlock(&worker->lock);
+
+        int rv = send_update(e->device, &reading);
+
+        pthread_mutex_lock(&worker->lock);
+        if (rv == 0) {
+            worker->updates++;
+        } else {
+            worker->update_failures++;
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+int gateway_start(const gateway_config* gateway) {
+    int i;
+    if (gateway->workers < 1 || gateway->workers > GATEWAY_MAX_WORKERS || gateway->max_endpoints == 0 ||
+            gateway->device_urn == NULL || gateway->device_model == NULL) {
+        return -1;
+    }
+    config = *gateway;
+    endpoints = calloc(config.max_endpoints, sizeof(gateway_endpoint));
+    if (endpoints == NULL) {
+        return -1;
+    }
+    endpoint_count = 0;
+    settled = 0;
+    for (i = 0; i < config.workers; i++) {
+        gateway_worker* worker = &workers[i];
+        memset(worker, 0, sizeof(*worker));
+        worker->capacity = config.max_endpoints / config.workers + 1;
+        worker->fifo = malloc(worker->capacity * sizeof(size_t));
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->changed, NULL);
+        worker->running = 1;
+        if (worker->fifo == NULL || pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            /* The workers before this one are stopped by gateway_stop */
+            free(worker->fifo);
+            worker->fifo = NULL;
+            pthread_mutex_destroy(&worker->lock);
+            pthread_cond_destroy(&worker->changed);
+            config.workers = i;
+            gateway_stop();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int gateway_add_endpoint(const char* hardware_id) {
+    pthread_mutex_lock(&add_lock);
+    if (endpoint_count == config.max_endpoints) {
+        pthread_mutex_unlock(&add_lock);
+        return -1;
+    }
+    size_t index = endpoint_count++;
+    pthread_mutex_unlock(&add_lock);
+
+    gateway_worker* worker = worker_of(index);
+    pthread_mutex_lock(&worker->lock);
+    gateway_endpoint* e = &endpoints[index];
+    snprintf(e->hardware_id, sizeof(e->hardware_id), "%s", hardware_id);
+    e->registering = 1;
+    enqueue(worker, index);
+    pthread_mutex_unlock(&worker->lock);
+    return (int)index;
+}
+
+void gateway_submit(int endpoint, const sensor_reading* reading) {
+    if (endpoint < 0) {
+        return;
+    }
+    /* An index not handed out yet has no device to send with */
+    pthread_mutex_lock(&add_lock);
+    int added = (size_t)endpoint < endpoint_count;
+    pthread_mutex_unlock(&add_lock);
+    if (!added) {
+        return;
+    }
+    gateway_worker* worker = worker_of((size_t)endpoint);
+    gateway_endpoint* e = &endpoints[endpoint];
+    pthread_mutex_lock(&worker->lock);
+    worker->submitted++;
+    if (e->dirty) {
+        worker->coalesced++;
+    }
+    e->latest = *reading;
+    e->dirty = 1;
+    /* Registration first, the reading is sent right after */
+    if (!e->registering && !e->failed) {
+        enqueue(worker, (size_t)endpoint);
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+size_t gateway_wait_registered(int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&add_lock);
+    while (settled < endpoint_count) {
+        if (pthread_cond_timedwait(&registered_changed, &add_lock, &deadline) != 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&add_lock);
+    gateway_stats stats;
+    gateway_get_stats(&stats);
+    return stats.registered;
+}
+
+void gateway_get_stats(gateway_stats* stats) {
+    int i;
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&add_lock);
+    stats->endpoints = endpoint_count;
+    pthread_mutex_unlock(&add_lock);
+    for (i = 0; i < config.workers; i++) {
+        gateway_worker* worker = &workers[i];
+        pthread_mutex_lock(&worker->lock);
+        stats->registered += worker->registered;
+        stats->registration_failures += worker->registration_failures;
+        stats->submitted += worker->submitted;
+        stats->updates += worker->updates;
+        stats->update_failures += worker->update_failures;
+        stats->coalesced += worker->coalesced;
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+void gateway_stop(void) {
+    int i;
+    size_t e;
+    for (i = 0; i < config.workers; i++) {
+        gateway_worker* worker = &workers[i];
+        pthread_mutex_lock(&worker->lock);
+        worker->running = 0;
+        pthread_cond_signal(&worker->changed);
+        pthread_mutex_unlock(&worker->lock);
+        pthread_join(worker->thread, NULL);
+        free(worker->fifo);
+        worker->fifo = NULL;
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->changed);
+    }
+    config.workers = 0;
+    for (e = 0; endpoints && e < endpoint_count; e++) {
+        if (endpoints[e].device) {
+            iotcs_free_virtual_device_handle(endpoints[e].device);
+        }
+    }
+    free(endpoints);
+    endpoints = NULL;
+    endpoint_count = 0;
+}
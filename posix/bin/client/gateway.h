@@ -0,0 +1,81 @@
+/*
+ * Gateway runtime for indirectly connected sensors.
+ *
+ * Endpoints are registered with iotcs_register_device and each keeps a
+ * virtual device handle of its own. Endpoints are sharded over worker
+ * threads by index; a worker registers its own endpoints and sends their
+ * updates, so many slow library calls run side by side while the
+ * library's dispatcher carries the messages. Readings for an endpoint
+ * whose previous update has not gone out yet replace it, only the newest
+ * value of each endpoint is sent.
+ */
+
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include <stddef.h>
+#include "iotcs.h"
+#include "iotcs_virtual_device.h"
+#include "reading.h"
+
+/* Most worker threads */
+#define GATEWAY_MAX_WORKERS 32
+/* Longest hardware id, including the terminator */
+#define GATEWAY_HARDWARE_ID_SIZE 64
+
+typedef struct {
+    size_t max_endpoints;                   /* capacity, fixed at start */
+    int workers;                            /* worker threads, 1 to GATEWAY_MAX_WORKERS */
+    const char* device_urn;                 /* model implemented by every endpoint */
+    iotcs_device_model_handle device_model; /* handle for device_urn */
+    int restricted;                         /* endpoints need their own credentials */
+} gateway_config;
+
+typedef struct {
+    size_t endpoints;                       /* endpoints added */
+    size_t registered;                      /* endpoints with a virtual device */
+    unsigned long registration_failures;
+    unsigned long submitted;                /* readings handed to the gateway */
+    unsigned long updates;                  /* updates sent */
+    unsigned long update_failures;
+    unsigned long coalesced;                /* readings replaced before they went out */
+} gateway_stats;
+
+/*
+ * Start the workers.
+ * Returns 0 on success, -1 on bad configuration or out of memory.
+ */
+int gateway_start(const gateway_config* config);
+
+/*
+ * Add an endpoint, its worker registers it in the background.
+ * @param hardware_id id unique within the cloud service instance
+ * Returns the endpoint index for gateway_submit, or -1 when full.
+ */
+int gateway_add_endpoint(const char* hardware_id);
+
+/*
+ * Hand over a reading for endpoint, thread safe and never blocks.
+ * Readings for an endpoint that is not registered yet are kept as its
+ * latest value and sent once it is, readings for an index that was not
+ * returned by gateway_add_endpoint are ignored.
+ */
+void gateway_submit(int endpoint, const sensor_reading* reading);
+
+/*
+ * Wait up to timeout_ms for all added endpoints to be registered or fail.
+ * Returns the number registered.
+ */
+size_t gateway_wait_registered(int timeout_ms);
+
+/*
+ * Sum the worker counters into stats.
+ */
+void gateway_get_stats(gateway_stats* stats);
+
+/*
+ * Stop the workers and free every virtual device handle.
+ */
+void gateway_stop(void);
+
+#endif /* GATEWAY_H */
@@ -0,0 +1,428 @@
+/*
+ * Asynchronous log sink, see log_sink.h
+ *
+ * The ring is a bounded multi producer queue: every record carries a
+ * sequence number that tells producers when it is free and the writer
+ * when it is filled in. Producers claim a position with a compare and
+ * swap on the enqueue position, the writer alone advances the dequeue
+ * position. The writer sleeps on an eventfd that producers only poke
+ * when it says it is asleep.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "log_sink.h"
+
+#define LOG_SINK_MASK (LOG_SINK_RECORDS - 1)
+/* Room for "2024-01-31 23:59:59.999 " */
+#define LOG_SINK_STAMP 32
+/* Repeated messages tracked by the rate limit */
+#define LOG_SINK_RATE_SLOTS 64
+/* Start of a repeated message kept for its held back note */
+#define LOG_SINK_RATE_TEXT 64
+#define LOG_SINK_NOTE (LOG_SINK_RATE_TEXT + 48)
+
+typedef struct {
+    atomic_size_t sequence;
+    struct timespec time;       /* CLOCK_REALTIME when logged */
+    unsigned short length;
+    char text[LOG_SINK_LINE];
+} log_record;
+
+typedef struct {
+    uint32_t key;
+    time_t window;              /* start of the current window */
+    unsigned int count;         /* lines seen in the window */
+    unsigned long held;         /* lines held back in the window */
+    char text[LOG_SINK_RATE_TEXT];  /* start of the message, for the note */
+} log_rate;
+
+static log_record records[LOG_SINK_RECORDS];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos;
+static atomic_int level = IOTCS_LOG_LEVEL_INFO;
+static atomic_int started;
+static atomic_int writer_sleeping;
+static int output_fd = 2;
+static int wake_fd = -1;
+static atomic_int running;
+static pthread_t writer;
+
+/* Used by the writer only */
+static log_rate rates[LOG_SINK_RATE_SLOTS];
+static time_t stamp_second = -1;
+static char stamp_prefix[24];
+
+static atomic_ulong lines;
+static atomic_ulong batches;
+static atomic_ulong dropped;
+static atomic_ulong suppressed;
+static atomic_ulong errors;
+
+static void format_stamp(const struct timespec* time, char* stamp, size_t size) {
+    /* localtime_r and strftime only once a second */
+    if (time->tv_sec != stamp_second) {
+        struct tm local;
+        localtime_r(&time->tv_sec, &local);
+        strftime(stamp_prefix, sizeof(stamp_prefix), "%Y-%m-%d %H:%M:%S", &local);
+        stamp_second = time->tv_sec;
+    }
+    snprintf(stamp, size, "%s.%03d ", stamp_prefix, (int)(time->tv_nsec / 1000000));
+}
+
+/* Write all of iov, writev may stop early on a pipe */
+static void write_all(struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(output_fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            atomic_fetch_add_explicit(&errors, 1, memory_order_relaxed);
+            return;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    atomic_fetch_add_explicit(&batches, 1, memory_order_relaxed);
+}
+
+/* FNV-1a over the text without digits, so counters in a message do not
+ * make every line look new */
+static uint32_t message_key(const char* text, size_t length) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+/* Note on the lines a slot held back, returns its length */
+static size_t held_note(const log_rate* rate, char* note) {
+    int length = snprintf(note, LOG_SINK_NOTE, "message held back %lu more times: %s\n", rate->held, rate->text);
+    return length < LOG_SINK_NOTE ? (size_t)length : LOG_SINK_NOTE - 1;
+}
+
+/*
+ * Decide on a line from the writer thread.
+ * Returns 1 to write it, 0 to hold it back. When the line starts the slot
+ * over, for a new window or another message, the note on what the slot
+ * held back is put in note and its length in *note_length, 0 for none.
+ */
+static int rate_check(const log_record* record, char* note, size_t* note_length) {
+    uint32_t key = message_key(record->text, record->length);
+    log_rate* rate = &rates[key % LOG_SINK_RATE_SLOTS];
+    *note_length = 0;
+    if (rate->key != key || record->time.tv_sec - rate->window >= LOG_SINK_RATE_WINDOW) {
+        if (rate->held) {
+            *note_length = held_note(rate, note);
+        }
+        size_t length = record->length < LOG_SINK_RATE_TEXT ? record->length : LOG_SINK_RATE_TEXT - 1;
+        while (length > 0 && record->text[length - 1] == '\n') {
+            length--;
+        }
+        memcpy(rate->text, record->text, length);
+        rate->text[length] = '\0';
+        rate->key = key;
+        rate->window = record->time.tv_sec;
+        rate->count = 0;
+        rate->held = 0;
+    }
+    if (++rate->count > LOG_SINK_RATE_BURST) {
+        rate->held++;
+        atomic_fetch_add_explicit(&suppressed, 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Write out up to LOG_SINK_BATCH filled records.
+ * Returns the number of records taken from the ring.
+ */
+static size_t write_batch(void) {
+    static char stamps[LOG_SINK_BATCH][LOG_SINK_STAMP];
+    static char notes[LOG_SINK_BATCH][LOG_SINK_NOTE];
+    static char newline[] = "\n";
+    struct iovec iov[LOG_SINK_BATCH * 5];
+    int count = 0;
+    size_t taken = 0, written = 0, i;
+
+    while (taken < LOG_SINK_BATCH) {
+        log_record* record = &records[(dequeue_pos + taken) & LOG_SINK_MASK];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        if (sequence != dequeue_pos + taken + 1) {
+            break;
+        }
+        size_t note_length;
+        int write = rate_check(record, notes[taken], &note_length);
+        if (note_length || write) {
+            format_stamp(&record->time, stamps[taken], LOG_SINK_STAMP);
+        }
+        if (note_length) {
+            iov[count].iov_base = stamps[taken];
+            iov[count++].iov_len = strlen(stamps[taken]);
+            iov[count].iov_base = notes[taken];
+            iov[count++].iov_len = note_length;
+        }
+        if (write) {
+            iov[count].iov_base = stamps[taken];
+            iov[count++].iov_len = strlen(stamps[taken]);
+            iov[count].iov_base = record->text;
+            iov[count++].iov_len = record->length;
+            if (record->length == 0 || record->text[record->length - 1] != '\n') {
+                iov[count].iov_base = newline;
+                iov[count++].iov_len = 1;
+            }
+            written++;
+        }
+        taken++;
+    }
+    if (count > 0) {
+        write_all(iov, count);
+    }
+    /* The iovecs pointed into the records, free them only now */
+    for (i = 0; i < taken; i++) {
+        atomic_store_explicit(&records[(dequeue_pos + i) & LOG_SINK_MASK].sequence,
+                dequeue_pos + i + LOG_SINK_RECORDS, memory_order_release);
+    }
+    dequeue_pos += taken;
+    atomic_fetch_add_explicit(&lines, written, memory_order_relaxed);
+    return taken;
+}
+
+/*
+ * Note the lines held back in windows that ended, or in every window
+ * when stopping, so a burst that goes quiet is still reported.
+ */
+static void report_held(int all) {
+    static char stamp[LOG_SINK_STAMP];
+    static char notes[LOG_SINK_RATE_SLOTS][LOG_SINK_NOTE];
+    struct iovec iov[LOG_SINK_RATE_SLOTS * 2];
+    struct timespec now;
+    int count = 0;
+    size_t i;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (i = 0; i < LOG_SINK_RATE_SLOTS; i++) {
+        log_rate* rate = &rates[i];
+        if (rate->held == 0 || (!all && now.tv_sec - rate->window < LOG_SINK_RATE_WINDOW)) {
+            continue;
+        }
+        if (count == 0) {
+            format_stamp(&now, stamp, sizeof(stamp));
+        }
+        iov[count].iov_base = stamp;
+        iov[count++].iov_len = strlen(stamp);
+        iov[count].iov_base = notes[i];
+        iov[count++].iov_len = held_note(rate, notes[i]);
+        rate->held = 0;
+    }
+    if (count > 0) {
+        write_all(iov, count);
+    }
+}
+
+static int record_ready(void) {
+    const log_record* record = &records[dequeue_pos & LOG_SINK_MASK];
+    return atomic_load_explicit(&record->sequence, memory_order_acquire) == dequeue_pos + 1;
+}
+
+static void* writer_main(void* arg) {
+    (void)arg;
+    struct pollfd wake = { wake_fd, POLLIN, 0 };
+    uint64_t count;
+    for (;;) {
+        while (write_batch() > 0) {
+        }
+        /* Also after each poll timeout */
+        report_held(0);
+        atomic_store(&writer_sleeping, 1);
+        /* Pairs with the fence in log_write, either a producer sees the
+         * writer asleep or the writer sees its record */
+        atomic_thread_fence(memory_order_seq_cst);
+        if (record_ready()) {
+            atomic_store(&writer_sleeping, 0);
+            continue;
+        }
+        if (!atomic_load(&running)) {
+            report_held(1);
+            break;
+        }
+        poll(&wake, 1, 1000);
+        atomic_store(&writer_sleeping, 0);
+        if (read(wake_fd, &count, sizeof(count)) < 0) {
+            /* EAGAIN on a timeout */
+        }
+    }
+    return NULL;
+}
+
+/* Write one line on the calling thread, when the writer does not run */
+static void write_direct(const char* text, size_t length) {
+    char stamp[LOG_SINK_STAMP];
+    char newline[] = "\n";
+    struct timespec now;
+    struct tm local;
+    clock_gettime(CLOCK_REALTIME, &now);
+    localtime_r(&now.tv_sec, &local);
+    size_t n = strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+    snprintf(stamp + n, sizeof(stamp) - n, ".%03d ", (int)(now.tv_nsec / 1000000));
+    struct iovec iov[3] = {
+        { stamp, strlen(stamp) },
+        { (void*)text, length },
+        { newline, 1 }
+    };
+    write_all(iov, length > 0 && text[length - 1] == '\n' ? 2 : 3);
+}
+
+/*
+ * Claim a record, copy the line in and publish it.
+ * Never blocks, the line is dropped when the ring is full.
+ */
+static void log_write(const char* text, size_t length) {
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    log_record* record;
+    if (!atomic_load_explicit(&started, memory_order_acquire)) {
+        write_direct(text, length);
+        return;
+    }
+    for (;;) {
+        record = &records[pos & LOG_SINK_MASK];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)pos;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    if (length > LOG_SINK_LINE) {
+        length = LOG_SINK_LINE;
+    }
+    memcpy(record->text, text, length);
+    record->length = (unsigned short)length;
+    atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&writer_sleeping)) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            /* The writer wakes up on its timeout anyway */
+        }
+    }
+}
+
+/* iotcs_log_method, runs on whatever thread the library logs from */
+static void library_log(iotcs_log_level line_level, iotcs_log_channel channel, const char* buf, size_t len) {
+    (void)channel;
+    /* The library may only pick up new levels at iotcs_init */
+    if ((int)line_level > atomic_load_explicit(&level, memory_order_relaxed)) {
+        return;
+    }
+    log_write(buf, len);
+}
+
+void log_printf(iotcs_log_level line_level, const char* format, ...) {
+    char text[LOG_SINK_LINE];
+    va_list args;
+    if ((int)line_level > atomic_load_explicit(&level, memory_order_relaxed)) {
+        return;
+    }
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    log_write(text, (size_t)length < sizeof(text) ? (size_t)length : sizeof(text) - 1);
+}
+
+void log_sink_set_level(iotcs_log_level new_level) {
+    iotcs_log_level levels[IOTCS_LOG_CHANNEL_NUM];
+    int i;
+    for (i = 0; i < IOTCS_LOG_CHANNEL_NUM; i++) {
+        levels[i] = new_level;
+    }
+    atomic_store(&level, new_level);
+    iotcs_log_set_levels(levels);
+}
+
+iotcs_log_level log_sink_level(void) {
+    return (iotcs_log_level)atomic_load(&level);
+}
+
+int log_sink_start(int fd, iotcs_log_level start_level) {
+    size_t i;
+    output_fd = fd;
+    for (i = 0; i < LOG_SINK_RECORDS; i++) {
+        atomic_init(&records[i].sequence, i);
+    }
+    atomic_store(&enqueue_pos, 0);
+    dequeue_pos = 0;
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        return -1;
+    }
+    atomic_store(&running, 1);
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+    atomic_store(&started, 1);
+    log_sink_set_level(start_level);
+    iotcs_log_set_method(library_log);
+    return 0;
+}
+
+void log_sink_get_stats(log_sink_stats* stats) {
+    stats->lines = atomic_load_explicit(&lines, memory_order_relaxed);
+    stats->batches = atomic_load_explicit(&batches, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+    stats->suppressed = atomic_load_explicit(&suppressed, memory_order_relaxed);
+    stats->errors = atomic_load_explicit(&errors, memory_order_relaxed);
+}
+
+void log_sink_stop(void) {
+    uint64_t one = 1;
+    if (!atomic_exchange(&started, 0)) {
+        return;
+    }
+    /* Lines logged from now on are written directly */
+    atomic_store(&running, 0);
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        /* Seen on the next timeout */
+    }
+    pthread_join(writer, NULL);
+    close(wake_fd);
+    wake_fd = -1;
+}
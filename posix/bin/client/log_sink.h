@@ -0,0 +1,75 @@
+/*
+ * Asynchronous log sink for the client and the IoT client library.
+ *
+ * Log lines are formatted by the calling thread into a preallocated,
+ * lock-free multi producer ring and written out by a background thread
+ * in batched writev calls, so logging never blocks on the terminal or
+ * the journal, even from the sensor and library threads. Each line gets
+ * a wall clock timestamp. Lines that repeat faster than the rate limit
+ * are counted instead of written. When the ring is full, lines are
+ * dropped and counted rather than waited for.
+ *
+ * Before log_sink_start and after log_sink_stop, lines are written
+ * directly on the calling thread.
+ */
+
+#ifndef LOG_SINK_H
+#define LOG_SINK_H
+
+#include <stddef.h>
+#include "advanced/iotcs_log.h"
+
+/* Number of lines the ring holds, must be a power of two */
+#define LOG_SINK_RECORDS 256
+/* Longest line kept, longer ones are cut */
+#define LOG_SINK_LINE 240
+/* Lines written by one writev */
+#define LOG_SINK_BATCH 32
+/* A message repeating more than LOG_SINK_RATE_BURST times within
+ * LOG_SINK_RATE_WINDOW secs is counted instead of written until the
+ * window ends, then a note says how often it was held back. Digits are
+ * ignored when comparing messages. */
+#define LOG_SINK_RATE_BURST 10
+#define LOG_SINK_RATE_WINDOW 10
+
+typedef struct {
+    unsigned long lines;        /* lines written */
+    unsigned long batches;      /* writev calls */
+    unsigned long dropped;      /* lines lost because the ring was full */
+    unsigned long suppressed;   /* lines held back by the rate limit */
+    unsigned long errors;       /* failed writes */
+} log_sink_stats;
+
+/*
+ * Start the writer thread on fd, and route the library's log through the
+ * sink. Call before iotcs_init.
+ * Returns 0 on success, -1 if the thread could not be created.
+ */
+int log_sink_start(int fd, iotcs_log_level level);
+
+/*
+ * Log a line at level, for the client's own messages. A trailing newline
+ * is added when missing.
+ */
+void log_printf(iotcs_log_level level, const char* format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+/*
+ * Change the level of the client and of every library channel, from any
+ * thread while running.
+ */
+void log_sink_set_level(iotcs_log_level level);
+
+iotcs_log_level log_sink_level(void);
+
+/*
+ * Copy the counters into stats, safe from any thread.
+ */
+void log_sink_get_stats(log_sink_stats* stats);
+
+/*
+ * Write out what is queued and stop the writer thread.
+ */
+void log_sink_stop(void);
+
+#endif /* LOG_SINK_H */
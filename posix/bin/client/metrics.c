@@ -0,0 +1,411 @@
+/*
+ * Latency histograms and counters, see metrics.h
+ *
+ * Bucket of a value v: v itself below 128, else with s the position of
+ * its highest bit less 6, 64 * s + (v >> s), so the top seven bits pick
+ * the bucket. Values from 2^41 ns on all land in the last one.
+ *
+ * A scrape reads the buckets one by one while other threads keep adding,
+ * so the totals of a scrape may be a few values apart. The count given is
+ * the sum of the buckets read, which keeps the histogram consistent.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "common_dht_read.h"
+#include "log_sink.h"
+#include "metrics.h"
+
+#define METRICS_SUB_BUCKETS 64
+#define METRICS_TOP_BIT 40
+#define METRICS_BUCKETS (METRICS_SUB_BUCKETS * (METRICS_TOP_BIT - 6) + 2 * METRICS_SUB_BUCKETS)
+/* Results counted by metrics_count_read: success, the four errors, other */
+#define METRICS_READ_RESULTS 6
+#define METRICS_REQUEST_MAX 2048
+/* A scraper gets this long to send its request and take the answer */
+#define METRICS_CLIENT_TIMEOUT_MS 2000
+
+typedef struct {
+    atomic_uint_least64_t buckets[METRICS_BUCKETS];
+    atomic_uint_least64_t sum;
+    atomic_uint_least64_t max;
+} histogram;
+
+typedef struct {
+    const char* name;           /* of the Prometheus histogram */
+    const char* quantiles;      /* of the gauges with its percentiles */
+    const char* help;
+    uint64_t first_bound;       /* ns, the buckets are 1-2-5 from here */
+    int decades;
+} histogram_export;
+
+static const histogram_export exports[METRIC_HISTOGRAMS] = {
+    { "dht_read_duration_seconds", "dht_read_duration_quantile_seconds",
+        "Time one read of the DHT sensor took", 1000000ULL, 3 },
+    { "dht_decode_margin_seconds", "dht_decode_margin_quantile_seconds",
+        "Distance of the weakest bit of a good read from the decode threshold", 1000ULL, 2 },
+    { "iotclient_upload_duration_seconds", "iotclient_upload_duration_quantile_seconds",
+        "Time from handing a reading to the library to its delivery", 1000000ULL, 5 },
+    { "iotclient_enqueue_duration_seconds", "iotclient_enqueue_duration_quantile_seconds",
+        "Time a virtual device update blocked before the library queued it", 1000ULL, 5 },
+    { "iotclient_sample_to_delivery_seconds", "iotclient_sample_to_delivery_quantile_seconds",
+        "Time from taking a reading to its delivery to the server", 10000000ULL, 5 }
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} counter_exports[METRIC_COUNTERS] = {
+    { "iotclient_samples_total", "Sampling periods started" },
+    { "iotclient_failed_samples_total", "Sampling periods without a good reading after the retries" },
+    { "iotclient_missed_periods_total", "Sampling periods the client was too late for" },
+    { "iotclient_read_retries_total", "Sensor reads repeated after bad data" }
+};
+
+static const char* read_results[METRICS_READ_RESULTS] = { "ok", "timeout", "checksum", "argument", "gpio", "other" };
+static const double quantile_points[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static histogram histograms[METRIC_HISTOGRAMS];
+static atomic_ulong counters[METRIC_COUNTERS];
+static atomic_ulong reads[METRICS_READ_RESULTS];
+
+static metrics_collector collect;
+static int listen_fd = -1;
+static int stop_fd = -1;
+static pthread_t thread;
+static metrics_writer scrape;
+
+static size_t bucket_of(uint64_t value) {
+    if (value < 2 * METRICS_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+    if (value >> (METRICS_TOP_BIT + 1)) {
+        return METRICS_BUCKETS - 1;
+    }
+    unsigned int shift = 63 - __builtin_clzll(value) - 6;
+    return METRICS_SUB_BUCKETS * shift + (size_t)(value >> shift);
+}
+
+/* Largest value that lands in the bucket */
+static uint64_t bucket_top(size_t bucket) {
+    if (bucket < 2 * METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned int shift = (unsigned int)(bucket / METRICS_SUB_BUCKETS) - 1;
+    uint64_t mantissa = bucket - (uint64_t)METRICS_SUB_BUCKETS * shift;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void metrics_record(metrics_histogram which, uint64_t value) {
+    histogram* h = &histograms[which];
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, value,
+            memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void metrics_record_delivery(int64_t event_time_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t elapsed = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec - event_time_ms * 1000000LL;
+    /* The clock may have been set back since */
+    metrics_record(METRIC_SAMPLE_TO_DELIVERY, elapsed > 0 ? (uint64_t)elapsed : 0);
+}
+
+void metrics_add(metrics_counter counter, unsigned long count) {
+    atomic_fetch_add_explicit(&counters[counter], count, memory_order_relaxed);
+}
+
+void metrics_count_read(int result) {
+    /* DHT_SUCCESS is 0, the errors count down from -1 */
+    int index = result <= 0 && result > -(METRICS_READ_RESULTS - 1) ? -result : METRICS_READ_RESULTS - 1;
+    atomic_fetch_add_explicit(&reads[index], 1, memory_order_relaxed);
+}
+
+unsigned long metrics_counter_value(metrics_counter counter) {
+    return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+}
+
+/* Copy the buckets, returns their total */
+static uint64_t snapshot(metrics_histogram which, uint64_t* buckets) {
+    uint64_t total = 0;
+    size_t i;
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        buckets[i] = atomic_load_explicit(&histograms[which].buckets[i], memory_order_relaxed);
+        total += buckets[i];
+    }
+    return total;
+}
+
+/* Top of the bucket holding the quantile, but no more than the largest value */
+static uint64_t quantile(metrics_histogram which, const uint64_t* buckets, uint64_t total, double q) {
+    uint64_t rank = (uint64_t)(q * total + 0.5), seen = 0;
+    uint64_t max = atomic_load_explicit(&histograms[which].max, memory_order_relaxed);
+    size_t i;
+    if (total == 0) {
+        return 0;
+    }
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return bucket_top(i) < max ? bucket_top(i) : max;
+}
+
+void metrics_get_histogram(metrics_histogram which, metrics_histogram_stats* stats) {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t total = snapshot(which, buckets);
+    stats->count = (unsigned long)total;
+    stats->sum = atomic_load_explicit(&histograms[which].sum, memory_order_relaxed);
+    stats->max = atomic_load_explicit(&histograms[which].max, memory_order_relaxed);
+    stats->p50 = quantile(which, buckets, total, 0.5);
+    stats->p99 = quantile(which, buckets, total, 0.99);
+}
+
+static void writer_printf(metrics_writer* writer, const char* format, ...) {
+    va_list args;
+    for (;;) {
+        size_t room = writer->size - writer->length;
+        va_start(args, format);
+        int needed = vsnprintf(writer->text + writer->length, room, format, args);
+        va_end(args);
+        if (needed < 0) {
+            return;
+        }
+        if ((size_t)needed < room) {
+            writer->length += (size_t)needed;
+            return;
+        }
+        size_t size = writer->size * 2 > writer->length + needed + 1 ? writer->size * 2 : writer->length + needed + 1;
+        char* text = realloc(writer->text, size);
+        if (text == NULL) {
+            /* Keep what fits, the scrape is cut short */
+            return;
+        }
+        writer->text = text;
+        writer->size = size;
+    }
+}
+
+static void write_family(metrics_writer* writer, const char* name, const char* type, const char* help) {
+    if (strcmp(writer->family, name) == 0) {
+        return;
+    }
+    snprintf(writer->family, sizeof(writer->family), "%s", name);
+    writer_printf(writer, "# HELP %s %s\n# TYPE %s %s\n", name, help ? help : "", name, type);
+}
+
+void metrics_write(metrics_writer* writer, const char* name, const char* type, const char* help,
+        const char* labels, double value) {
+    write_family(writer, name, type, help);
+    if (labels) {
+        writer_printf(writer, "%s{%s} %.15g\n", name, labels, value);
+    } else {
+        writer_printf(writer, "%s %.15g\n", name, value);
+    }
+}
+
+static void write_histogram(metrics_writer* writer, metrics_histogram which) {
+    static uint64_t buckets[METRICS_BUCKETS];
+    const histogram_export* export = &exports[which];
+    uint64_t total = snapshot(which, buckets), below = 0;
+    uint64_t bound = export->first_bound;
+    size_t i = 0, q;
+    int decade, step;
+
+    write_family(writer, export->name, "histogram", export->help);
+    for (decade = 0; decade < export->decades; decade++, bound *= 10) {
+        for (step = 0; step < 3; step++) {
+            uint64_t le = bound * (step == 0 ? 1 : step == 1 ? 2 : 5);
+            for (; i < METRICS_BUCKETS && bucket_top(i) <= le; i++) {
+                below += buckets[i];
+            }
+            writer_printf(writer, "%s_bucket{le=\"%.9g\"} %llu\n", export->name, le / 1e9, (unsigned long long)below);
+        }
+    }
+    writer_printf(writer, "%s_bucket{le=\"+Inf\"} %llu\n", export->name, (unsigned long long)total);
+    writer_printf(writer, "%s_sum %.9g\n", export->name,
+            atomic_load_explicit(&histograms[which].sum, memory_order_relaxed) / 1e9);
+    writer_printf(writer, "%s_count %llu\n", export->name, (unsigned long long)total);
+
+    write_family(writer, export->quantiles, "gauge", "Percentiles of the histogram of the same name");
+    for (q = 0; q < sizeof(quantile_points) / sizeof(quantile_points[0]); q++) {
+        writer_printf(writer, "%s{quantile=\"%g\"} %.9g\n", export->quantiles, quantile_points[q],
+                quantile(which, buckets, total, quantile_points[q]) / 1e9);
+    }
+}
+
+static void render(metrics_writer* writer) {
+    char labels[32];
+    int i;
+    writer->length = 0;
+    writer->family[0] = '\0';
+    for (i = 0; i < METRIC_HISTOGRAMS; i++) {
+        write_histogram(writer, (metrics_histogram)i);
+    }
+    for (i = 0; i < METRIC_COUNTERS; i++) {
+        metrics_write(writer, counter_exports[i].name, "counter", counter_exports[i].help, NULL,
+                (double)atomic_load_explicit(&counters[i], memory_order_relaxed));
+    }
+    for (i = 0; i < METRICS_READ_RESULTS; i++) {
+        snprintf(labels, sizeof(labels), "result=\"%s\"", read_results[i]);
+        metrics_write(writer, "dht_reads_total", "counter", "Reads of the DHT sensor by result", labels,
+                (double)atomic_load_explicit(&reads[i], memory_order_relaxed));
+    }
+    if (collect) {
+        collect(writer);
+    }
+}
+
+static int send_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return 0;
+}
+
+static void serve(int fd) {
+    char request[METRICS_REQUEST_MAX + 1];
+    char header[160];
+    size_t length = 0;
+    struct timeval timeout = { METRICS_CLIENT_TIMEOUT_MS / 1000, (METRICS_CLIENT_TIMEOUT_MS % 1000) * 1000 };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    /* Only the request line matters, the headers are read and ignored */
+    while (length < METRICS_REQUEST_MAX) {
+        ssize_t got = recv(fd, request + length, METRICS_REQUEST_MAX - length, 0);
+        if (got <= 0) {
+            return;
+        }
+        length += (size_t)got;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+            break;
+        }
+    }
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET /metrics?", 13) != 0) {
+        static const char not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+                "Content-Length: 10\r\nConnection: close\r\n\r\nNot found\n";
+        send_all(fd, not_found, sizeof(not_found) - 1);
+        return;
+    }
+    render(&scrape);
+    int header_length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n", scrape.length);
+    if (send_all(fd, header, (size_t)header_length) == 0) {
+        send_all(fd, scrape.text, scrape.length);
+    }
+}
+
+static void* metrics_main(void* arg) {
+    (void)arg;
+    struct pollfd fds[2];
+    fds[0].fd = stop_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = listen_fd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs: Error, metrics server poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        /* Scrapes come from the local Prometheus agent, one at a time */
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            serve(fd);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+static void close_sockets(void) {
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if (stop_fd >= 0) {
+        close(stop_fd);
+        stop_fd = -1;
+    }
+}
+
+int metrics_server_start(uint16_t port, metrics_collector collector) {
+    struct sockaddr_in address;
+    int one = 1;
+
+    collect = collector;
+    scrape.size = 16 * 1024;
+    scrape.length = 0;
+    scrape.text = malloc(scrape.size);
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (scrape.text == NULL || listen_fd < 0 || stop_fd < 0) {
+        close_sockets();
+        free(scrape.text);
+        scrape.text = NULL;
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, 4) != 0 ||
+            pthread_create(&thread, NULL, metrics_main, NULL) != 0) {
+        close_sockets();
+        free(scrape.text);
+        scrape.text = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_server_stop(void) {
+    uint64_t one = 1;
+    if (listen_fd < 0) {
+        return;
+    }
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        /* Cannot happen with a fresh eventfd */
+    }
+    pthread_join(thread, NULL);
+    close_sockets();
+    free(scrape.text);
+    scrape.text = NULL;
+}
@@ -0,0 +1,115 @@
+/*
+ * Latency histograms and counters, exported for Prometheus.
+ *
+ * Histograms are HDR style: a value falls into one of a fixed set of
+ * buckets, linear below 128 ns and then 64 per power of two, so every
+ * quantile is known to within 1.6% from a few microseconds to half an
+ * hour. Recording is an atomic add into static arrays, with no lock and
+ * no allocation, and is safe from any thread including the real-time
+ * sensor thread.
+ *
+ * The metrics server answers GET /metrics on 127.0.0.1 with the Prometheus
+ * text format: each histogram with buckets on a 1-2-5 grid of seconds and
+ * its 50th, 90th, 99th and 99.9th percentile, the counters, and whatever
+ * the collector callback adds, such as queue depths read from the other
+ * modules at scrape time.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    METRIC_DHT_READ,            /* one pi_2_dht_read */
+    METRIC_DECODE_MARGIN,       /* weakest bit's distance from the threshold, good reads */
+    METRIC_UPLOAD,              /* message queued to delivered */
+    METRIC_ENQUEUE,             /* virtual device update handed to the library, finish_update blocking */
+    METRIC_SAMPLE_TO_DELIVERY,  /* reading taken to accepted by the server */
+    METRIC_HISTOGRAMS
+} metrics_histogram;
+
+typedef enum {
+    METRIC_SAMPLES,             /* sampling periods started */
+    METRIC_FAILED_SAMPLES,      /* periods without a good reading after the retries */
+    METRIC_MISSED_PERIODS,      /* periods the event loop was too late for */
+    METRIC_RETRIES,             /* sensor reads repeated after bad data */
+    METRIC_COUNTERS
+} metrics_counter;
+
+typedef struct {
+    unsigned long count;
+    uint64_t sum;               /* ns */
+    uint64_t max;
+    uint64_t p50;               /* ns, 0 when empty */
+    uint64_t p99;
+} metrics_histogram_stats;
+
+/* Text of one scrape, grows in the metrics thread only */
+typedef struct {
+    char* text;
+    size_t length;
+    size_t size;
+    char family[64];            /* name of the last metric written */
+} metrics_writer;
+
+/*
+ * Called on the metrics thread at each scrape to add metrics of its own
+ * with metrics_write. Must only use what is safe from any thread.
+ */
+typedef void (*metrics_collector)(metrics_writer* writer);
+
+/*
+ * Record a value in ns.
+ */
+void metrics_record(metrics_histogram histogram, uint64_t value_ns);
+
+/*
+ * Record the time from a reading's event time (wall clock ms) until now in
+ * METRIC_SAMPLE_TO_DELIVERY. The wall clock is what spooled readings keep
+ * across restarts.
+ */
+void metrics_record_delivery(int64_t event_time_ms);
+
+/*
+ * Add to a counter.
+ */
+void metrics_add(metrics_counter counter, unsigned long count);
+
+/*
+ * Count the result of a sensor read, DHT_SUCCESS or a DHT_ERROR_* code.
+ */
+void metrics_count_read(int result);
+
+unsigned long metrics_counter_value(metrics_counter counter);
+
+/*
+ * Count, sum, max and two percentiles of a histogram, thread safe.
+ */
+void metrics_get_histogram(metrics_histogram histogram, metrics_histogram_stats* stats);
+
+/*
+ * Append a sample to the scrape, for collectors.
+ * @param type "counter" or "gauge"
+ * @param labels e.g. "state=\"pending\"", NULL for none. Metrics with
+ * several label sets are written one after the other with the same
+ * name, the help and type lines are only written for the first, later
+ * ones may pass NULL for help.
+ */
+void metrics_write(metrics_writer* writer, const char* name, const char* type, const char* help,
+        const char* labels, double value);
+
+/*
+ * Serve the metrics on 127.0.0.1:port from a thread of its own.
+ * collector may be NULL.
+ * Returns 0 on success, -1 if the socket or thread could not be set up.
+ */
+int metrics_server_start(uint16_t port, metrics_collector collector);
+
+/*
+ * Stop the metrics thread and close the socket.
+ */
+void metrics_server_stop(void);
+
+#endif /* METRICS_H */
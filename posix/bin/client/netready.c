@@ -0,0 +1,133 @@
+/*
+ * Network readiness, see netready.h
+ */
+
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+#include "common_dht_read.h"
+#include "netready.h"
+
+static int netlink_fd = -1;
+static const char* server_host;
+
+/* A default route in /proc/net/route (IPv4) or /proc/net/ipv6_route */
+static int has_default_route(void) {
+    char line[256];
+    int found = 0;
+    FILE* routes = fopen("/proc/net/route", "r");
+    if (routes) {
+        char iface[64];
+        unsigned int destination, gateway, flags;
+        while (!found && fgets(line, sizeof(line), routes)) {
+            if (sscanf(line, "%63s %x %x %x", iface, &destination, &gateway, &flags) == 4 &&
+                    destination == 0 && (flags & 0x1)) {      /* RTF_UP */
+                found = 1;
+            }
+        }
+        fclose(routes);
+    }
+    routes = found ? NULL : fopen("/proc/net/ipv6_route", "r");
+    if (routes) {
+        char destination[33], iface[64];
+        unsigned int prefix, flags;
+        while (!found && fgets(line, sizeof(line), routes)) {
+            /* dest prefix src prefix next_hop metric refcnt use flags iface */
+            if (sscanf(line, "%32s %x %*s %*x %*s %*x %*x %*x %x %63s",
+                    destination, &prefix, &flags, iface) == 4 &&
+                    prefix == 0 && strcmp(iface, "lo") != 0 && (flags & 0x1) &&
+                    strspn(destination, "0") == 32) {
+                found = 1;
+            }
+        }
+        fclose(routes);
+    }
+    return found;
+}
+
+static int host_resolves(void) {
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    if (getaddrinfo(server_host, NULL, &hints, &result) != 0) {
+        return 0;
+    }
+    freeaddrinfo(result);
+    return 1;
+}
+
+int netready_open(const char* host) {
+    struct sockaddr_nl address;
+    server_host = host;
+    netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (netlink_fd < 0) {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE |
+            RTMGRP_IPV6_IFADDR | RTMGRP_IPV6_ROUTE;
+    if (bind(netlink_fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(netlink_fd);
+        netlink_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int netready_check(void) {
+    if (!has_default_route()) {
+        return 0;
+    }
+    /* Resolving before there is a route would only wait for a timeout */
+    return server_host == NULL || host_resolves();
+}
+
+/* Throw away queued notifications, they only say "look again" */
+static void drain(void) {
+    char buffer[4096];
+    while (recv(netlink_fd, buffer, sizeof(buffer), 0) > 0) {
+        /* until EAGAIN */
+    }
+}
+
+int netready_wait(int timeout_ms) {
+    uint64_t deadline = monotonic_nanoseconds() + (uint64_t)(timeout_ms < 0 ? 0 : timeout_ms) * 1000000ULL;
+    for (;;) {
+        if (netready_check()) {
+            return 0;
+        }
+        int wait_ms = NETREADY_RECHECK_MS;
+        if (timeout_ms >= 0) {
+            uint64_t now = monotonic_nanoseconds();
+            if (now >= deadline) {
+                return -1;
+            }
+            if ((deadline - now) / 1000000ULL < (uint64_t)wait_ms) {
+                wait_ms = (int)((deadline - now) / 1000000ULL) + 1;
+            }
+        }
+        if (netlink_fd >= 0) {
+            struct pollfd pfd = { netlink_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, wait_ms) > 0) {
+                drain();
+            }
+        } else {
+            usleep(wait_ms * 1000);
+        }
+    }
+}
+
+void netready_close(void) {
+    if (netlink_fd >= 0) {
+        close(netlink_fd);
+        netlink_fd = -1;
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * Wait for the network to be usable instead of for a fixed time.
+ *
+ * The network counts as ready once there is a default route and, when a
+ * server host is given, that host resolves. Route and address changes are
+ * followed through a netlink socket so the check reruns as soon as
+ * something changes, with a periodic recheck for DNS coming up late.
+ */
+
+#ifndef NETREADY_H
+#define NETREADY_H
+
+/* Recheck interval when netlink stays quiet, for DNS that comes up late */
+#define NETREADY_RECHECK_MS 2000
+
+/*
+ * Environment variable naming the server host to resolve. The host in the
+ * trusted assets store is encrypted and only the client library can read
+ * it, so it is given again here.
+ */
+#define NETREADY_HOST_ENV "IOTCS_SERVER_HOST"
+
+/*
+ * Start watching the network.
+ * @param host server host that must resolve, NULL to only wait for a route
+ * Returns 0 on success, -1 if the netlink socket could not be opened (the
+ * wait then falls back to polling).
+ */
+int netready_open(const char* host);
+
+/*
+ * Check once whether the network is ready. Returns 1 if it is.
+ */
+int netready_check(void);
+
+/*
+ * Wait until the network is ready.
+ * @param timeout_ms longest wait in milliseconds, -1 to wait forever
+ * Returns 0 when ready, -1 on timeout.
+ */
+int netready_wait(int timeout_ms);
+
+/*
+ * Stop watching the network.
+ */
+void netready_close(void);
+
+#endif /* NETREADY_H */
@@ -0,0 +1,393 @@
+/*
+ * Local query endpoint, see query_server.h
+ *
+ * One thread polls the listening socket and the connections, which are
+ * all non-blocking. A connection is either reading its next request or
+ * sending: the rest of a frame the socket would not take, or the next
+ * frame of a range. Each poll round sends a few frames per connection at
+ * most, so a long range does not hold up a latest query on another one.
+ *
+ * The latest reading is kept as two words under a sequence count the
+ * publisher makes odd while it writes. A reader retries if the count was
+ * odd or changed, which happens only when a reading is published at that
+ * very moment.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "log_sink.h"
+#include "query_server.h"
+
+/* Frames sent to one connection per poll round */
+#define QUERY_FRAMES_PER_ROUND 4
+#define QUERY_OUT_SIZE (sizeof(query_frame) + QUERY_FRAME_POINTS * sizeof(query_rollup))
+
+typedef struct {
+    int fd;                             /* -1 = free */
+    uint8_t request[sizeof(query_request)];
+    size_t request_length;
+    query_request range;                /* being streamed, type 0 = none */
+    uint64_t remaining;                 /* records still allowed */
+    tsdb_cursor* cursor;                /* allocated on the first QUERY_RANGE */
+    uint8_t* out;
+    size_t out_length;
+    size_t out_sent;
+} query_client;
+
+static query_server_config config;
+static char socket_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static int listen_fd = -1;
+static int stop_fd = -1;
+static pthread_t thread;
+static query_client clients[QUERY_SERVER_CLIENTS];
+
+/* Latest reading: event time, and temperature and humidity bits */
+static atomic_uint snapshot_sequence;
+static atomic_uint_least64_t snapshot_time;
+static atomic_uint_least64_t snapshot_values;
+
+static atomic_ulong connections;
+static atomic_ulong refused;
+static atomic_ulong latest;
+static atomic_ulong ranges;
+static atomic_ulong records;
+static atomic_ulong errors;
+
+void query_server_publish(const sensor_reading* reading) {
+    uint32_t temperature, humidity;
+    unsigned int sequence = atomic_load_explicit(&snapshot_sequence, memory_order_relaxed);
+    memcpy(&temperature, &reading->temperature, sizeof(temperature));
+    memcpy(&humidity, &reading->humidity, sizeof(humidity));
+    atomic_store_explicit(&snapshot_sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&snapshot_time, (uint64_t)reading->event_time, memory_order_relaxed);
+    atomic_store_explicit(&snapshot_values, (uint64_t)temperature << 32 | humidity, memory_order_relaxed);
+    atomic_store_explicit(&snapshot_sequence, sequence + 2, memory_order_release);
+}
+
+/* Returns 0 with the latest reading in out, -1 if there is none yet */
+static int read_snapshot(query_reading* out) {
+    unsigned int before, after;
+    uint64_t time, values;
+    do {
+        before = atomic_load_explicit(&snapshot_sequence, memory_order_acquire);
+        time = atomic_load_explicit(&snapshot_time, memory_order_relaxed);
+        values = atomic_load_explicit(&snapshot_values, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&snapshot_sequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    if (time == 0) {
+        return -1;
+    }
+    uint32_t temperature = (uint32_t)(values >> 32), humidity = (uint32_t)values;
+    out->time = (int64_t)time;
+    memcpy(&out->temperature, &temperature, sizeof(out->temperature));
+    memcpy(&out->humidity, &humidity, sizeof(out->humidity));
+    return 0;
+}
+
+/* Put a frame header in front of count records already in the buffer */
+static void put_frame(query_client* client, uint16_t type, uint16_t status, uint32_t count, size_t record_size) {
+    query_frame frame = { type, status, count };
+    memcpy(client->out, &frame, sizeof(frame));
+    client->out_length = sizeof(frame) + count * record_size;
+    client->out_sent = 0;
+}
+
+static void fill_readings(query_client* client, size_t want) {
+    int64_t times[QUERY_FRAME_POINTS];
+    float temperature[QUERY_FRAME_POINTS];
+    float humidity[QUERY_FRAME_POINTS];
+    query_reading* out = (query_reading*)(client->out + sizeof(query_frame));
+    size_t i, count = tsdb_cursor_next(client->cursor, times, temperature, humidity, want);
+    for (i = 0; i < count; i++) {
+        out[i].time = times[i];
+        out[i].temperature = temperature[i];
+        out[i].humidity = humidity[i];
+    }
+    put_frame(client, QUERY_RANGE, QUERY_OK, (uint32_t)count, sizeof(query_reading));
+}
+
+static void fill_rollups(query_client* client, size_t want) {
+    rollup_bucket buckets[QUERY_FRAME_POINTS];
+    query_rollup* out = (query_rollup*)(client->out + sizeof(query_frame));
+    size_t i, count = rollup_read(config.rollups, (rollup_level)client->range.level, client->range.from,
+            client->range.to, buckets, want);
+    for (i = 0; i < count; i++) {
+        out[i].start = buckets[i].start;
+        out[i].length = (uint32_t)(buckets[i].length / 1000);
+        out[i].count = buckets[i].count;
+        out[i].temperature = buckets[i].temperature;
+        out[i].humidity = buckets[i].humidity;
+    }
+    if (count > 0) {
+        /* Carry on after the last bucket sent */
+        client->range.from = buckets[count - 1].start + 1;
+    }
+    put_frame(client, QUERY_ROLLUP, QUERY_OK, (uint32_t)count, sizeof(query_rollup));
+}
+
+/* Next frame of the range being streamed, the empty one ends it */
+static void fill_range(query_client* client) {
+    size_t want = client->remaining < QUERY_FRAME_POINTS ? (size_t)client->remaining : QUERY_FRAME_POINTS;
+    if (want == 0) {
+        put_frame(client, client->range.type, QUERY_OK, 0, 0);
+    } else if (client->range.type == QUERY_RANGE) {
+        fill_readings(client, want);
+    } else {
+        fill_rollups(client, want);
+    }
+    query_frame* frame = (query_frame*)client->out;
+    client->remaining -= frame->count;
+    atomic_fetch_add(&records, frame->count);
+    if (frame->count == 0) {
+        if (client->range.type == QUERY_RANGE) {
+            tsdb_cursor_close(client->cursor);
+        }
+        client->range.type = 0;
+        atomic_fetch_add(&ranges, 1);
+    }
+}
+
+static void answer_error(query_client* client, uint16_t type, query_status status) {
+    put_frame(client, type, (uint16_t)status, 0, 0);
+    atomic_fetch_add(&errors, 1);
+}
+
+static void answer(query_client* client) {
+    query_request request;
+    memcpy(&request, client->request, sizeof(request));
+    if (request.type == QUERY_LATEST) {
+        query_reading* reading = (query_reading*)(client->out + sizeof(query_frame));
+        if (read_snapshot(reading) == 0) {
+            put_frame(client, QUERY_LATEST, QUERY_OK, 1, sizeof(query_reading));
+        } else {
+            put_frame(client, QUERY_LATEST, QUERY_NO_DATA, 0, 0);
+        }
+        atomic_fetch_add(&latest, 1);
+        return;
+    }
+    if ((request.type != QUERY_RANGE && request.type != QUERY_ROLLUP) || request.from > request.to ||
+            (request.type == QUERY_ROLLUP && request.level >= ROLLUP_LEVELS)) {
+        answer_error(client, request.type, QUERY_BAD_REQUEST);
+        return;
+    }
+    if ((request.type == QUERY_RANGE && config.history == NULL) ||
+            (request.type == QUERY_ROLLUP && config.rollups == NULL)) {
+        answer_error(client, request.type, QUERY_UNAVAILABLE);
+        return;
+    }
+    if (request.type == QUERY_RANGE) {
+        if (client->cursor == NULL && (client->cursor = malloc(sizeof(tsdb_cursor))) == NULL) {
+            answer_error(client, request.type, QUERY_UNAVAILABLE);
+            return;
+        }
+        tsdb_cursor_open(client->cursor, config.history, request.from, request.to);
+    }
+    client->range = request;
+    client->remaining = request.max ? request.max : UINT64_MAX;
+    fill_range(client);
+}
+
+static void close_client(query_client* client) {
+    if (client->range.type == QUERY_RANGE) {
+        tsdb_cursor_close(client->cursor);
+    }
+    close(client->fd);
+    free(client->cursor);
+    free(client->out);
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+}
+
+/* Send and answer what the socket allows, returns -1 to close it */
+static int serve(query_client* client) {
+    int frames = 0;
+    for (;;) {
+        if (client->out_sent < client->out_length) {
+            ssize_t sent = send(client->fd, client->out + client->out_sent, client->out_length - client->out_sent,
+                    MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+            }
+            client->out_sent += (size_t)sent;
+            continue;
+        }
+        if (client->range.type) {
+            if (++frames > QUERY_FRAMES_PER_ROUND) {
+                /* Let the other connections have a go */
+                return 0;
+            }
+            fill_range(client);
+            continue;
+        }
+        ssize_t got = recv(client->fd, client->request + client->request_length,
+                sizeof(client->request) - client->request_length, MSG_DONTWAIT);
+        if (got == 0) {
+            return -1;
+        }
+        if (got < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        client->request_length += (size_t)got;
+        if (client->request_length == sizeof(client->request)) {
+            client->request_length = 0;
+            answer(client);
+        }
+    }
+}
+
+static void accept_client(void) {
+    size_t i;
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    for (i = 0; i < QUERY_SERVER_CLIENTS; i++) {
+        if (clients[i].fd < 0) {
+            break;
+        }
+    }
+    uint8_t* out = i < QUERY_SERVER_CLIENTS ? malloc(QUERY_OUT_SIZE) : NULL;
+    if (out == NULL) {
+        close(fd);
+        atomic_fetch_add(&refused, 1);
+        return;
+    }
+    clients[i].fd = fd;
+    clients[i].out = out;
+    atomic_fetch_add(&connections, 1);
+}
+
+static void* query_server_main(void* arg) {
+    (void)arg;
+    struct pollfd fds[2 + QUERY_SERVER_CLIENTS];
+    query_client* polled[QUERY_SERVER_CLIENTS];
+    size_t i;
+
+    for (;;) {
+        nfds_t count = 2;
+        fds[0].fd = stop_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = listen_fd;
+        fds[1].events = POLLIN;
+        for (i = 0; i < QUERY_SERVER_CLIENTS; i++) {
+            query_client* client = &clients[i];
+            if (client->fd < 0) {
+                continue;
+            }
+            fds[count].fd = client->fd;
+            fds[count].events = client->out_sent < client->out_length || client->range.type ? POLLOUT : POLLIN;
+            polled[count - 2] = client;
+            count++;
+        }
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs: Error, query server poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        for (i = 2; i < count; i++) {
+            if (fds[i].revents && serve(polled[i - 2]) != 0) {
+                close_client(polled[i - 2]);
+            }
+        }
+        /* Last, a new connection may take a slot closed above */
+        if (fds[1].revents & POLLIN) {
+            accept_client();
+        }
+    }
+    return NULL;
+}
+
+static void close_sockets(void) {
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    if (stop_fd >= 0) {
+        close(stop_fd);
+        stop_fd = -1;
+    }
+}
+
+int query_server_start(const query_server_config* server) {
+    struct sockaddr_un address;
+    size_t i;
+
+    config = *server;
+    if (config.path == NULL || strlen(config.path) >= sizeof(socket_path)) {
+        return -1;
+    }
+    snprintf(socket_path, sizeof(socket_path), "%s", config.path);
+    for (i = 0; i < QUERY_SERVER_CLIENTS; i++) {
+        memset(&clients[i], 0, sizeof(clients[i]));
+        clients[i].fd = -1;
+    }
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (listen_fd < 0 || stop_fd < 0) {
+        close_sockets();
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, socket_path, strlen(socket_path));
+    /* Left behind by a run that did not stop cleanly */
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, QUERY_SERVER_CLIENTS) != 0) {
+        close_sockets();
+        return -1;
+    }
+    /* Members of the group may query */
+    chmod(socket_path, 0660);
+    if (pthread_create(&thread, NULL, query_server_main, NULL) != 0) {
+        close_sockets();
+        unlink(socket_path);
+        return -1;
+    }
+    return 0;
+}
+
+void query_server_get_stats(query_server_stats* stats) {
+    stats->connections = atomic_load(&connections);
+    stats->refused = atomic_load(&refused);
+    stats->latest = atomic_load(&latest);
+    stats->ranges = atomic_load(&ranges);
+    stats->records = atomic_load(&records);
+    stats->errors = atomic_load(&errors);
+}
+
+void query_server_stop(void) {
+    size_t i;
+    uint64_t one = 1;
+    if (listen_fd < 0) {
+        return;
+    }
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        /* Cannot happen with a fresh eventfd */
+    }
+    pthread_join(thread, NULL);
+    for (i = 0; i < QUERY_SERVER_CLIENTS; i++) {
+        if (clients[i].fd >= 0) {
+            close_client(&clients[i]);
+        }
+    }
+    close_sockets();
+    unlink(socket_path);
+}
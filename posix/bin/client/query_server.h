@@ -0,0 +1,119 @@
+/*
+ * Local query endpoint on a UNIX domain socket.
+ *
+ * Other processes on the device ask here for the latest reading, or for
+ * the readings and rollups of a time range, instead of reading the
+ * sensor themselves. The latest reading is published by the event loop
+ * under a sequence lock, so answering never waits for the sensor, the
+ * network or the writer. Ranges are streamed from the history in frames
+ * of at most QUERY_FRAME_POINTS records, a client that reads slowly
+ * holds up only itself.
+ *
+ * The protocol is binary in host byte order, the socket does not leave
+ * the device. A client writes query_request structs, requests on one
+ * connection are answered in order. Every answer is one or more frames,
+ * a query_frame header followed by count records:
+ *
+ *   QUERY_LATEST  one frame, count 1 and a query_reading record, or
+ *                 count 0 and QUERY_NO_DATA before the first reading
+ *   QUERY_RANGE   frames of query_reading records, time order, at most
+ *                 max records in all (0 = no limit), closed by a frame
+ *                 with count 0
+ *   QUERY_ROLLUP  the same with query_rollup records of the level given
+ *
+ * A request that cannot be answered gets a single frame with count 0 and
+ * the reason in status.
+ */
+
+#ifndef QUERY_SERVER_H
+#define QUERY_SERVER_H
+
+#include <stdint.h>
+#include "reading.h"
+#include "rollup.h"
+#include "tsdb.h"
+
+/* Most records in one frame */
+#define QUERY_FRAME_POINTS 1024
+/* Connections served at once, more are closed right away */
+#define QUERY_SERVER_CLIENTS 8
+
+typedef enum {
+    QUERY_LATEST = 1,
+    QUERY_RANGE = 2,
+    QUERY_ROLLUP = 3
+} query_type;
+
+typedef enum {
+    QUERY_OK = 0,
+    QUERY_NO_DATA = 1,          /* no reading yet */
+    QUERY_BAD_REQUEST = 2,      /* unknown type or level, from after to */
+    QUERY_UNAVAILABLE = 3       /* no history or rollups kept */
+} query_status;
+
+typedef struct {
+    uint16_t type;              /* query_type */
+    uint16_t level;             /* rollup_level, QUERY_ROLLUP only */
+    uint32_t max;               /* most records to return, 0 = all */
+    int64_t from;               /* ms since the epoch, inclusive */
+    int64_t to;
+} query_request;
+
+typedef struct {
+    uint16_t type;              /* of the request answered */
+    uint16_t status;            /* query_status */
+    uint32_t count;             /* records following */
+} query_frame;
+
+typedef struct {
+    int64_t time;               /* ms since the epoch */
+    float temperature;
+    float humidity;
+} query_reading;
+
+typedef struct {
+    int64_t start;              /* ms since the epoch */
+    uint32_t length;            /* secs */
+    uint32_t count;             /* readings in the bucket */
+    rollup_summary temperature;
+    rollup_summary humidity;
+} query_rollup;
+
+typedef struct {
+    const char* path;           /* socket, replaced if it exists */
+    tsdb* history;              /* for QUERY_RANGE, NULL = none */
+    rollup* rollups;            /* for QUERY_ROLLUP, NULL = none */
+} query_server_config;
+
+typedef struct {
+    unsigned long connections;  /* accepted */
+    unsigned long refused;      /* closed at once, too many connections */
+    unsigned long latest;       /* QUERY_LATEST answered */
+    unsigned long ranges;       /* QUERY_RANGE and QUERY_ROLLUP answered */
+    unsigned long records;      /* range records sent */
+    unsigned long errors;       /* requests answered with an error status */
+} query_server_stats;
+
+/*
+ * Start serving on config->path on a thread of its own.
+ * Returns 0 on success, -1 if the socket or thread could not be set up.
+ */
+int query_server_start(const query_server_config* config);
+
+/*
+ * Make reading the answer to QUERY_LATEST. Must always be called from
+ * the same thread, never blocks.
+ */
+void query_server_publish(const sensor_reading* reading);
+
+/*
+ * Copy the counters into stats.
+ */
+void query_server_get_stats(query_server_stats* stats);
+
+/*
+ * Close all connections, stop the thread and remove the socket.
+ */
+void query_server_stop(void);
+
+#endif /* QUERY_SERVER_H */
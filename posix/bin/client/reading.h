@@ -0,0 +1,23 @@
+/*
+ * A single temperature/humidity sample taken from the DHT sensor.
+ */
+
+#ifndef READING_H
+#define READING_H
+
+#include <stdint.h>
+
+typedef struct {
+    int result;             /* DHT_SUCCESS or one of the DHT_ERROR_* codes */
+    int attempts;           /* number of sensor reads it took */
+    float temperature;      /* degrees Celsius */
+    float humidity;         /* percent relative humidity */
+    int quality;            /* decode confidence 0-100, see dht_decode_info */
+    int repaired_bits;      /* bits the decoder flipped to pass the checksum */
+    uint32_t margin_us;     /* weakest bit's distance from the decode threshold */
+    uint64_t sample_ns;     /* monotonic time the sample was taken */
+    int64_t event_time;     /* wall clock time in milliseconds since the epoch */
+    int on_demand;          /* answers a readNow action, reported past the deadband */
+} sensor_reading;
+
+#endif /* READING_H */
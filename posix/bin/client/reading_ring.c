@@ -0,0 +1,201 @@
+/*
+ * Lock-free SPSC ring of sensor readings, see reading_ring.h
+ *
+ * head and tail count up forever and are masked to index the slots, so
+ * tail - head is the occupancy. The only place both threads write the same
+ * variable is drop-oldest, where the producer moves head forward with a
+ * compare-and-swap; the consumer copies a slot first and then claims it
+ * with a compare-and-swap too, and throws the copy away if it lost.
+ */
+
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "reading_ring.h"
+
+#define RING_MASK (READING_RING_CAPACITY - 1)
+
+static void signal_fd(int fd) {
+    uint64_t one = 1;
+    ssize_t n = write(fd, &one, sizeof(one));
+    (void)n;
+}
+
+static void wait_fd(int fd) {
+    uint64_t count;
+    ssize_t n = read(fd, &count, sizeof(count));
+    (void)n;
+}
+
+int reading_ring_init(reading_ring* ring, reading_ring_policy policy) {
+    memset(ring, 0, sizeof(*ring));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->policy = policy;
+    ring->data_fd = eventfd(0, EFD_CLOEXEC);
+    ring->space_fd = eventfd(0, EFD_CLOEXEC);
+    if (ring->data_fd < 0 || ring->space_fd < 0) {
+        reading_ring_destroy(ring);
+        return -1;
+    }
+    return 0;
+}
+
+static void note_occupancy(reading_ring* ring, size_t tail) {
+    size_t occupancy = tail - atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (occupancy > atomic_load_explicit(&ring->high_water, memory_order_relaxed)) {
+        atomic_store_explicit(&ring->high_water, (unsigned int)occupancy, memory_order_relaxed);
+    }
+}
+
+/* Store into a free slot, the caller made sure there is one */
+static void publish(reading_ring* ring, size_t tail, const sensor_reading* reading) {
+    ring->slots[tail & RING_MASK] = *reading;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    note_occupancy(ring, tail + 1);
+    signal_fd(ring->data_fd);
+}
+
+static int has_room(reading_ring* ring, size_t tail) {
+    if (tail - ring->cached_head < READING_RING_CAPACITY) {
+        return 1;
+    }
+    ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return tail - ring->cached_head < READING_RING_CAPACITY;
+}
+
+static void push_drop_oldest(reading_ring* ring, size_t tail, const sensor_reading* reading) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    while (tail - head >= READING_RING_CAPACITY) {
+        /* Claim the oldest slot before overwriting it, a failed exchange
+         * means the consumer took it and reloads head */
+        if (atomic_compare_exchange_weak_explicit(&ring->head, &head, head + 1,
+                memory_order_acq_rel, memory_order_acquire)) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            head++;
+        }
+    }
+    ring->cached_head = head;
+    publish(ring, tail, reading);
+}
+
+static void push_block(reading_ring* ring, size_t tail, const sensor_reading* reading) {
+    if (!has_room(ring, tail)) {
+        atomic_fetch_add_explicit(&ring->blocked, 1, memory_order_relaxed);
+        atomic_store(&ring->producer_waiting, 1);
+        /* Pairs with the fence in reading_ring_pop, either the consumer sees
+         * the flag or this side sees the freed slot */
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!has_room(ring, tail)) {
+            wait_fd(ring->space_fd);
+        }
+        atomic_store(&ring->producer_waiting, 0);
+    }
+    publish(ring, tail, reading);
+}
+
+void reading_ring_push(reading_ring* ring, const sensor_reading* reading) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ring->pushed, 1, memory_order_relaxed);
+    switch (ring->policy) {
+        case READING_RING_DROP_OLDEST:
+            push_drop_oldest(ring, tail, reading);
+            break;
+        case READING_RING_BLOCK:
+            push_block(ring, tail, reading);
+            break;
+        case READING_RING_COALESCE:
+            /* Keep order: a held back reading goes in before this one */
+            if (!reading_ring_flush_pending(ring)) {
+                tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+                if (has_room(ring, tail)) {
+                    publish(ring, tail, reading);
+                    break;
+                }
+            }
+            if (ring->has_pending) {
+                atomic_fetch_add_explicit(&ring->coalesced, 1, memory_order_relaxed);
+            }
+            ring->pending = *reading;
+            ring->has_pending = 1;
+            break;
+    }
+}
+
+int reading_ring_flush_pending(reading_ring* ring) {
+    if (!ring->has_pending) {
+        return 0;
+    }
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (!has_room(ring, tail)) {
+        return 1;
+    }
+    ring->has_pending = 0;
+    publish(ring, tail, &ring->pending);
+    return 0;
+}
+
+int reading_ring_pop(reading_ring* ring, sensor_reading* reading) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (;;) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head == tail) {
+            return 0;
+        }
+        *reading = ring->slots[head & RING_MASK];
+        if (ring->policy != READING_RING_DROP_OLDEST) {
+            /* Only this thread moves head */
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+            break;
+        }
+        if (atomic_compare_exchange_strong_explicit(&ring->head, &head, head + 1,
+                memory_order_acq_rel, memory_order_acquire)) {
+            break;
+        }
+        /* The producer dropped this slot and may be rewriting it, the copy is
+         * no good and head has been reloaded */
+    }
+    atomic_fetch_add_explicit(&ring->popped, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&ring->producer_waiting)) {
+        signal_fd(ring->space_fd);
+    }
+    return 1;
+}
+
+void reading_ring_wait(reading_ring* ring, int timeout_ms) {
+    struct pollfd pfd = { ring->data_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        wait_fd(ring->data_fd);
+    }
+}
+
+void reading_ring_wake(reading_ring* ring) {
+    signal_fd(ring->data_fd);
+}
+
+void reading_ring_get_stats(reading_ring* ring, reading_ring_stats* stats) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    stats->pushed = atomic_load_explicit(&ring->pushed, memory_order_relaxed);
+    stats->popped = atomic_load_explicit(&ring->popped, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    stats->coalesced = atomic_load_explicit(&ring->coalesced, memory_order_relaxed);
+    stats->blocked = atomic_load_explicit(&ring->blocked, memory_order_relaxed);
+    stats->high_water = atomic_load_explicit(&ring->high_water, memory_order_relaxed);
+    /* head may pass a stale tail when read from a third thread */
+    stats->occupancy = tail > head ? (unsigned int)(tail - head) : 0;
+}
+
+void reading_ring_destroy(reading_ring* ring) {
+    if (ring->data_fd >= 0) {
+        close(ring->data_fd);
+    }
+    if (ring->space_fd >= 0) {
+        close(ring->space_fd);
+    }
+    ring->data_fd = -1;
+    ring->space_fd = -1;
+}
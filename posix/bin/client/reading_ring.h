@@ -0,0 +1,108 @@
+/*
+ * Lock-free single producer, single consumer ring of sensor readings.
+ *
+ * The event loop thread pushes readings and the upload thread pops them.
+ * Head and tail live on cache lines of their own so the two threads do not
+ * bounce a shared line on every operation. What happens when the ring is
+ * full is chosen by the overflow policy.
+ */
+
+#ifndef READING_RING_H
+#define READING_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include "reading.h"
+
+/* Number of slots, must be a power of two */
+#define READING_RING_CAPACITY 64
+#define READING_RING_CACHE_LINE 64
+
+typedef enum {
+    /* Overwrite the oldest unread reading, the consumer never sees it */
+    READING_RING_DROP_OLDEST,
+    /* Make the producer wait until the consumer frees a slot */
+    READING_RING_BLOCK,
+    /* Keep only the newest reading aside until a slot frees up */
+    READING_RING_COALESCE
+} reading_ring_policy;
+
+typedef struct {
+    unsigned long pushed;       /* readings offered by the producer */
+    unsigned long popped;       /* readings taken by the consumer */
+    unsigned long dropped;      /* readings overwritten, drop-oldest */
+    unsigned long coalesced;    /* readings replaced by a newer one, coalesce */
+    unsigned long blocked;      /* pushes that had to wait, block */
+    unsigned int occupancy;     /* readings in the ring right now */
+    unsigned int high_water;    /* largest occupancy seen */
+} reading_ring_stats;
+
+typedef struct {
+    /* Consumer side */
+    _Alignas(READING_RING_CACHE_LINE) atomic_size_t head;
+    atomic_ulong popped;
+    int data_fd;                        /* eventfd, readable after a push */
+    /* Producer side */
+    _Alignas(READING_RING_CACHE_LINE) atomic_size_t tail;
+    size_t cached_head;                 /* producer's last look at head */
+    reading_ring_policy policy;
+    int space_fd;                       /* eventfd, consumer frees a slot */
+    atomic_int producer_waiting;
+    int has_pending;                    /* coalesce slot in use */
+    sensor_reading pending;
+    atomic_ulong pushed;
+    atomic_ulong dropped;
+    atomic_ulong coalesced;
+    atomic_ulong blocked;
+    atomic_uint high_water;
+    /* Shared */
+    _Alignas(READING_RING_CACHE_LINE) sensor_reading slots[READING_RING_CAPACITY];
+} reading_ring;
+
+/*
+ * Prepare ring for use with the given overflow policy.
+ * Returns 0 on success, -1 if the wakeup descriptors could not be created.
+ */
+int reading_ring_init(reading_ring* ring, reading_ring_policy policy);
+
+/*
+ * Producer: add a reading, applying the overflow policy when the ring is
+ * full. Only blocks with READING_RING_BLOCK.
+ */
+void reading_ring_push(reading_ring* ring, const sensor_reading* reading);
+
+/*
+ * Producer: move a coalesced reading into the ring if there is room now.
+ * Returns 1 if a reading is still held back, 0 otherwise.
+ */
+int reading_ring_flush_pending(reading_ring* ring);
+
+/*
+ * Consumer: take the oldest reading.
+ * Returns 1 and fills in reading, or 0 if the ring is empty.
+ */
+int reading_ring_pop(reading_ring* ring, sensor_reading* reading);
+
+/*
+ * Consumer: wait until a push may have happened. Returns at once if one
+ * did since the last call. Also returns after reading_ring_wake.
+ * @param timeout_ms longest wait in milliseconds, -1 to wait forever
+ */
+void reading_ring_wait(reading_ring* ring, int timeout_ms);
+
+/*
+ * Wake a consumer sleeping in reading_ring_wait.
+ */
+void reading_ring_wake(reading_ring* ring);
+
+/*
+ * Snapshot of the counters, safe from any thread.
+ */
+void reading_ring_get_stats(reading_ring* ring, reading_ring_stats* stats);
+
+/*
+ * Release the wakeup descriptors.
+ */
+void reading_ring_destroy(reading_ring* ring);
+
+#endif /* READING_RING_H */
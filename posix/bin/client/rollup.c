@@ -0,0 +1,358 @@
+/*
+ * Minute, hour and day summaries, see rollup.h
+ *
+ * Each level has a file of its own:
+ *
+ *   header  magic, version, level, ring capacity, next slot, slots used,
+ *           the open bucket's count, start and accumulators
+ *   ring    capacity records of 24 bytes, the oldest overwritten first
+ *
+ * A record has the bucket's start in minutes since the epoch, its count,
+ * and min, max, mean and standard deviation of both values in hundredths,
+ * which is finer than the sensor reports and keeps a year of hours under
+ * a quarter of a megabyte.
+ *
+ * The open bucket is updated in the mapping on every reading, the files
+ * are derived data and one that does not check out is started over.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rollup.h"
+
+#define ROLLUP_MAGIC 0x504c4c52u    /* "RLLP" */
+#define ROLLUP_VERSION 1
+#define ROLLUP_HEADER_SIZE 128
+
+typedef struct {
+    double mean;
+    double m2;                  /* sum of squared distances from the mean */
+    float min;
+    float max;
+} accumulator;
+
+typedef struct {
+    int64_t start;              /* ms since the epoch */
+    uint32_t count;             /* 0 = no open bucket */
+    uint32_t reserved;
+    accumulator temperature;
+    accumulator humidity;
+} open_bucket;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t level;
+    uint32_t capacity;          /* records in the ring */
+    uint32_t next;              /* slot the next closed bucket goes to */
+    uint32_t stored;            /* slots in use */
+    uint32_t reserved;
+    open_bucket open;
+    uint8_t padding[ROLLUP_HEADER_SIZE - 24 - sizeof(open_bucket)];
+} file_header;
+
+typedef struct {
+    uint32_t start;             /* minutes since the epoch */
+    uint32_t count;
+    int16_t temperature[3];     /* min, max, mean in hundredths */
+    uint16_t temperature_stddev;
+    int16_t humidity[3];
+    uint16_t humidity_stddev;
+} record;
+
+static const int64_t level_length[ROLLUP_LEVELS] = { 60 * 1000LL, 3600 * 1000LL, 24 * 3600 * 1000LL };
+static const uint32_t level_keep[ROLLUP_LEVELS] = { ROLLUP_MINUTE_KEEP, ROLLUP_HOUR_KEEP, ROLLUP_DAY_KEEP };
+static const char* level_names[ROLLUP_LEVELS] = { "minute", "hour", "day" };
+
+static file_header* header_of(rollup_file* file) {
+    return (file_header*)file->map;
+}
+
+static record* ring_of(rollup_file* file) {
+    return (record*)(file->map + ROLLUP_HEADER_SIZE);
+}
+
+/* Ring slot of the i-th oldest record */
+static uint32_t slot_of(const file_header* header, uint32_t i) {
+    return (header->next + header->capacity - header->stored + i) % header->capacity;
+}
+
+static void accumulate(accumulator* a, uint32_t count, float value) {
+    /* Welford: count already includes this value */
+    double delta = value - a->mean;
+    a->mean += delta / count;
+    a->m2 += delta * (value - a->mean);
+    if (count == 1 || value < a->min) {
+        a->min = value;
+    }
+    if (count == 1 || value > a->max) {
+        a->max = value;
+    }
+}
+
+static int16_t to_hundredths(double value) {
+    long scaled = lrint(value * 100.0);
+    return (int16_t)(scaled < INT16_MIN ? INT16_MIN : scaled > INT16_MAX ? INT16_MAX : scaled);
+}
+
+static uint16_t stddev_hundredths(const accumulator* a, uint32_t count) {
+    long scaled = lrint(sqrt(a->m2 > 0 ? a->m2 / count : 0) * 100.0);
+    return (uint16_t)(scaled > UINT16_MAX ? UINT16_MAX : scaled);
+}
+
+static void encode(const open_bucket* open, record* out) {
+    out->start = (uint32_t)(open->start / 60000);
+    out->count = open->count;
+    out->temperature[0] = to_hundredths(open->temperature.min);
+    out->temperature[1] = to_hundredths(open->temperature.max);
+    out->temperature[2] = to_hundredths(open->temperature.mean);
+    out->temperature_stddev = stddev_hundredths(&open->temperature, open->count);
+    out->humidity[0] = to_hundredths(open->humidity.min);
+    out->humidity[1] = to_hundredths(open->humidity.max);
+    out->humidity[2] = to_hundredths(open->humidity.mean);
+    out->humidity_stddev = stddev_hundredths(&open->humidity, open->count);
+}
+
+static void decode(rollup_level level, const record* in, rollup_bucket* out) {
+    out->level = level;
+    out->start = (int64_t)in->start * 60000;
+    out->length = level_length[level];
+    out->count = in->count;
+    out->temperature.min = in->temperature[0] / 100.0f;
+    out->temperature.max = in->temperature[1] / 100.0f;
+    out->temperature.mean = in->temperature[2] / 100.0f;
+    out->temperature.stddev = in->temperature_stddev / 100.0f;
+    out->humidity.min = in->humidity[0] / 100.0f;
+    out->humidity.max = in->humidity[1] / 100.0f;
+    out->humidity.mean = in->humidity[2] / 100.0f;
+    out->humidity.stddev = in->humidity_stddev / 100.0f;
+}
+
+/* Start of the bucket after the newest closed one, 0 if none */
+static int64_t closed_end(rollup_file* file, rollup_level level) {
+    file_header* header = header_of(file);
+    if (header->stored == 0) {
+        return 0;
+    }
+    record* newest = &ring_of(file)[slot_of(header, header->stored - 1)];
+    return (int64_t)newest->start * 60000 + level_length[level];
+}
+
+/* Move the open bucket into the ring, returns it decoded in bucket */
+static void close_bucket(rollup* r, rollup_level level, rollup_bucket* bucket) {
+    rollup_file* file = &r->files[level];
+    file_header* header = header_of(file);
+    record* slot = &ring_of(file)[header->next];
+    encode(&header->open, slot);
+    header->next = (header->next + 1) % header->capacity;
+    if (header->stored < header->capacity) {
+        header->stored++;
+    }
+    header->open.count = 0;
+    r->stats.closed[level]++;
+    decode(level, slot, bucket);
+}
+
+static int open_file(rollup* r, rollup_level level) {
+    char path[ROLLUP_PATH_MAX + 16];
+    struct stat st;
+    rollup_file* file = &r->files[level];
+    size_t size = ROLLUP_HEADER_SIZE + (size_t)level_keep[level] * sizeof(record);
+
+    snprintf(path, sizeof(path), "%s/%s.rlp", r->dir, level_names[level]);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    int fresh = (size_t)st.st_size != size;
+    if (fresh && ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return -1;
+    }
+    uint8_t* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    file_header* header = (file_header*)map;
+    if (!fresh && (header->magic != ROLLUP_MAGIC || header->version != ROLLUP_VERSION ||
+            header->level != level || header->capacity != level_keep[level] ||
+            header->next >= header->capacity || header->stored > header->capacity)) {
+        fresh = 1;
+    }
+    if (fresh) {
+        memset(header, 0, ROLLUP_HEADER_SIZE);
+        header->magic = ROLLUP_MAGIC;
+        header->version = ROLLUP_VERSION;
+        header->level = (uint16_t)level;
+        header->capacity = level_keep[level];
+    } else if (header->open.count > 0 && header->open.start % level_length[level] != 0) {
+        /* Torn write of the open bucket, lose it rather than the ring */
+        header->open.count = 0;
+    }
+    file->fd = fd;
+    file->map = map;
+    file->size = size;
+    return 0;
+}
+
+int rollup_open(rollup* r, const char* dir, rollup_handler handler, void* arg) {
+    int level;
+    memset(r, 0, sizeof(*r));
+    for (level = 0; level < ROLLUP_LEVELS; level++) {
+        r->files[level].fd = -1;
+    }
+    r->handler = handler;
+    r->handler_arg = arg;
+    pthread_mutex_init(&r->lock, NULL);
+    snprintf(r->dir, sizeof(r->dir), "%s", dir);
+    if (mkdir(r->dir, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    for (level = 0; level < ROLLUP_LEVELS; level++) {
+        if (open_file(r, (rollup_level)level) != 0) {
+            rollup_close(r);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void report_closed(rollup* r, const rollup_bucket* closed, size_t count) {
+    size_t i;
+    /* Outside the lock, the handler may hand the bucket to another thread */
+    for (i = 0; r->handler && i < count; i++) {
+        r->handler(&closed[i], r->handler_arg);
+    }
+}
+
+void rollup_add(rollup* r, int64_t time_ms, float temperature, float humidity) {
+    rollup_bucket closed[ROLLUP_LEVELS];
+    size_t closed_count = 0;
+    int level, rejected = 0;
+
+    if (isnan(temperature) || isnan(humidity)) {
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    r->stats.samples++;
+    for (level = 0; level < ROLLUP_LEVELS; level++) {
+        rollup_file* file = &r->files[level];
+        if (file->map == NULL) {
+            continue;
+        }
+        file_header* header = header_of(file);
+        open_bucket* open = &header->open;
+        int64_t start = time_ms - time_ms % level_length[level];
+        if (open->count > 0 && start > open->start) {
+            close_bucket(r, (rollup_level)level, &closed[closed_count++]);
+        }
+        if (open->count > 0 ? start < open->start : time_ms < closed_end(file, (rollup_level)level)) {
+            /* Its bucket is already closed */
+            rejected = 1;
+            continue;
+        }
+        if (open->count == 0) {
+            memset(open, 0, sizeof(*open));
+            open->start = start;
+        }
+        open->count++;
+        accumulate(&open->temperature, open->count, temperature);
+        accumulate(&open->humidity, open->count, humidity);
+    }
+    if (rejected) {
+        r->stats.rejected++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    report_closed(r, closed, closed_count);
+}
+
+void rollup_tick(rollup* r, int64_t now_ms) {
+    rollup_bucket closed[ROLLUP_LEVELS];
+    size_t closed_count = 0;
+    int level;
+
+    pthread_mutex_lock(&r->lock);
+    for (level = 0; level < ROLLUP_LEVELS; level++) {
+        rollup_file* file = &r->files[level];
+        if (file->map == NULL) {
+            continue;
+        }
+        open_bucket* open = &header_of(file)->open;
+        if (open->count > 0 && open->start + level_length[level] <= now_ms) {
+            close_bucket(r, (rollup_level)level, &closed[closed_count++]);
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+    report_closed(r, closed, closed_count);
+}
+
+size_t rollup_read(rollup* r, rollup_level level, int64_t from, int64_t to, rollup_bucket* buckets, size_t max) {
+    size_t copied = 0;
+    if (level < 0 || level >= ROLLUP_LEVELS) {
+        return 0;
+    }
+    pthread_mutex_lock(&r->lock);
+    rollup_file* file = &r->files[level];
+    if (file->map != NULL) {
+        file_header* header = header_of(file);
+        record* ring = ring_of(file);
+        uint32_t low = 0, high = header->stored;
+        /* The ring is in time order, find the first bucket not before from */
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            if ((int64_t)ring[slot_of(header, middle)].start * 60000 < from) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        for (; low < header->stored && copied < max; low++) {
+            const record* slot = &ring[slot_of(header, low)];
+            if ((int64_t)slot->start * 60000 > to) {
+                break;
+            }
+            decode(level, slot, &buckets[copied++]);
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+    return copied;
+}
+
+const char* rollup_level_name(rollup_level level) {
+    return level >= 0 && level < ROLLUP_LEVELS ? level_names[level] : "unknown";
+}
+
+void rollup_get_stats(rollup* r, rollup_stats* stats) {
+    pthread_mutex_lock(&r->lock);
+    *stats = r->stats;
+    pthread_mutex_unlock(&r->lock);
+}
+
+void rollup_close(rollup* r) {
+    int level;
+    pthread_mutex_lock(&r->lock);
+    for (level = 0; level < ROLLUP_LEVELS; level++) {
+        rollup_file* file = &r->files[level];
+        if (file->map != NULL) {
+            msync(file->map, file->size, MS_ASYNC);
+            munmap(file->map, file->size);
+            file->map = NULL;
+        }
+        if (file->fd >= 0) {
+            close(file->fd);
+            file->fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+    pthread_mutex_destroy(&r->lock);
+}
@@ -0,0 +1,121 @@
+/*
+ * Minute, hour and day summaries of the readings of one sensor.
+ *
+ * Every reading updates the open bucket of each level in constant time:
+ * count, min and max, and mean and variance with Welford's method, which
+ * stays accurate where summing squares would cancel. A bucket closes when
+ * a reading falls past its end, or when rollup_tick finds the clock has
+ * moved on, and is then kept in a fixed ring of compact records per
+ * level: a week of minutes, thirteen months of hours, ten years of days.
+ * Buckets start on UTC boundaries, empty ones are not stored.
+ *
+ * The rings and the open buckets live in one memory mapped file per level
+ * in a directory of their own, so a restart carries on with the buckets
+ * it was filling.
+ */
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ROLLUP_PATH_MAX 256
+
+/* Closed buckets kept per level */
+#define ROLLUP_MINUTE_KEEP (7 * 24 * 60)
+#define ROLLUP_HOUR_KEEP (396 * 24)
+#define ROLLUP_DAY_KEEP (10 * 366)
+
+typedef enum {
+    ROLLUP_MINUTE,
+    ROLLUP_HOUR,
+    ROLLUP_DAY,
+    ROLLUP_LEVELS
+} rollup_level;
+
+typedef struct {
+    float min;
+    float max;
+    float mean;
+    float stddev;               /* of the population, 0 for a single reading */
+} rollup_summary;
+
+typedef struct {
+    rollup_level level;
+    int64_t start;              /* ms since the epoch */
+    int64_t length;             /* ms */
+    uint32_t count;             /* readings in the bucket */
+    rollup_summary temperature;
+    rollup_summary humidity;
+} rollup_bucket;
+
+/*
+ * Called for each bucket as it closes, on the thread that closed it.
+ */
+typedef void (*rollup_handler)(const rollup_bucket* bucket, void* arg);
+
+typedef struct {
+    unsigned long samples;          /* readings added */
+    unsigned long rejected;         /* readings older than an open bucket */
+    unsigned long closed[ROLLUP_LEVELS];
+} rollup_stats;
+
+typedef struct {
+    int fd;
+    uint8_t* map;
+    size_t size;
+} rollup_file;
+
+typedef struct {
+    char dir[ROLLUP_PATH_MAX];
+    pthread_mutex_t lock;
+    rollup_file files[ROLLUP_LEVELS];
+    rollup_handler handler;
+    void* handler_arg;
+    rollup_stats stats;
+} rollup;
+
+/*
+ * Open the summaries in dir, creating the directory and files if needed.
+ * handler may be NULL.
+ * Returns 0 on success, -1 on failure.
+ */
+int rollup_open(rollup* r, const char* dir, rollup_handler handler, void* arg);
+
+/*
+ * Add a reading to the open bucket of every level, thread safe. Buckets
+ * it falls past are closed first.
+ */
+void rollup_add(rollup* r, int64_t time_ms, float temperature, float humidity);
+
+/*
+ * Close the open buckets that end at or before now_ms, for when readings
+ * stop coming.
+ */
+void rollup_tick(rollup* r, int64_t now_ms);
+
+/*
+ * Copy up to max closed buckets of a level that start in from <= start
+ * <= to into buckets, oldest first.
+ * Returns the number copied.
+ */
+size_t rollup_read(rollup* r, rollup_level level, int64_t from, int64_t to, rollup_bucket* buckets, size_t max);
+
+/*
+ * Name of a level, "minute", "hour" or "day".
+ */
+const char* rollup_level_name(rollup_level level);
+
+/*
+ * Copy the counters into stats, thread safe.
+ */
+void rollup_get_stats(rollup* r, rollup_stats* stats);
+
+/*
+ * Close the files, the open buckets stay in them for the next run.
+ */
+void rollup_close(rollup* r);
+
+#endif /* ROLLUP_H */
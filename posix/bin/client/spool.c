@@ -0,0 +1,483 @@
+/*
+ * Store-and-forward spool, see spool.h
+ *
+ * A segment file is a header followed by fixed size records:
+ *
+ *   header  magic, version, sequence number, record size
+ *   record  magic, crc32, event time, temperature, humidity, quality
+ *
+ * A record is filled in first and gets its checksum and magic last, then
+ * the page is synced. A record with a bad magic or checksum ends the
+ * segment. The cursor file holds the sequence number and index of the
+ * next record to replay and is replaced atomically with rename.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spool.h"
+
+#define SPOOL_SEGMENT_MAGIC 0x4c4f4f50u /* "POOL" */
+#define SPOOL_RECORD_MAGIC  0x44524352u /* "RCRD" */
+#define SPOOL_CURSOR_MAGIC  0x53525543u /* "CURS" */
+#define SPOOL_VERSION 1
+#define SPOOL_PATH_MAX 256
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sequence;
+    uint32_t record_size;
+} segment_header;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;               /* over everything after this field */
+    int64_t event_time;
+    float temperature;
+    float humidity;
+    int16_t quality;
+    int16_t repaired_bits;
+    uint32_t reserved;
+} spool_record;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t index;
+    uint32_t crc;
+} cursor_record;
+
+typedef struct {
+    uint32_t sequence;
+    size_t count;               /* valid records */
+} segment_info;
+
+/* A mapped segment file */
+typedef struct {
+    uint32_t sequence;
+    int fd;
+    unsigned char* map;
+    size_t size;
+} segment_map;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static spool_config config;
+static int opened;
+static segment_info segments[SPOOL_MAX_SEGMENTS];
+static unsigned int segment_count;
+static size_t cursor_index;     /* next record to replay in segments[0] */
+static segment_map tail_map;    /* segment being appended to */
+static segment_map head_map;    /* segment being replayed from */
+static spool_stats stats;
+
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t length) {
+    static uint32_t table[256];
+    static int table_ready;
+    const unsigned char* bytes = data;
+    size_t i;
+    if (!table_ready) {
+        uint32_t n, k, c;
+        for (n = 0; n < 256; n++) {
+            c = n;
+            for (k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        table_ready = 1;
+    }
+    crc = ~crc;
+    for (i = 0; i < length; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t record_crc(const spool_record* record) {
+    return crc32_update(0, &record->event_time,
+            sizeof(*record) - offsetof(spool_record, event_time));
+}
+
+static void segment_path(char* path, uint32_t sequence) {
+    snprintf(path, SPOOL_PATH_MAX, "%s/segment-%08u.log", config.dir, (unsigned int)sequence);
+}
+
+static size_t segment_size(void) {
+    return sizeof(segment_header) + config.segment_records * sizeof(spool_record);
+}
+
+static spool_record* record_at(segment_map* map, size_t index) {
+    return (spool_record*)(map->map + sizeof(segment_header)) + index;
+}
+
+static void unmap_segment(segment_map* map) {
+    if (map->map) {
+        munmap(map->map, map->size);
+        close(map->fd);
+    }
+    memset(map, 0, sizeof(*map));
+    map->fd = -1;
+}
+
+static int map_segment(segment_map* map, uint32_t sequence, int create) {
+    char path[SPOOL_PATH_MAX];
+    segment_path(path, sequence);
+    unmap_segment(map);
+    map->fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+    if (map->fd < 0) {
+        return -1;
+    }
+    map->size = segment_size();
+    if (create && ftruncate(map->fd, map->size) != 0) {
+        close(map->fd);
+        unlink(path);
+        map->fd = -1;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(map->fd, &st) != 0 || (size_t)st.st_size < map->size) {
+        close(map->fd);
+        map->fd = -1;
+        return -1;
+    }
+    map->map = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+    if (map->map == MAP_FAILED) {
+        map->map = NULL;
+        close(map->fd);
+        map->fd = -1;
+        return -1;
+    }
+    map->sequence = sequence;
+    if (create) {
+        segment_header* header = (segment_header*)map->map;
+        header->version = SPOOL_VERSION;
+        header->sequence = sequence;
+        header->record_size = sizeof(spool_record);
+        header->magic = SPOOL_SEGMENT_MAGIC;
+        msync(map->map, sizeof(*header), MS_SYNC);
+    }
+    return 0;
+}
+
+/* Map a segment that may already be mapped as the other end */
+static segment_map* mapped(segment_map* map, uint32_t sequence) {
+    if (map->map && map->sequence == sequence) {
+        return map;
+    }
+    return map_segment(map, sequence, 0) == 0 ? map : NULL;
+}
+
+static void remove_segment(uint32_t sequence) {
+    char path[SPOOL_PATH_MAX];
+    if (head_map.map && head_map.sequence == sequence) {
+        unmap_segment(&head_map);
+    }
+    if (tail_map.map && tail_map.sequence == sequence) {
+        unmap_segment(&tail_map);
+    }
+    segment_path(path, sequence);
+    unlink(path);
+}
+
+static void drop_oldest_segment(void) {
+    remove_segment(segments[0].sequence);
+    memmove(segments, segments + 1, (segment_count - 1) * sizeof(segments[0]));
+    segment_count--;
+    cursor_index = 0;
+}
+
+static void save_cursor(void) {
+    char path[SPOOL_PATH_MAX], temporary[SPOOL_PATH_MAX];
+    cursor_record cursor;
+    cursor.magic = SPOOL_CURSOR_MAGIC;
+    cursor.sequence = segment_count ? segments[0].sequence : 0;
+    cursor.index = (uint32_t)cursor_index;
+    cursor.crc = crc32_update(0, &cursor, offsetof(cursor_record, crc));
+    snprintf(path, sizeof(path), "%s/cursor", config.dir);
+    snprintf(temporary, sizeof(temporary), "%s/cursor.tmp", config.dir);
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+    int ok = write(fd, &cursor, sizeof(cursor)) == sizeof(cursor) && fsync(fd) == 0;
+    close(fd);
+    if (ok) {
+        rename(temporary, path);
+    }
+}
+
+static int load_cursor(cursor_record* cursor) {
+    char path[SPOOL_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/cursor", config.dir);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int ok = read(fd, cursor, sizeof(*cursor)) == sizeof(*cursor);
+    close(fd);
+    if (!ok || cursor->magic != SPOOL_CURSOR_MAGIC ||
+            cursor->crc != crc32_update(0, cursor, offsetof(cursor_record, crc))) {
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_info(const void* a, const void* b) {
+    uint32_t x = ((const segment_info*)a)->sequence, y = ((const segment_info*)b)->sequence;
+    return x < y ? -1 : x > y;
+}
+
+/* Count the valid records of a segment, -1 if it is no segment of ours */
+static long scan_segment(uint32_t sequence) {
+    segment_map map;
+    memset(&map, 0, sizeof(map));
+    map.fd = -1;
+    if (map_segment(&map, sequence, 0) != 0) {
+        return -1;
+    }
+    segment_header* header = (segment_header*)map.map;
+    if (header->magic != SPOOL_SEGMENT_MAGIC || header->version != SPOOL_VERSION ||
+            header->record_size != sizeof(spool_record) || header->sequence != sequence) {
+        unmap_segment(&map);
+        return -1;
+    }
+    size_t count = 0;
+    while (count < config.segment_records) {
+        spool_record* record = record_at(&map, count);
+        if (record->magic != SPOOL_RECORD_MAGIC) {
+            break;
+        }
+        if (record->crc != record_crc(record)) {
+            /* Torn by a power cut, nothing after it was acknowledged */
+            stats.corrupt++;
+            break;
+        }
+        count++;
+    }
+    unmap_segment(&map);
+    return (long)count;
+}
+
+static int recover(void) {
+    DIR* dir = opendir(config.dir);
+    struct dirent* entry;
+    unsigned int sequence;
+    if (dir == NULL) {
+        return -1;
+    }
+    segment_count = 0;
+    while ((entry = readdir(dir)) != NULL && segment_count < SPOOL_MAX_SEGMENTS) {
+        if (sscanf(entry->d_name, "segment-%8u.log", &sequence) == 1) {
+            segments[segment_count].sequence = sequence;
+            segments[segment_count].count = 0;
+            segment_count++;
+        }
+    }
+    closedir(dir);
+    qsort(segments, segment_count, sizeof(segments[0]), compare_info);
+
+    unsigned int i, kept = 0;
+    for (i = 0; i < segment_count; i++) {
+        long count = scan_segment(segments[i].sequence);
+        if (count <= 0) {
+            remove_segment(segments[i].sequence);
+            continue;
+        }
+        segments[i].count = (size_t)count;
+        segments[kept++] = segments[i];
+    }
+    segment_count = kept;
+
+    /* Skip what an earlier run already replayed */
+    cursor_record cursor;
+    cursor_index = 0;
+    if (load_cursor(&cursor) == 0) {
+        while (segment_count && segments[0].sequence < cursor.sequence) {
+            drop_oldest_segment();
+        }
+        if (segment_count && segments[0].sequence == cursor.sequence) {
+            cursor_index = cursor.index < segments[0].count ? cursor.index : segments[0].count;
+        }
+    }
+    return 0;
+}
+
+static unsigned long count_pending(void) {
+    unsigned long pending = 0;
+    unsigned int i;
+    for (i = 0; i < segment_count; i++) {
+        pending += segments[i].count;
+    }
+    return pending - cursor_index;
+}
+
+int spool_open(const spool_config* spool) {
+    if (spool->dir == NULL || spool->segment_records == 0 || spool->max_segments < 2 ||
+            spool->max_segments > SPOOL_MAX_SEGMENTS) {
+        return -1;
+    }
+    pthread_mutex_lock(&lock);
+    config = *spool;
+    memset(&stats, 0, sizeof(stats));
+    memset(&tail_map, 0, sizeof(tail_map));
+    memset(&head_map, 0, sizeof(head_map));
+    tail_map.fd = head_map.fd = -1;
+    if (mkdir(config.dir, 0700) != 0 && errno != EEXIST) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    if (recover() != 0) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    opened = 1;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/* Make sure the last segment is mapped and has room, locked */
+static int prepare_tail(void) {
+    if (segment_count && segments[segment_count - 1].count < config.segment_records) {
+        return mapped(&tail_map, segments[segment_count - 1].sequence) ? 0 : -1;
+    }
+    if (segment_count == config.max_segments) {
+        stats.dropped += segments[0].count - cursor_index;
+        drop_oldest_segment();
+        save_cursor();
+    }
+    uint32_t sequence = segment_count ? segments[segment_count - 1].sequence + 1 : 1;
+    if (map_segment(&tail_map, sequence, 1) != 0) {
+        return -1;
+    }
+    segments[segment_count].sequence = sequence;
+    segments[segment_count].count = 0;
+    segment_count++;
+    return 0;
+}
+
+int spool_append(const sensor_reading* reading) {
+    int rv = -1;
+    pthread_mutex_lock(&lock);
+    if (opened && prepare_tail() == 0) {
+        segment_info* info = &segments[segment_count - 1];
+        spool_record* record = record_at(&tail_map, info->count);
+        record->event_time = reading->event_time;
+        record->temperature = reading->temperature;
+        record->humidity = reading->humidity;
+        record->quality = (int16_t)reading->quality;
+        record->repaired_bits = (int16_t)reading->repaired_bits;
+        record->reserved = 0;
+        record->crc = record_crc(record);
+        __sync_synchronize();
+        record->magic = SPOOL_RECORD_MAGIC;
+        /* msync wants a page aligned start */
+        long page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)record & ~(uintptr_t)(page - 1);
+        uintptr_t end = (uintptr_t)(record + 1);
+        if (msync((void*)start, end - start, MS_SYNC) == 0) {
+            info->count++;
+            stats.appended++;
+            rv = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return rv;
+}
+
+size_t spool_peek(sensor_reading* readings, spool_position* positions, size_t max) {
+    size_t copied = 0;
+    unsigned int segment = 0;
+    size_t index;
+    pthread_mutex_lock(&lock);
+    index = cursor_index;
+    while (opened && copied < max && segment < segment_count) {
+        if (index >= segments[segment].count) {
+            segment++;
+            index = 0;
+            continue;
+        }
+        /* The replay end has a mapping of its own, walking forward */
+        segment_map* map = mapped(&head_map, segments[segment].sequence);
+        if (map == NULL) {
+            break;
+        }
+        if (positions) {
+            positions[copied].segment = segments[segment].sequence;
+            positions[copied].index = (uint32_t)index;
+        }
+        const spool_record* record = record_at(map, index++);
+        sensor_reading* reading = &readings[copied++];
+        memset(reading, 0, sizeof(*reading));
+        reading->attempts = 1;
+        reading->event_time = record->event_time;
+        reading->temperature = record->temperature;
+        reading->humidity = record->humidity;
+        reading->quality = record->quality;
+        reading->repaired_bits = record->repaired_bits;
+    }
+    pthread_mutex_unlock(&lock);
+    return copied;
+}
+
+void spool_consume(const spool_position* last) {
+    int moved = 0;
+    pthread_mutex_lock(&lock);
+    while (opened && segment_count > 0 && segments[0].sequence <= last->segment) {
+        size_t end = segments[0].count;
+        if (segments[0].sequence == last->segment && (size_t)last->index + 1 < end) {
+            end = (size_t)last->index + 1;
+        }
+        if (end <= cursor_index) {
+            break;
+        }
+        stats.replayed += end - cursor_index;
+        cursor_index = end;
+        moved = 1;
+        /* A fully replayed segment goes, unless it is still being filled */
+        if (cursor_index == segments[0].count &&
+                (segment_count > 1 || segments[0].count == config.segment_records)) {
+            drop_oldest_segment();
+        } else {
+            break;
+        }
+    }
+    if (opened && moved) {
+        save_cursor();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+unsigned long spool_pending(void) {
+    unsigned long pending;
+    pthread_mutex_lock(&lock);
+    pending = opened ? count_pending() : 0;
+    pthread_mutex_unlock(&lock);
+    return pending;
+}
+
+void spool_get_stats(spool_stats* copy) {
+    pthread_mutex_lock(&lock);
+    *copy = stats;
+    copy->pending = opened ? count_pending() : 0;
+    copy->segments = segment_count;
+    pthread_mutex_unlock(&lock);
+}
+
+void spool_close(void) {
+    pthread_mutex_lock(&lock);
+    if (opened) {
+        unmap_segment(&head_map);
+        unmap_segment(&tail_map);
+        opened = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
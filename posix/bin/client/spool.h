@@ -0,0 +1,84 @@
+/*
+ * Store-and-forward spool for readings the uplink could not deliver.
+ *
+ * Readings are appended to memory mapped segment files in a directory.
+ * Every record carries a checksum, so after a power cut the spool is
+ * recovered up to the last complete record. Replay reads from a cursor
+ * that is persisted separately; segments are removed once replayed, and
+ * the oldest are dropped when the spool reaches its size limit.
+ */
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "reading.h"
+
+/* Most segment files kept on disk */
+#define SPOOL_MAX_SEGMENTS 256
+
+typedef struct {
+    const char* dir;            /* directory for the segment files, NULL = no spool */
+    size_t segment_records;     /* readings per segment file */
+    unsigned int max_segments;  /* disk bound, oldest segments are dropped past it */
+} spool_config;
+
+/* Where a reading is in the spool, stays valid while it is pending */
+typedef struct {
+    uint32_t segment;           /* sequence number of its segment file */
+    uint32_t index;             /* record in the segment */
+} spool_position;
+
+typedef struct {
+    unsigned long appended;     /* readings written */
+    unsigned long replayed;     /* readings handed back for upload */
+    unsigned long dropped;      /* readings lost to the size limit */
+    unsigned long corrupt;      /* damaged records skipped at recovery */
+    unsigned long pending;      /* readings waiting for replay */
+    unsigned int segments;      /* segment files on disk */
+} spool_stats;
+
+/*
+ * Open the spool, creating the directory if needed, and recover what an
+ * earlier run left behind.
+ * Returns 0 on success, -1 on failure.
+ */
+int spool_open(const spool_config* config);
+
+/*
+ * Append a reading, thread safe. The record is synced to disk before this
+ * returns. Returns 0 on success, -1 on failure.
+ */
+int spool_append(const sensor_reading* reading);
+
+/*
+ * Copy up to max of the oldest pending readings into readings without
+ * consuming them, and where they are into positions unless it is NULL.
+ * Returns the number copied.
+ */
+size_t spool_peek(sensor_reading* readings, spool_position* positions, size_t max);
+
+/*
+ * Mark every pending reading up to and including the one at last as
+ * replayed, thread safe. Readings dropped for the size limit meanwhile
+ * are skipped, a position already replayed changes nothing.
+ */
+void spool_consume(const spool_position* last);
+
+/*
+ * Number of readings waiting for replay.
+ */
+unsigned long spool_pending(void);
+
+/*
+ * Copy the counters into stats.
+ */
+void spool_get_stats(spool_stats* stats);
+
+/*
+ * Unmap and close the spool, pending readings stay on disk.
+ */
+void spool_close(void);
+
+#endif /* SPOOL_H */
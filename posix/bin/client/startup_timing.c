@@ -0,0 +1,70 @@
+/*
+ * Startup time breakdown, see startup_timing.h
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "common_dht_read.h"
+#include "log_sink.h"
+#include "startup_timing.h"
+
+static const char* phase_names[STARTUP_PHASES] = {
+    "first reading",
+    "network",
+    "library init",
+    "activation",
+    "device model",
+    "device handle",
+    "uplink ready"
+};
+
+static uint64_t started;
+static _Atomic uint64_t marks[STARTUP_PHASES];
+
+void startup_begin(void) {
+    int i;
+    started = monotonic_nanoseconds();
+    for (i = 0; i < STARTUP_PHASES; i++) {
+        atomic_store(&marks[i], 0);
+    }
+}
+
+void startup_mark(startup_phase phase) {
+    uint64_t unset = 0;
+    atomic_compare_exchange_strong(&marks[phase], &unset, monotonic_nanoseconds());
+}
+
+long startup_elapsed_ms(startup_phase phase) {
+    uint64_t mark = atomic_load(&marks[phase]);
+    return mark ? (long)((mark - started) / 1000000ULL) : -1;
+}
+
+void startup_report(void) {
+    int order[STARTUP_PHASES];
+    int i, j, count = 0;
+    long previous = 0;
+    /* In the order they were reached, a warm start resolves the model last */
+    for (i = 0; i < STARTUP_PHASES; i++) {
+        if (i == STARTUP_FIRST_READING || startup_elapsed_ms((startup_phase)i) < 0) {
+            continue;
+        }
+        for (j = count; j > 0 && startup_elapsed_ms((startup_phase)order[j - 1]) >
+                startup_elapsed_ms((startup_phase)i); j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+        count++;
+    }
+    log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Startup timing (ms since start, ms in phase):\n");
+    for (i = 0; i < count; i++) {
+        long elapsed = startup_elapsed_ms((startup_phase)order[i]);
+        log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs:   %-14s %6ld %6ld\n", phase_names[order[i]], elapsed, elapsed - previous);
+        previous = elapsed;
+    }
+    /* Sampling does not wait for the uplink, so it is not a phase of it */
+    if (startup_elapsed_ms(STARTUP_FIRST_READING) >= 0) {
+        log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs:   %-14s %6ld\n", phase_names[STARTUP_FIRST_READING],
+                startup_elapsed_ms(STARTUP_FIRST_READING));
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * Startup time breakdown.
+ *
+ * Each phase of bringing the client up is marked with the monotonic time
+ * it finished, from whichever thread runs it, and the breakdown is
+ * printed once the uplink is ready.
+ */
+
+#ifndef STARTUP_TIMING_H
+#define STARTUP_TIMING_H
+
+typedef enum {
+    STARTUP_FIRST_READING,      /* first successful sensor reading */
+    STARTUP_NETWORK,            /* network ready */
+    STARTUP_LIBRARY,            /* iotcs_init done */
+    STARTUP_ACTIVATION,         /* device known to be activated */
+    STARTUP_DEVICE_MODEL,       /* device model handle resolved */
+    STARTUP_DEVICE,             /* virtual device handle resolved */
+    STARTUP_UPLINK_READY,       /* first upload may go out */
+    STARTUP_PHASES
+} startup_phase;
+
+/*
+ * Start the clock, call first thing in main.
+ */
+void startup_begin(void);
+
+/*
+ * Mark phase as done now. Only the first mark of a phase counts.
+ */
+void startup_mark(startup_phase phase);
+
+/*
+ * Milliseconds from startup_begin to phase, -1 if not reached yet.
+ */
+long startup_elapsed_ms(startup_phase phase);
+
+/*
+ * Print the phases reached so far to stderr.
+ */
+void startup_report(void);
+
+#endif /* STARTUP_TIMING_H */
@@ -0,0 +1,733 @@
+/*
+ * Columnar reading history, see tsdb.h
+ *
+ * A segment file is a header, the block index and the blocks:
+ *
+ *   header  magic, version, day, blocks used, open flag, end of sealed data
+ *   index   TSDB_INDEX_BLOCKS entries: first and last time (ms into the
+ *           day), offset, count, size
+ *   block   header (count, stream lengths in bits, first time), then the
+ *           time, temperature and humidity streams
+ *
+ * An open block has its three streams at fixed offsets, each region big
+ * enough for TSDB_BLOCK_POINTS worst case readings, so appends write in
+ * place. Sealing packs the streams behind each other and the next block
+ * starts right after. The block header's count is written after the
+ * bits, so recovery decodes the open block up to the last complete
+ * reading and rebuilds the encoder state from it.
+ *
+ * Timestamps are kept in units of the segment's resolution. The first one
+ * is in the block header, then each delta of
+ * delta is written as '0' when zero, else '10' + 5 bits, '110' + 9 bits,
+ * '1110' + 12 bits or '1111' + 32 bits. Readings land on a grid with a
+ * few ms of jitter, the 5 bit case is for that.
+ * Values: the first one as its 32 bits, then the XOR with the previous
+ * value as '0' when zero, '10' + the meaningful bits when they fit the
+ * window of the last full XOR, else '11' + 5 bits of leading zeros +
+ * 5 bits of length - 1 + the meaningful bits.
+ * The DHT reports tenths, and the XOR of 21.5f and 21.6f has some twenty
+ * meaningful bits against seven for 215.0f and 216.0f. So a column whose
+ * first value in the block is an exact tenth stores its values times ten
+ * ("decimal"). A later value that is not an exact tenth ends the block.
+ */
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tsdb.h"
+
+#define TSDB_SEGMENT_MAGIC 0x42445354u  /* "TSDB" */
+#define TSDB_BLOCK_MAGIC   0x4b4c4254u  /* "TBLK" */
+#define TSDB_VERSION 1
+
+/* The stream reader loads 8 bytes at a time and may run past the end */
+#define TSDB_READ_PAD 8
+#define TSDB_TIME_REGION ((TSDB_BLOCK_POINTS * 36 + 7) / 8 + TSDB_READ_PAD)
+#define TSDB_VALUE_REGION ((32 + (TSDB_BLOCK_POINTS - 1) * 44 + 7) / 8 + TSDB_READ_PAD)
+#define TSDB_BLOCK_RESERVE (sizeof(block_header) + TSDB_TIME_REGION + 2 * TSDB_VALUE_REGION)
+#define TSDB_DATA_START (sizeof(segment_header) + TSDB_INDEX_BLOCKS * sizeof(tsdb_index_entry))
+#define TSDB_SEGMENT_MAP (TSDB_DATA_START + TSDB_INDEX_BLOCKS * TSDB_BLOCK_RESERVE)
+/* No window yet, the next XOR is written in full */
+#define TSDB_NO_WINDOW 0xff
+#define TSDB_DECIMAL_TEMPERATURE 0x1
+#define TSDB_DECIMAL_HUMIDITY 0x2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t day;
+    uint32_t blocks;            /* index entries in use, the open block included */
+    uint32_t open;              /* the last block is still open */
+    uint64_t data_end;          /* end of the sealed blocks */
+    uint32_t resolution;        /* ms per time unit in the blocks */
+    uint8_t reserved[28];
+} segment_header;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t time_bits;
+    uint32_t temperature_bits;
+    uint32_t humidity_bits;
+    uint32_t flags;             /* TSDB_DECIMAL_* */
+    int64_t first_time;
+} block_header;
+
+typedef struct {
+    const uint8_t* time;
+    const uint8_t* temperature;
+    const uint8_t* humidity;
+} block_streams;
+
+static void put_bits(uint8_t* stream, uint32_t* position, uint64_t value, unsigned int count) {
+    while (count > 0) {
+        uint32_t bit = *position;
+        uint8_t* byte = stream + (bit >> 3);
+        unsigned int free = 8 - (bit & 7);
+        unsigned int take = count < free ? count : free;
+        uint8_t chunk = (uint8_t)((value >> (count - take)) & ((1u << take) - 1));
+        /* Clear what follows, the region may hold bits of a torn append */
+        uint8_t keep = free == 8 ? 0 : (uint8_t)(0xff << free);
+        *byte = (uint8_t)((*byte & keep) | (chunk << (free - take)));
+        *position += take;
+        count -= take;
+    }
+}
+
+/* Read count bits, 1 to 32 */
+static inline uint32_t get_bits(const uint8_t* stream, uint32_t* position, unsigned int count) {
+    uint32_t bit = *position;
+    uint64_t word;
+    memcpy(&word, stream + (bit >> 3), sizeof(word));
+    word = be64toh(word) << (bit & 7);
+    *position = bit + count;
+    return (uint32_t)(word >> (64 - count));
+}
+
+static uint32_t float_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static float bits_float(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/* value is a whole number of tenths, exactly */
+static int is_decimal(float value) {
+    float scaled = rintf(value * 10.0f);
+    return fabsf(scaled) < 16777216.0f && scaled / 10.0f == value && float_bits(scaled / 10.0f) == float_bits(value);
+}
+
+static uint32_t stored_bits(const tsdb_value_column* column, float value) {
+    return float_bits(column->decimal ? rintf(value * 10.0f) : value);
+}
+
+static float stored_value(const tsdb_value_column* column) {
+    float value = bits_float(column->previous);
+    return column->decimal ? value / 10.0f : value;
+}
+
+static int64_t day_of(int64_t time_ms) {
+    return time_ms >= 0 ? time_ms / TSDB_DAY_MS : -1;
+}
+
+static size_t stream_bytes(uint32_t bits) {
+    return (bits + 7) / 8;
+}
+
+static void segment_path(const char* dir, int64_t day, char* path, size_t size) {
+    time_t seconds = (time_t)(day * 86400);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    snprintf(path, size, "%s/%04d-%02d-%02d.tsd", dir, utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday);
+}
+
+/* Day of a segment file name, -1 if it is not one */
+static int64_t segment_day(const char* name) {
+    struct tm utc;
+    if (strlen(name) != 14 || strcmp(name + 10, ".tsd") != 0) {
+        return -1;
+    }
+    memset(&utc, 0, sizeof(utc));
+    if (sscanf(name, "%4d-%2d-%2d", &utc.tm_year, &utc.tm_mon, &utc.tm_mday) != 3) {
+        return -1;
+    }
+    utc.tm_year -= 1900;
+    utc.tm_mon -= 1;
+    return (int64_t)timegm(&utc) / 86400;
+}
+
+/* Oldest and newest day with a segment in dir, returns -1 if there is none */
+static int segment_days(const char* dir, int64_t* first, int64_t* last) {
+    struct dirent* entry;
+    DIR* directory = opendir(dir);
+    *first = INT64_MAX;
+    *last = -1;
+    if (directory == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        int64_t day = segment_day(entry->d_name);
+        if (day < 0) {
+            continue;
+        }
+        if (day < *first) {
+            *first = day;
+        }
+        if (day > *last) {
+            *last = day;
+        }
+    }
+    closedir(directory);
+    return *last < 0 ? -1 : 0;
+}
+
+static segment_header* header_of(const tsdb* db) {
+    return (segment_header*)db->map;
+}
+
+static tsdb_index_entry* index_of(uint8_t* map) {
+    return (tsdb_index_entry*)(map + sizeof(segment_header));
+}
+
+static void streams_of(const uint8_t* block, int open, block_streams* streams) {
+    const block_header* header = (const block_header*)block;
+    streams->time = block + sizeof(block_header);
+    if (open) {
+        streams->temperature = streams->time + TSDB_TIME_REGION;
+        streams->humidity = streams->temperature + TSDB_VALUE_REGION;
+    } else {
+        streams->temperature = streams->time + stream_bytes(header->time_bits);
+        streams->humidity = streams->temperature + stream_bytes(header->temperature_bits);
+    }
+}
+
+static void encode_time(uint8_t* stream, tsdb_block_state* state, int64_t time) {
+    int64_t delta = time - state->previous_time;
+    int64_t dod = delta - state->previous_delta;
+    if (dod == 0) {
+        put_bits(stream, &state->time_bits, 0, 1);
+    } else if (dod >= -15 && dod <= 16) {
+        put_bits(stream, &state->time_bits, 0x2, 2);
+        put_bits(stream, &state->time_bits, (uint64_t)(dod + 15), 5);
+    } else if (dod >= -255 && dod <= 256) {
+        put_bits(stream, &state->time_bits, 0x6, 3);
+        put_bits(stream, &state->time_bits, (uint64_t)(dod + 255), 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+        put_bits(stream, &state->time_bits, 0xe, 4);
+        put_bits(stream, &state->time_bits, (uint64_t)(dod + 2047), 12);
+    } else {
+        /* Within a day, |dod| stays below two days of milliseconds */
+        put_bits(stream, &state->time_bits, 0xf, 4);
+        put_bits(stream, &state->time_bits, (uint32_t)(int32_t)dod, 32);
+    }
+    state->previous_delta = delta;
+    state->previous_time = time;
+}
+
+static int64_t decode_time(const uint8_t* stream, tsdb_block_state* state) {
+    int64_t dod;
+    if (get_bits(stream, &state->time_bits, 1) == 0) {
+        dod = 0;
+    } else if (get_bits(stream, &state->time_bits, 1) == 0) {
+        dod = (int64_t)get_bits(stream, &state->time_bits, 5) - 15;
+    } else if (get_bits(stream, &state->time_bits, 1) == 0) {
+        dod = (int64_t)get_bits(stream, &state->time_bits, 9) - 255;
+    } else if (get_bits(stream, &state->time_bits, 1) == 0) {
+        dod = (int64_t)get_bits(stream, &state->time_bits, 12) - 2047;
+    } else {
+        dod = (int32_t)get_bits(stream, &state->time_bits, 32);
+    }
+    state->previous_delta += dod;
+    state->previous_time += state->previous_delta;
+    return state->previous_time;
+}
+
+static void encode_value(uint8_t* stream, tsdb_value_column* column, float value) {
+    uint32_t bits = stored_bits(column, value);
+    uint32_t xor = bits ^ column->previous;
+    column->previous = bits;
+    if (xor == 0) {
+        put_bits(stream, &column->bits, 0, 1);
+        return;
+    }
+    unsigned int leading = (unsigned int)__builtin_clz(xor);
+    unsigned int trailing = (unsigned int)__builtin_ctz(xor);
+    if (leading >= column->leading && trailing >= column->trailing) {
+        put_bits(stream, &column->bits, 0x2, 2);
+        put_bits(stream, &column->bits, xor >> column->trailing, 32 - column->leading - column->trailing);
+        return;
+    }
+    unsigned int meaningful = 32 - leading - trailing;
+    put_bits(stream, &column->bits, 0x3, 2);
+    put_bits(stream, &column->bits, leading, 5);
+    put_bits(stream, &column->bits, meaningful - 1, 5);
+    put_bits(stream, &column->bits, xor >> trailing, meaningful);
+    column->leading = (uint8_t)leading;
+    column->trailing = (uint8_t)trailing;
+}
+
+static float decode_value(const uint8_t* stream, tsdb_value_column* column) {
+    if (get_bits(stream, &column->bits, 1) != 0) {
+        uint32_t xor;
+        if (get_bits(stream, &column->bits, 1) == 0) {
+            xor = get_bits(stream, &column->bits, 32 - column->leading - column->trailing) << column->trailing;
+        } else {
+            unsigned int leading = get_bits(stream, &column->bits, 5);
+            unsigned int meaningful = get_bits(stream, &column->bits, 5) + 1;
+            column->leading = (uint8_t)leading;
+            column->trailing = (uint8_t)(32 - leading - meaningful);
+            xor = get_bits(stream, &column->bits, meaningful) << column->trailing;
+        }
+        column->previous ^= xor;
+    }
+    return stored_value(column);
+}
+
+/*
+ * Decode a block into the columns, the arrays hold TSDB_BLOCK_POINTS.
+ * state is left as the encoder had it after the last reading.
+ * Returns the number of readings.
+ */
+static size_t decode_block(const uint8_t* block, int open, int64_t resolution, int64_t* times, float* temperature,
+        float* humidity, tsdb_block_state* state) {
+    const block_header* header = (const block_header*)block;
+    block_streams streams;
+    size_t count = header->count, i;
+    if (header->magic != TSDB_BLOCK_MAGIC || count == 0 || count > TSDB_BLOCK_POINTS) {
+        return 0;
+    }
+    streams_of(block, open, &streams);
+    memset(state, 0, sizeof(*state));
+    state->previous_time = header->first_time;
+    state->temperature.previous = get_bits(streams.temperature, &state->temperature.bits, 32);
+    state->temperature.leading = TSDB_NO_WINDOW;
+    state->temperature.decimal = (header->flags & TSDB_DECIMAL_TEMPERATURE) != 0;
+    state->humidity.previous = get_bits(streams.humidity, &state->humidity.bits, 32);
+    state->humidity.leading = TSDB_NO_WINDOW;
+    state->humidity.decimal = (header->flags & TSDB_DECIMAL_HUMIDITY) != 0;
+    times[0] = header->first_time * resolution;
+    temperature[0] = stored_value(&state->temperature);
+    humidity[0] = stored_value(&state->humidity);
+    /* Column at a time, each loop walks one stream */
+    for (i = 1; i < count; i++) {
+        times[i] = decode_time(streams.time, state) * resolution;
+    }
+    for (i = 1; i < count; i++) {
+        temperature[i] = decode_value(streams.temperature, &state->temperature);
+    }
+    for (i = 1; i < count; i++) {
+        humidity[i] = decode_value(streams.humidity, &state->humidity);
+    }
+    return count;
+}
+
+/* Pack the open block's streams and close it */
+static void seal_block(tsdb* db) {
+    segment_header* header = header_of(db);
+    tsdb_index_entry* entry = &index_of(db->map)[header->blocks - 1];
+    uint8_t* block = db->map + entry->offset;
+    block_header* bheader = (block_header*)block;
+    uint8_t* time = block + sizeof(block_header);
+    size_t time_size = stream_bytes(db->state.time_bits);
+    size_t temperature_size = stream_bytes(db->state.temperature.bits);
+    size_t humidity_size = stream_bytes(db->state.humidity.bits);
+
+    memmove(time + time_size, time + TSDB_TIME_REGION, temperature_size);
+    memmove(time + time_size + temperature_size, time + TSDB_TIME_REGION + TSDB_VALUE_REGION, humidity_size);
+    bheader->time_bits = db->state.time_bits;
+    bheader->temperature_bits = db->state.temperature.bits;
+    bheader->humidity_bits = db->state.humidity.bits;
+
+    size_t size = sizeof(block_header) + time_size + temperature_size + humidity_size;
+    entry->bytes = (uint16_t)size;
+    header->data_end = entry->offset + size;
+    header->open = 0;
+    db->stats.blocks++;
+    db->stats.bytes += size;
+    msync(db->map, header->data_end, MS_ASYNC);
+}
+
+static void close_segment(tsdb* db) {
+    if (db->fd < 0) {
+        return;
+    }
+    segment_header* header = header_of(db);
+    if (header->open) {
+        seal_block(db);
+    }
+    /* Keep the reader's padding behind the last stream */
+    if (ftruncate(db->fd, (off_t)(header->data_end + TSDB_READ_PAD)) != 0) {
+        /* Only wastes the space of the open block's regions */
+    }
+    munmap(db->map, TSDB_SEGMENT_MAP);
+    close(db->fd);
+    db->fd = -1;
+    db->map = NULL;
+}
+
+static int open_segment(tsdb* db, int64_t day) {
+    char path[TSDB_PATH_MAX + 32];
+    struct stat st;
+    segment_path(db->dir, day, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    int fresh = (size_t)st.st_size < TSDB_DATA_START;
+    if (fresh && ftruncate(fd, (off_t)(TSDB_DATA_START + TSDB_READ_PAD)) != 0) {
+        close(fd);
+        return -1;
+    }
+    uint8_t* map = mmap(NULL, TSDB_SEGMENT_MAP, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    segment_header* header = (segment_header*)map;
+    if (fresh) {
+        memset(header, 0, sizeof(*header));
+        header->magic = TSDB_SEGMENT_MAGIC;
+        header->version = TSDB_VERSION;
+        header->day = day;
+        header->data_end = TSDB_DATA_START;
+        header->resolution = (uint32_t)db->resolution;
+    } else if (header->magic != TSDB_SEGMENT_MAGIC || header->version != TSDB_VERSION || header->day != day ||
+            header->blocks > TSDB_INDEX_BLOCKS || header->resolution == 0) {
+        /* Damaged, readings for this day are rejected rather than risk it */
+        munmap(map, TSDB_SEGMENT_MAP);
+        close(fd);
+        return -1;
+    }
+    db->fd = fd;
+    db->map = map;
+    db->day = day;
+
+    tsdb_index_entry* index = index_of(map);
+    if (header->open) {
+        /* Carry on with the open block where the last run left it */
+        int64_t* times = malloc(TSDB_BLOCK_POINTS * (sizeof(int64_t) + 2 * sizeof(float)));
+        float* values = (float*)(times + TSDB_BLOCK_POINTS);
+        tsdb_index_entry* entry = &index[header->blocks - 1];
+        size_t count = times ? decode_block(map + entry->offset, 1, header->resolution, times, values,
+                values + TSDB_BLOCK_POINTS, &db->state) : 0;
+        if (count == 0) {
+            /* Nothing usable, drop the block */
+            header->blocks--;
+            header->open = 0;
+        } else {
+            entry->count = (uint16_t)count;
+            entry->last = (uint32_t)(times[count - 1] - day * TSDB_DAY_MS);
+        }
+        free(times);
+    }
+    if (header->blocks > 0 && day * TSDB_DAY_MS + index[header->blocks - 1].last > db->last_time) {
+        db->last_time = day * TSDB_DAY_MS + index[header->blocks - 1].last;
+    }
+    return 0;
+}
+
+static int start_block(tsdb* db, int64_t time, float temperature, float humidity) {
+    segment_header* header = header_of(db);
+    int64_t units = time / header->resolution;
+    uint64_t offset = header->data_end;
+    if (header->blocks == TSDB_INDEX_BLOCKS ||
+            ftruncate(db->fd, (off_t)(offset + TSDB_BLOCK_RESERVE)) != 0) {
+        return -1;
+    }
+    uint8_t* block = db->map + offset;
+    memset(block, 0, TSDB_BLOCK_RESERVE);
+    block_header* bheader = (block_header*)block;
+    block_streams streams;
+    streams_of(block, 1, &streams);
+
+    memset(&db->state, 0, sizeof(db->state));
+    db->state.previous_time = units;
+    db->state.temperature.leading = TSDB_NO_WINDOW;
+    db->state.humidity.leading = TSDB_NO_WINDOW;
+    db->state.temperature.decimal = (uint8_t)is_decimal(temperature);
+    db->state.humidity.decimal = (uint8_t)is_decimal(humidity);
+    db->state.temperature.previous = stored_bits(&db->state.temperature, temperature);
+    db->state.humidity.previous = stored_bits(&db->state.humidity, humidity);
+    put_bits((uint8_t*)streams.temperature, &db->state.temperature.bits, db->state.temperature.previous, 32);
+    put_bits((uint8_t*)streams.humidity, &db->state.humidity.bits, db->state.humidity.previous, 32);
+    bheader->magic = TSDB_BLOCK_MAGIC;
+    bheader->flags = (db->state.temperature.decimal ? TSDB_DECIMAL_TEMPERATURE : 0) |
+            (db->state.humidity.decimal ? TSDB_DECIMAL_HUMIDITY : 0);
+    bheader->first_time = units;
+    bheader->count = 1;
+
+    tsdb_index_entry* entry = &index_of(db->map)[header->blocks];
+    entry->first = entry->last = (uint32_t)(units * header->resolution - db->day * TSDB_DAY_MS);
+    entry->offset = (uint32_t)offset;
+    entry->count = 1;
+    entry->bytes = 0;
+    header->blocks++;
+    header->open = 1;
+    return 0;
+}
+
+int tsdb_open(tsdb* db, const char* dir, int64_t resolution_ms) {
+    int64_t first, last;
+    memset(db, 0, sizeof(*db));
+    db->fd = -1;
+    db->last_time = -1;
+    db->resolution = resolution_ms > 0 ? resolution_ms : 1;
+    pthread_mutex_init(&db->lock, NULL);
+    snprintf(db->dir, sizeof(db->dir), "%s", dir);
+    if (mkdir(db->dir, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    /* The newest segment tells where the history ends */
+    DIR* directory = opendir(db->dir);
+    if (directory == NULL) {
+        return -1;
+    }
+    closedir(directory);
+    if (segment_days(db->dir, &first, &last) == 0) {
+        open_segment(db, last);
+    }
+    return 0;
+}
+
+int tsdb_append(tsdb* db, int64_t time_ms, float temperature, float humidity) {
+    int64_t day = day_of(time_ms);
+    int rv = 0;
+    pthread_mutex_lock(&db->lock);
+    if (day < 0 || time_ms < db->last_time) {
+        db->stats.rejected++;
+        pthread_mutex_unlock(&db->lock);
+        return -1;
+    }
+    if (db->fd < 0 || day != db->day) {
+        close_segment(db);
+        if (open_segment(db, day) != 0) {
+            db->stats.rejected++;
+            pthread_mutex_unlock(&db->lock);
+            return -1;
+        }
+    }
+
+    segment_header* header = header_of(db);
+    if (header->open && ((db->state.temperature.decimal && !is_decimal(temperature)) ||
+            (db->state.humidity.decimal && !is_decimal(humidity)))) {
+        /* Would not come back exactly, start a block that stores raw bits */
+        seal_block(db);
+    }
+    if (!header->open) {
+        rv = start_block(db, time_ms, temperature, humidity);
+    } else {
+        tsdb_index_entry* entry = &index_of(db->map)[header->blocks - 1];
+        uint8_t* block = db->map + entry->offset;
+        block_header* bheader = (block_header*)block;
+        block_streams streams;
+        streams_of(block, 1, &streams);
+        encode_time((uint8_t*)streams.time, &db->state, time_ms / header->resolution);
+        encode_value((uint8_t*)streams.temperature, &db->state.temperature, temperature);
+        encode_value((uint8_t*)streams.humidity, &db->state.humidity, humidity);
+        bheader->time_bits = db->state.time_bits;
+        bheader->temperature_bits = db->state.temperature.bits;
+        bheader->humidity_bits = db->state.humidity.bits;
+        /* Last, makes the reading part of the block */
+        bheader->count++;
+        entry->count = (uint16_t)bheader->count;
+        entry->last = (uint32_t)(time_ms / header->resolution * header->resolution - db->day * TSDB_DAY_MS);
+        if (entry->count == TSDB_BLOCK_POINTS) {
+            seal_block(db);
+        }
+    }
+    if (rv == 0) {
+        db->last_time = time_ms;
+        db->stats.points++;
+    } else {
+        db->stats.rejected++;
+    }
+    pthread_mutex_unlock(&db->lock);
+    return rv;
+}
+
+void tsdb_cursor_open(tsdb_cursor* cursor, tsdb* db, int64_t from, int64_t to) {
+    int64_t first, last;
+    cursor->db = db;
+    cursor->from = from < 0 ? 0 : from;
+    cursor->to = to;
+    cursor->day = day_of(cursor->from);
+    cursor->last_day = day_of(to);
+    /* Days without a segment cost an open each, keep to those on disk */
+    if (segment_days(db->dir, &first, &last) != 0) {
+        first = INT64_MAX;
+    }
+    pthread_mutex_lock(&db->lock);
+    if (db->fd >= 0) {
+        first = db->day < first ? db->day : first;
+        last = db->day > last ? db->day : last;
+    }
+    pthread_mutex_unlock(&db->lock);
+    if (cursor->day < first) {
+        cursor->day = first;
+    }
+    if (cursor->last_day > last) {
+        cursor->last_day = last;
+    }
+    cursor->fd = -1;
+    cursor->map = NULL;
+    cursor->block = 0;
+    cursor->position = cursor->count = 0;
+}
+
+static void cursor_unmap(tsdb_cursor* cursor) {
+    if (cursor->map) {
+        munmap((void*)cursor->map, TSDB_SEGMENT_MAP);
+        cursor->map = NULL;
+    }
+    if (cursor->fd >= 0) {
+        close(cursor->fd);
+        cursor->fd = -1;
+    }
+}
+
+/* Map the cursor's day, positioned at the first block that can match */
+static int cursor_map(tsdb_cursor* cursor) {
+    char path[TSDB_PATH_MAX + 32];
+    segment_path(cursor->db->dir, cursor->day, path, sizeof(path));
+    cursor->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (cursor->fd < 0) {
+        return -1;
+    }
+    cursor->map = mmap(NULL, TSDB_SEGMENT_MAP, PROT_READ, MAP_SHARED, cursor->fd, 0);
+    if (cursor->map == MAP_FAILED) {
+        cursor->map = NULL;
+        cursor_unmap(cursor);
+        return -1;
+    }
+    const segment_header* header = (const segment_header*)cursor->map;
+    if (header->magic != TSDB_SEGMENT_MAGIC || header->version != TSDB_VERSION || header->resolution == 0) {
+        cursor_unmap(cursor);
+        return -1;
+    }
+    /* Sparse index: first block whose last reading is not before from */
+    pthread_mutex_lock(&cursor->db->lock);
+    const tsdb_index_entry* index = index_of((uint8_t*)cursor->map);
+    int64_t day_start = cursor->day * TSDB_DAY_MS;
+    uint32_t low = 0, high = header->blocks;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (day_start + index[middle].last < cursor->from) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    pthread_mutex_unlock(&cursor->db->lock);
+    cursor->block = low;
+    return 0;
+}
+
+/* Decode the next block that overlaps the range, 0 at the end */
+static int cursor_load(tsdb_cursor* cursor) {
+    while (cursor->day <= cursor->last_day) {
+        if (cursor->map == NULL && cursor_map(cursor) != 0) {
+            cursor->day++;
+            cursor->block = 0;
+            continue;
+        }
+        const segment_header* header = (const segment_header*)cursor->map;
+        const tsdb_index_entry* index = index_of((uint8_t*)cursor->map);
+        tsdb_block_state state;
+        /* The writer may be appending to the open block */
+        pthread_mutex_lock(&cursor->db->lock);
+        if (cursor->block >= header->blocks || cursor->day * TSDB_DAY_MS + index[cursor->block].first > cursor->to) {
+            int done = cursor->block < header->blocks;
+            pthread_mutex_unlock(&cursor->db->lock);
+            cursor_unmap(cursor);
+            if (done) {
+                break;
+            }
+            cursor->day++;
+            cursor->block = 0;
+            continue;
+        }
+        const tsdb_index_entry* entry = &index[cursor->block++];
+        cursor->count = decode_block(cursor->map + entry->offset, entry->bytes == 0, header->resolution,
+                cursor->times, cursor->temperature, cursor->humidity, &state);
+        pthread_mutex_unlock(&cursor->db->lock);
+        /* Skip to the first reading in range */
+        size_t low = 0, high = cursor->count;
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (cursor->times[middle] < cursor->from) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        cursor->position = low;
+        if (cursor->position < cursor->count) {
+            return 1;
+        }
+    }
+    cursor->day = cursor->last_day + 1;
+    return 0;
+}
+
+size_t tsdb_cursor_next(tsdb_cursor* cursor, int64_t* times, float* temperature, float* humidity, size_t max) {
+    size_t copied = 0;
+    while (copied < max) {
+        if (cursor->position == cursor->count && !cursor_load(cursor)) {
+            break;
+        }
+        size_t n = cursor->count - cursor->position;
+        if (n > max - copied) {
+            n = max - copied;
+        }
+        /* Readings are in time order, stop at the first one past the range */
+        while (n > 0 && cursor->times[cursor->position + n - 1] > cursor->to) {
+            n--;
+        }
+        if (n == 0) {
+            cursor->position = cursor->count = 0;
+            cursor_unmap(cursor);
+            cursor->day = cursor->last_day + 1;
+            break;
+        }
+        memcpy(times + copied, cursor->times + cursor->position, n * sizeof(int64_t));
+        memcpy(temperature + copied, cursor->temperature + cursor->position, n * sizeof(float));
+        memcpy(humidity + copied, cursor->humidity + cursor->position, n * sizeof(float));
+        cursor->position += n;
+        copied += n;
+    }
+    return copied;
+}
+
+void tsdb_cursor_close(tsdb_cursor* cursor) {
+    cursor_unmap(cursor);
+}
+
+void tsdb_get_stats(tsdb* db, tsdb_stats* stats) {
+    pthread_mutex_lock(&db->lock);
+    *stats = db->stats;
+    pthread_mutex_unlock(&db->lock);
+}
+
+void tsdb_close(tsdb* db) {
+    pthread_mutex_lock(&db->lock);
+    close_segment(db);
+    pthread_mutex_unlock(&db->lock);
+    pthread_mutex_destroy(&db->lock);
+}
@@ -0,0 +1,137 @@
+/*
+ * Append-only columnar store for the reading history of one sensor.
+ *
+ * Readings are kept in one memory mapped segment file per UTC day. A
+ * segment holds blocks of up to TSDB_BLOCK_POINTS readings, each block
+ * stores its timestamps, temperatures and humidities as separate
+ * compressed columns: timestamps delta-of-delta encoded, values XOR
+ * encoded against the previous value (as in Facebook's Gorilla). At the
+ * front of each segment a sparse index has the time span and offset of
+ * every block, so a range scan only decodes the blocks it overlaps.
+ *
+ * Timestamps are kept to a resolution chosen per store, readings on a
+ * regular grid then take one bit for their time.
+ *
+ * The open block is written in place and is recovered after a crash, up
+ * to the last complete append. Several sensors use one tsdb each, in
+ * directories of their own.
+ */
+
+#ifndef TSDB_H
+#define TSDB_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Readings per block */
+#define TSDB_BLOCK_POINTS 1024
+/* Blocks per day segment, 85 a day are needed at one reading a second */
+#define TSDB_INDEX_BLOCKS 96
+#define TSDB_PATH_MAX 256
+
+#define TSDB_DAY_MS (24 * 3600 * 1000LL)
+
+typedef struct {
+    uint32_t first;             /* time of the first reading, ms since the start of the day */
+    uint32_t last;              /* time of the last reading */
+    uint32_t offset;            /* of the block in the segment */
+    uint16_t count;             /* readings in the block */
+    uint16_t bytes;             /* block size once sealed, 0 while open */
+} tsdb_index_entry;
+
+/* Encoder state of one value column */
+typedef struct {
+    uint32_t previous;          /* bits of the previous value */
+    uint32_t bits;              /* stream length */
+    uint8_t leading;            /* window of the last XOR written out in full */
+    uint8_t trailing;
+    uint8_t decimal;            /* values are stored times ten */
+} tsdb_value_column;
+
+/* Encoder state of the open block */
+typedef struct {
+    int64_t previous_time;
+    int64_t previous_delta;
+    uint32_t time_bits;
+    tsdb_value_column temperature;
+    tsdb_value_column humidity;
+} tsdb_block_state;
+
+typedef struct {
+    unsigned long points;       /* readings appended */
+    unsigned long rejected;     /* readings older than the last one, or a full day */
+    unsigned long blocks;       /* blocks sealed */
+    unsigned long bytes;        /* compressed size of the sealed blocks */
+} tsdb_stats;
+
+typedef struct {
+    char dir[TSDB_PATH_MAX];
+    pthread_mutex_t lock;
+    int fd;                     /* open segment, -1 = none */
+    int64_t day;                /* days since the epoch of the open segment */
+    uint8_t* map;
+    int64_t resolution;         /* ms, for new segments */
+    int64_t last_time;          /* newest reading stored, for ordering */
+    tsdb_block_state state;     /* of the open block, if the segment has one */
+    tsdb_stats stats;
+} tsdb;
+
+typedef struct {
+    tsdb* db;
+    int64_t from;
+    int64_t to;
+    int64_t day;                /* segment being scanned */
+    int64_t last_day;           /* last segment that can match */
+    int fd;
+    const uint8_t* map;
+    uint32_t block;             /* next block in the segment's index */
+    size_t position;            /* next reading in the decoded block */
+    size_t count;               /* readings in the decoded block */
+    int64_t times[TSDB_BLOCK_POINTS];
+    float temperature[TSDB_BLOCK_POINTS];
+    float humidity[TSDB_BLOCK_POINTS];
+} tsdb_cursor;
+
+/*
+ * Open the store in dir, creating the directory if needed.
+ * @param resolution_ms timestamps are rounded down to a multiple of this,
+ * 1 keeps them exact. Existing segments keep the one they were made with.
+ * Returns 0 on success, -1 on failure.
+ */
+int tsdb_open(tsdb* db, const char* dir, int64_t resolution_ms);
+
+/*
+ * Append a reading, thread safe. Readings must come in time order, older
+ * ones are rejected.
+ * Returns 0 on success, -1 if the reading was not stored.
+ */
+int tsdb_append(tsdb* db, int64_t time_ms, float temperature, float humidity);
+
+/*
+ * Start a scan of the readings with from <= time <= to. Only the days
+ * between the oldest and the newest segment on disk are visited, however
+ * wide the range. The cursor is large, allocate it statically or on the
+ * heap.
+ */
+void tsdb_cursor_open(tsdb_cursor* cursor, tsdb* db, int64_t from, int64_t to);
+
+/*
+ * Copy up to max of the next readings of the scan into the columns.
+ * Returns the number copied, 0 at the end of the range.
+ */
+size_t tsdb_cursor_next(tsdb_cursor* cursor, int64_t* times, float* temperature, float* humidity, size_t max);
+
+void tsdb_cursor_close(tsdb_cursor* cursor);
+
+/*
+ * Copy the counters into stats, thread safe.
+ */
+void tsdb_get_stats(tsdb* db, tsdb_stats* stats);
+
+/*
+ * Seal the open block and close the store.
+ */
+void tsdb_close(tsdb* db);
+
+#endif /* TSDB_H */
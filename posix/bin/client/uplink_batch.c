@@ -0,0 +1,471 @@
+/*
+ * Batched uplink of readings as data messages, see uplink_batch.h
+ *
+ * A message must stay valid until the dispatcher reports it delivered or
+ * failed, so messages come from a fixed pool of slots that are handed back
+ * in the dispatcher callbacks. The dispatcher queues a copy of every
+ * message and calls back with that, so a slot is found from its number in
+ * user_data, never from the message's address.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "iotcs.h"
+#include "iotcs_device.h"
+#include "advanced/iotcs_messaging.h"
+#include "common_dht_read.h"
+#include "log_sink.h"
+#include "metrics.h"
+#include "uplink_batch.h"
+
+typedef struct {
+    iotcs_message message;
+    iotcs_value values[UPLINK_BATCH_SUMMARY_ITEMS];
+    sensor_reading reading;
+    uint32_t tag;               /* for the handlers */
+    int summary;                /* carries a rollup bucket, not the reading */
+    uint64_t queued_ns;         /* monotonic time it was handed to the library */
+    int in_use;
+} message_slot;
+
+static const iotcs_data_item_desc items_desc[] = {
+    { IOTCS_VALUE_TYPE_NUMBER, "temperature" },
+    { IOTCS_VALUE_TYPE_NUMBER, "humidity" },
+    { IOTCS_VALUE_TYPE_NONE, NULL }
+};
+
+static const iotcs_data_item_desc summary_items_desc[] = {
+    { IOTCS_VALUE_TYPE_INT, "period" },
+    { IOTCS_VALUE_TYPE_INT, "count" },
+    { IOTCS_VALUE_TYPE_NUMBER, "temperatureMin" },
+    { IOTCS_VALUE_TYPE_NUMBER, "temperatureMax" },
+    { IOTCS_VALUE_TYPE_NUMBER, "temperatureMean" },
+    { IOTCS_VALUE_TYPE_NUMBER, "temperatureStddev" },
+    { IOTCS_VALUE_TYPE_NUMBER, "humidityMin" },
+    { IOTCS_VALUE_TYPE_NUMBER, "humidityMax" },
+    { IOTCS_VALUE_TYPE_NUMBER, "humidityMean" },
+    { IOTCS_VALUE_TYPE_NUMBER, "humidityStddev" },
+    { IOTCS_VALUE_TYPE_NONE, NULL }
+};
+
+static iotcs_message_base message_base;
+static iotcs_data_message_base data_base;
+static iotcs_data_message_base summary_base;
+static size_t batch_limit;
+static uint64_t batch_age_ns;
+
+/* Readings waiting for a flush, only touched by the upload thread */
+static sensor_reading batch[UPLINK_BATCH_MAX];
+static size_t batch_count;
+static uint64_t batch_started;
+
+/* Message slots, released from the dispatcher thread */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released = PTHREAD_COND_INITIALIZER;
+static message_slot slots[UPLINK_BATCH_MAX];
+static size_t slots_in_use;
+static uplink_batch_stats stats;
+static uplink_batch_handler delivered_handler;
+static uplink_batch_handler failed_handler;
+static int callbacks_set;
+
+/* Virtual device updates waiting for their report, oldest first, under the lock */
+typedef struct {
+    int64_t event_time;
+    uint64_t queued_ns;
+} pending_update;
+static pending_update updates[UPLINK_BATCH_MAX];
+static size_t updates_head;
+static size_t updates_count;
+
+/* Key of a slot in its messages' user_data, 0 is never used */
+static void* slot_key(const message_slot* slot) {
+    return (void*)(uintptr_t)(slot - slots + 1);
+}
+
+/* Called with the lock held */
+static message_slot* slot_of(const iotcs_message* message) {
+    /* The callbacks see every message the library sends, ours have our base */
+    if (message->base != &message_base) {
+        return NULL;
+    }
+    uintptr_t key = (uintptr_t)message->user_data;
+    if (key == 0 || key > UPLINK_BATCH_MAX || !slots[key - 1].in_use) {
+        return NULL;
+    }
+    return &slots[key - 1];
+}
+
+static void release(message_slot* slot, int delivered) {
+    uplink_batch_handler handler = delivered ? delivered_handler : failed_handler;
+    if (delivered) {
+        metrics_record(METRIC_UPLOAD, monotonic_nanoseconds() - slot->queued_ns);
+        if (!slot->summary) {
+            metrics_record_delivery(slot->reading.event_time);
+        }
+    }
+    if (handler && !slot->summary) {
+        /* Before the slot can be reused */
+        handler(&slot->reading, slot->tag);
+    }
+    pthread_mutex_lock(&lock);
+    slot->in_use = 0;
+    slots_in_use--;
+    if (delivered) {
+        stats.delivered++;
+    } else {
+        stats.failed++;
+    }
+    pthread_cond_broadcast(&released);
+    pthread_mutex_unlock(&lock);
+}
+
+#ifdef IOTCS_MESSAGE_DISPATCHER
+/*
+ * The library's own dispatcher callbacks, which ours replace, pass every
+ * message on to this. It frees the messages of virtual device updates and
+ * alerts and releases their device handles, so everything that is not
+ * ours must still go there. The library has no way to get the callbacks
+ * that were set, and does not declare this in its headers.
+ */
+extern void device_model_handle_send(iotcs_message* message, iotcs_result result, const char* fail_reason);
+
+/* A data message that is not ours is the next virtual device update */
+static void update_reported(const iotcs_message* message, int delivered) {
+    pending_update update;
+    if (message->base == NULL || message->base->type != IOTCS_MESSAGE_DATA) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    int found = updates_count > 0;
+    if (found) {
+        update = updates[updates_head];
+        updates_head = (updates_head + 1) % UPLINK_BATCH_MAX;
+        updates_count--;
+    }
+    pthread_mutex_unlock(&lock);
+    if (found && delivered) {
+        metrics_record(METRIC_UPLOAD, monotonic_nanoseconds() - update.queued_ns);
+        metrics_record_delivery(update.event_time);
+    }
+}
+
+static void on_delivery(iotcs_message* message) {
+    pthread_mutex_lock(&lock);
+    message_slot* slot = slot_of(message);
+    pthread_mutex_unlock(&lock);
+    if (slot) {
+        release(slot, 1);
+    } else {
+        update_reported(message, 1);
+        device_model_handle_send(message, IOTCS_RESULT_OK, NULL);
+    }
+}
+
+static void on_error(iotcs_message* message, iotcs_result result, const char* fail_reason) {
+    pthread_mutex_lock(&lock);
+    message_slot* slot = slot_of(message);
+    pthread_mutex_unlock(&lock);
+    if (slot) {
+        log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, %s from %lld not delivered (%d): %s\n",
+                slot->summary ? "summary" : "reading", (long long)message->event_time, result, fail_reason ? fail_reason : "unknown");
+        release(slot, 0);
+    } else {
+        update_reported(message, 0);
+        device_model_handle_send(message, result, fail_reason);
+    }
+}
+#endif
+
+static void set_callbacks(void) {
+#ifdef IOTCS_MESSAGE_DISPATCHER
+    if (!callbacks_set) {
+        iotcs_message_dispatcher_set_delivery_callback(on_delivery);
+        iotcs_message_dispatcher_set_error_callback(on_error);
+        callbacks_set = 1;
+    }
+#endif
+}
+
+int uplink_batch_init(const char* format, size_t max_readings, uint32_t max_age_ms) {
+    if (format == NULL || max_readings == 0 || max_readings > UPLINK_BATCH_MAX) {
+        return -1;
+    }
+    memset(&message_base, 0, sizeof(message_base));
+    message_base.type = IOTCS_MESSAGE_DATA;
+    message_base.source = iotcs_get_endpoint_id();
+    message_base.priority = IOTCS_MESSAGE_PRIORITY_DEFAULT;
+    message_base.reliability = IOTCS_MESSAGE_RELIABILITY_DEFAULT;
+    data_base.format = format;
+    summary_base.format = NULL;
+    batch_limit = max_readings;
+    batch_age_ns = (uint64_t)max_age_ms * 1000000ULL;
+    batch_count = 0;
+    memset(slots, 0, sizeof(slots));
+    slots_in_use = 0;
+    memset(&stats, 0, sizeof(stats));
+    set_callbacks();
+    return 0;
+}
+
+void uplink_batch_track_updates(void) {
+    set_callbacks();
+}
+
+void uplink_batch_note_update(const sensor_reading* reading) {
+    pthread_mutex_lock(&lock);
+    if (updates_count == UPLINK_BATCH_MAX) {
+        /* Never reported, its time is lost */
+        updates_head = (updates_head + 1) % UPLINK_BATCH_MAX;
+        updates_count--;
+    }
+    pending_update* update = &updates[(updates_head + updates_count) % UPLINK_BATCH_MAX];
+    update->event_time = reading->event_time;
+    update->queued_ns = monotonic_nanoseconds();
+    updates_count++;
+    pthread_mutex_unlock(&lock);
+}
+
+int uplink_batch_add(const sensor_reading* reading) {
+    if (batch_count == UPLINK_BATCH_MAX) {
+        /* Every slot is in flight and the batch is full, the oldest goes */
+        memmove(batch, batch + 1, (UPLINK_BATCH_MAX - 1) * sizeof(batch[0]));
+        batch_count--;
+        pthread_mutex_lock(&lock);
+        stats.dropped++;
+        pthread_mutex_unlock(&lock);
+    }
+    if (batch_count == 0) {
+        batch_started = monotonic_nanoseconds();
+    }
+    batch[batch_count++] = *reading;
+    return batch_count >= batch_limit;
+}
+
+int uplink_batch_timeout_ms(void) {
+    if (batch_count == 0) {
+        return -1;
+    }
+    uint64_t now = monotonic_nanoseconds();
+    uint64_t due = batch_started + batch_age_ns;
+    if (now >= due) {
+        return 0;
+    }
+    /* Round up so the wait does not wake just short of the deadline */
+    return (int)((due - now + 999999ULL) / 1000000ULL);
+}
+
+static message_slot* take_slot(void) {
+    size_t i;
+    for (i = 0; i < UPLINK_BATCH_MAX; i++) {
+        if (!slots[i].in_use) {
+            slots[i].in_use = 1;
+            slots_in_use++;
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+static void fill_message(message_slot* slot, const sensor_reading* reading, uint32_t tag) {
+    memset(&slot->message, 0, sizeof(slot->message));
+    slot->reading = *reading;
+    slot->tag = tag;
+    slot->summary = 0;
+    slot->values[0].number_value = reading->temperature;
+    slot->values[1].number_value = reading->humidity;
+    slot->message.base = &message_base;
+    slot->message.event_time = (uint64_t)reading->event_time;
+    slot->message.user_data = slot_key(slot);
+    slot->message.u.data.base = &data_base;
+    slot->message.u.data.items_desc = items_desc;
+    slot->message.u.data.items_value = slot->values;
+}
+
+#ifdef IOTCS_MESSAGE_DISPATCHER
+static size_t queue_messages(message_slot** taken, size_t count) {
+    size_t i, queued = 0;
+    for (i = 0; i < count; i++) {
+        taken[i]->queued_ns = monotonic_nanoseconds();
+        if (iotcs_message_dispatcher_queue(&taken[i]->message) == IOTCS_RESULT_OK) {
+            queued++;
+        } else {
+            release(taken[i], 0);
+        }
+    }
+    return queued;
+}
+#else
+static size_t queue_messages(message_slot** taken, size_t count) {
+    iotcs_message messages[IOTCS_MAX_MESSAGES_FOR_SEND];
+    size_t i, j, queued = 0;
+    /* Without the dispatcher the library sends arrays synchronously */
+    for (i = 0; i < count; i += IOTCS_MAX_MESSAGES_FOR_SEND) {
+        size_t n = count - i < IOTCS_MAX_MESSAGES_FOR_SEND ? count - i : IOTCS_MAX_MESSAGES_FOR_SEND;
+        for (j = 0; j < n; j++) {
+            taken[i + j]->queued_ns = monotonic_nanoseconds();
+            messages[j] = taken[i + j]->message;
+        }
+        int sent = iotcs_send(messages, n) == IOTCS_RESULT_OK;
+        for (j = 0; j < n; j++) {
+            release(taken[i + j], sent);
+        }
+        queued += sent ? n : 0;
+    }
+    return queued;
+}
+#endif
+
+/* Queue up to count readings, returns how many got a message slot */
+static size_t send_readings(const sensor_reading* readings, const uint32_t* tags, size_t count) {
+    message_slot* taken[UPLINK_BATCH_MAX];
+    size_t taken_count = 0, queued;
+
+    if (count > UPLINK_BATCH_MAX) {
+        count = UPLINK_BATCH_MAX;
+    }
+    pthread_mutex_lock(&lock);
+    while (taken_count < count) {
+        message_slot* slot = take_slot();
+        if (slot == NULL) {
+            stats.deferred++;
+            break;
+        }
+        fill_message(slot, &readings[taken_count], tags ? tags[taken_count] : 0);
+        taken[taken_count++] = slot;
+    }
+    pthread_mutex_unlock(&lock);
+
+    /* Queue back to back so the dispatcher finds them together */
+    queued = queue_messages(taken, taken_count);
+
+    pthread_mutex_lock(&lock);
+    stats.queued += queued;
+    if (queued > 0) {
+        stats.batches++;
+    }
+    pthread_mutex_unlock(&lock);
+    return taken_count;
+}
+
+size_t uplink_batch_flush(void) {
+    size_t i, count = send_readings(batch, NULL, batch_count);
+
+    /* Readings without a slot wait for the next flush */
+    for (i = count; i < batch_count; i++) {
+        batch[i - count] = batch[i];
+    }
+    batch_count -= count;
+    if (batch_count > 0) {
+        batch_started = monotonic_nanoseconds();
+    }
+    return count;
+}
+
+size_t uplink_batch_send(const sensor_reading* readings, const uint32_t* tags, size_t count) {
+    return send_readings(readings, tags, count);
+}
+
+void uplink_batch_set_summary_format(const char* format) {
+    summary_base.format = format;
+}
+
+int uplink_batch_send_summary(const rollup_bucket* bucket) {
+    message_slot* slot;
+    if (summary_base.format == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&lock);
+    slot = take_slot();
+    if (slot == NULL) {
+        stats.deferred++;
+    }
+    pthread_mutex_unlock(&lock);
+    if (slot == NULL) {
+        return -1;
+    }
+
+    memset(&slot->message, 0, sizeof(slot->message));
+    memset(&slot->reading, 0, sizeof(slot->reading));
+    slot->tag = 0;
+    slot->summary = 1;
+    slot->values[0].int_value = (int)(bucket->length / 1000);
+    slot->values[1].int_value = (int)bucket->count;
+    slot->values[2].number_value = bucket->temperature.min;
+    slot->values[3].number_value = bucket->temperature.max;
+    slot->values[4].number_value = bucket->temperature.mean;
+    slot->values[5].number_value = bucket->temperature.stddev;
+    slot->values[6].number_value = bucket->humidity.min;
+    slot->values[7].number_value = bucket->humidity.max;
+    slot->values[8].number_value = bucket->humidity.mean;
+    slot->values[9].number_value = bucket->humidity.stddev;
+    slot->message.base = &message_base;
+    /* Stamped with the start of the bucket */
+    slot->message.event_time = (uint64_t)bucket->start;
+    slot->message.user_data = slot_key(slot);
+    slot->message.u.data.base = &summary_base;
+    slot->message.u.data.items_desc = summary_items_desc;
+    slot->message.u.data.items_value = slot->values;
+
+    size_t queued = queue_messages(&slot, 1);
+    pthread_mutex_lock(&lock);
+    stats.queued += queued;
+    stats.summaries += queued;
+    pthread_mutex_unlock(&lock);
+    /* A refused message was released, the bucket is still kept locally */
+    return 0;
+}
+
+size_t uplink_batch_free_slots(void) {
+    size_t free_slots;
+    pthread_mutex_lock(&lock);
+    free_slots = UPLINK_BATCH_MAX - slots_in_use;
+    pthread_mutex_unlock(&lock);
+    return free_slots;
+}
+
+uint32_t uplink_batch_oldest_ms(void) {
+    uint64_t now = monotonic_nanoseconds(), oldest = now;
+    size_t i;
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < UPLINK_BATCH_MAX; i++) {
+        if (slots[i].in_use && slots[i].queued_ns < oldest) {
+            oldest = slots[i].queued_ns;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return (uint32_t)((now - oldest) / 1000000ULL);
+}
+
+void uplink_batch_set_handlers(uplink_batch_handler delivered, uplink_batch_handler failed) {
+    delivered_handler = delivered;
+    failed_handler = failed;
+}
+
+void uplink_batch_get_stats(uplink_batch_stats* copy) {
+    pthread_mutex_lock(&lock);
+    *copy = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+void uplink_batch_finalize(int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&lock);
+    while (slots_in_use > 0) {
+        if (pthread_cond_timedwait(&released, &lock, &deadline) != 0) {
+            log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, %u readings still in flight\n", (unsigned int)slots_in_use);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,135 @@
+/*
+ * Batched uplink of readings as data messages.
+ *
+ * The virtual device API turns every reading into a request of its own.
+ * Here readings are collected and then queued as data messages in one go,
+ * each carrying the time it was sampled, which lets the library pack up to
+ * IOTCS_MAX_MESSAGES_FOR_SEND of them into a single request. A batch is
+ * flushed when it is full or its oldest reading reaches the age limit.
+ */
+
+#ifndef UPLINK_BATCH_H
+#define UPLINK_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "reading.h"
+#include "rollup.h"
+
+/* Most readings in one batch, also the number of messages in flight */
+#define UPLINK_BATCH_MAX 32
+/* Values in a summary message */
+#define UPLINK_BATCH_SUMMARY_ITEMS 10
+
+typedef struct {
+    unsigned long batches;      /* flushes that queued at least one message */
+    unsigned long queued;       /* data messages handed to the library */
+    unsigned long delivered;    /* messages the server accepted */
+    unsigned long failed;       /* messages the library gave up on */
+    unsigned long deferred;     /* flushes cut short by messages in flight */
+    unsigned long dropped;      /* readings pushed out of a full batch */
+    unsigned long summaries;    /* rollup summaries handed to the library */
+} uplink_batch_stats;
+
+/*
+ * Called from the library's dispatcher thread for each reading that was
+ * delivered, or that was not and will not be retried by the library.
+ * tag is what the reading was sent with, 0 for batched readings.
+ */
+typedef void (*uplink_batch_handler)(const sensor_reading* reading, uint32_t tag);
+
+/*
+ * Set up batching of data messages in the given format, for example
+ * "urn:com:oracle:demo:esensor:attributes".
+ * @param max_readings flush when this many readings are waiting
+ * @param max_age_ms flush when the oldest reading is this old
+ * Returns 0 on success, -1 on bad arguments.
+ */
+int uplink_batch_init(const char* format, size_t max_readings, uint32_t max_age_ms);
+
+/*
+ * Set the dispatcher callbacks for timing virtual device updates, when
+ * readings are not batched and uplink_batch_init is not called.
+ */
+void uplink_batch_track_updates(void);
+
+/*
+ * Note that a virtual device update of reading is about to be finished.
+ * Updates are matched in order with the data messages not ours that the
+ * dispatcher reports, and the delivered ones are timed like batched
+ * readings. Only the newest UPLINK_BATCH_MAX wait for their report.
+ */
+void uplink_batch_note_update(const sensor_reading* reading);
+
+/*
+ * Add a reading to the batch.
+ * Returns 1 if the batch is now full and should be flushed, 0 otherwise.
+ */
+int uplink_batch_add(const sensor_reading* reading);
+
+/*
+ * Milliseconds until the batch must be flushed for age, 0 if it is due
+ * now, -1 if the batch is empty.
+ */
+int uplink_batch_timeout_ms(void);
+
+/*
+ * Queue everything in the batch as data messages.
+ * Returns the number of readings taken, readings that found no free
+ * message slot stay in the batch for the next flush. Readings the library
+ * refused go to the failure handler.
+ */
+size_t uplink_batch_flush(void);
+
+/*
+ * Queue readings as data messages right away, bypassing the batch. Each
+ * is handed to the handlers with its tag from tags, NULL for all 0.
+ * Returns the number taken, which is less than count when message slots
+ * run out. Readings the library refused go to the failure handler.
+ */
+size_t uplink_batch_send(const sensor_reading* readings, const uint32_t* tags, size_t count);
+
+/*
+ * Send rollup summaries as data messages in the given format, for example
+ * "urn:com:oracle:demo:esensor:summary", NULL for none. A summary has the
+ * bucket's length in secs as "period", its "count", and min, max, mean
+ * and stddev of temperature and humidity ("temperatureMin" and so on),
+ * and carries the start of the bucket as its event time.
+ */
+void uplink_batch_set_summary_format(const char* format);
+
+/*
+ * Queue a rollup summary as a data message right away. Summaries the
+ * library gives up on are not handed to the failure handler.
+ * Returns 0 when it got a message slot, -1 if none was free or no
+ * summary format is set.
+ */
+int uplink_batch_send_summary(const rollup_bucket* bucket);
+
+/*
+ * Number of message slots not in flight.
+ */
+size_t uplink_batch_free_slots(void);
+
+/*
+ * Milliseconds the oldest message in flight has waited for the library to
+ * report it delivered or failed, 0 when none is in flight.
+ */
+uint32_t uplink_batch_oldest_ms(void);
+
+/*
+ * Set the handlers for delivered and failed readings, NULL for none.
+ */
+void uplink_batch_set_handlers(uplink_batch_handler delivered, uplink_batch_handler failed);
+
+/*
+ * Copy the counters into stats.
+ */
+void uplink_batch_get_stats(uplink_batch_stats* stats);
+
+/*
+ * Wait up to timeout_ms for queued messages to be delivered or fail.
+ */
+void uplink_batch_finalize(int timeout_ms);
+
+#endif /* UPLINK_BATCH_H */
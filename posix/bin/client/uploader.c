@@ -0,0 +1,460 @@
+/*
+ * Upload thread, see uploader.h
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "common_dht_read.h"
+#include "dht_trace.h"
+#include "log_sink.h"
+#include "metrics.h"
+#include "uploader.h"
+
+/* Time given to batched messages still in flight when stopping */
+#define UPLOADER_DRAIN_MS 5000
+/* Wait before probing a down uplink with spooled readings, doubled up to the max */
+#define UPLOADER_RETRY_MIN_MS 5000
+#define UPLOADER_RETRY_MAX_MS 300000
+/* How often replay tops up while the spool drains */
+#define UPLOADER_REPLAY_TICK_MS 100
+
+static uploader_connect connect_uplink;
+static iotcs_virtual_device_handle device_handle;
+static uploader_config config;
+static int batching;
+static pthread_t thread;
+static atomic_int running;
+static int failed_fd = -1;
+static atomic_int connected;    /* 0 while connecting, 1 when up, -1 when it gave up */
+static reading_ring ring;
+static deadband filter;
+static atomic_ulong sent;
+static atomic_ulong failed;
+static int spooling;
+static atomic_int uplink_down;
+static atomic_int reports_missing;
+static uint64_t retry_at;
+static uint32_t retry_ms;
+static double replay_tokens;
+static uint64_t replay_refilled;
+/*
+ * The slice of the spool being replayed. A reading leaves the spool only
+ * once it and every one before it were delivered, a failed one stays at
+ * the head and the next slice starts over from there.
+ */
+typedef enum {
+    REPLAY_IN_FLIGHT,
+    REPLAY_DELIVERED,
+    REPLAY_FAILED
+} replay_state;
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static spool_position replay_positions[UPLINK_BATCH_MAX];
+static replay_state replay_states[UPLINK_BATCH_MAX];
+static size_t replay_sent;
+static size_t replay_reported;
+static size_t replay_consumed;
+static pthread_mutex_t summary_lock = PTHREAD_MUTEX_INITIALIZER;
+static rollup_bucket summaries[UPLOADER_SUMMARY_QUEUE];
+static size_t summary_count;
+static unsigned long summaries_dropped;
+
+static int upload(const sensor_reading* reading) {
+    iotcs_result rv;
+    uint64_t started = monotonic_nanoseconds();
+    iotcs_virtual_device_start_update(device_handle);
+    TRACE_BEGIN("set_float temperature");
+    rv = iotcs_virtual_device_set_float(device_handle, "temperature", reading->temperature);
+    TRACE_END("set_float temperature", rv);
+    if (rv != IOTCS_RESULT_OK) {
+        log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs_virtual_device_set_float method 1 failed\n");
+        /* Still finish the update so the next one can start */
+        iotcs_virtual_device_finish_update(device_handle);
+        return -1;
+    }
+    TRACE_BEGIN("set_float humidity");
+    rv = iotcs_virtual_device_set_float(device_handle, "humidity", reading->humidity);
+    TRACE_END("set_float humidity", rv);
+    if (rv != IOTCS_RESULT_OK) {
+        log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs_virtual_device_set_float method 2 failed\n");
+        iotcs_virtual_device_finish_update(device_handle);
+        return -1;
+    }
+    /* Only queues the update, the dispatcher callbacks time its delivery */
+    uplink_batch_note_update(reading);
+    TRACE_BEGIN("finish_update");
+    iotcs_virtual_device_finish_update(device_handle);
+    TRACE_END("finish_update", 0);
+    metrics_record(METRIC_ENQUEUE, monotonic_nanoseconds() - started);
+    return 0;
+}
+
+/* Dispatcher thread: keep what did not get through, a replayed reading still is */
+static void on_failed(const sensor_reading* reading, uint32_t tag) {
+    atomic_store(&uplink_down, 1);
+    atomic_store(&reports_missing, 0);
+    if (tag) {
+        pthread_mutex_lock(&replay_lock);
+        replay_states[tag - 1] = REPLAY_FAILED;
+        replay_reported++;
+        pthread_mutex_unlock(&replay_lock);
+    } else if (spool_append(reading) != 0) {
+        log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not spool reading from %lld\n", (long long)reading->event_time);
+    }
+}
+
+/* Dispatcher thread: a replayed reading leaves the spool only here */
+static void on_delivered(const sensor_reading* reading, uint32_t tag) {
+    (void)reading;
+    atomic_store(&uplink_down, 0);
+    atomic_store(&reports_missing, 0);
+    if (tag == 0) {
+        return;
+    }
+    spool_position last;
+    pthread_mutex_lock(&replay_lock);
+    size_t before = replay_consumed;
+    replay_states[tag - 1] = REPLAY_DELIVERED;
+    replay_reported++;
+    while (replay_consumed < replay_sent && replay_states[replay_consumed] == REPLAY_DELIVERED) {
+        replay_consumed++;
+    }
+    int advanced = replay_consumed > before;
+    if (advanced) {
+        last = replay_positions[replay_consumed - 1];
+    }
+    pthread_mutex_unlock(&replay_lock);
+    /* Consuming a position already consumed changes nothing */
+    if (advanced) {
+        spool_consume(&last);
+    }
+}
+
+/* Send a rate limited slice of the spool, returns ms until the next try or -1 */
+static int replay(void) {
+    sensor_reading readings[UPLINK_BATCH_MAX];
+    uint32_t tags[UPLINK_BATCH_MAX];
+    uint64_t now = monotonic_nanoseconds();
+    size_t i;
+
+    pthread_mutex_lock(&replay_lock);
+    int busy = replay_reported < replay_sent;
+    pthread_mutex_unlock(&replay_lock);
+    if (busy) {
+        /* The last slice is not reported yet */
+        return UPLOADER_REPLAY_TICK_MS;
+    }
+    if (spool_pending() == 0) {
+        return -1;
+    }
+    if (atomic_load(&uplink_down)) {
+        if (now < retry_at) {
+            return (int)((retry_at - now) / 1000000ULL) + 1;
+        }
+        /* Probe with what the bucket allows, back off further if it fails */
+        retry_at = now + (uint64_t)retry_ms * 1000000ULL;
+        retry_ms = retry_ms * 2 > UPLOADER_RETRY_MAX_MS ? UPLOADER_RETRY_MAX_MS : retry_ms * 2;
+    } else {
+        retry_ms = UPLOADER_RETRY_MIN_MS;
+    }
+
+    replay_tokens += (double)(now - replay_refilled) * config.replay_rate / 1e9;
+    if (replay_tokens > UPLINK_BATCH_MAX) {
+        replay_tokens = UPLINK_BATCH_MAX;
+    }
+    replay_refilled = now;
+
+    size_t count = (size_t)replay_tokens;
+    size_t free_slots = uplink_batch_free_slots();
+    if (count > free_slots) {
+        count = free_slots;
+    }
+    pthread_mutex_lock(&replay_lock);
+    count = spool_peek(readings, replay_positions, count);
+    for (i = 0; i < count; i++) {
+        tags[i] = (uint32_t)i + 1;
+        replay_states[i] = REPLAY_IN_FLIGHT;
+    }
+    /* Set before sending, the reports can come at once */
+    replay_sent = count;
+    replay_reported = 0;
+    replay_consumed = 0;
+    pthread_mutex_unlock(&replay_lock);
+    if (count > 0) {
+        size_t taken = uplink_batch_send(readings, tags, count);
+        pthread_mutex_lock(&replay_lock);
+        replay_sent = taken;
+        pthread_mutex_unlock(&replay_lock);
+        replay_tokens -= taken;
+    }
+    return UPLOADER_REPLAY_TICK_MS;
+}
+
+/* Send the queued summaries, returns ms until the next try or -1 */
+static int send_summaries(void) {
+    rollup_bucket bucket;
+    for (;;) {
+        pthread_mutex_lock(&summary_lock);
+        if (summary_count == 0) {
+            pthread_mutex_unlock(&summary_lock);
+            return -1;
+        }
+        bucket = summaries[0];
+        pthread_mutex_unlock(&summary_lock);
+        if (uplink_batch_send_summary(&bucket) != 0) {
+            /* Every message slot is in flight */
+            return UPLOADER_REPLAY_TICK_MS;
+        }
+        pthread_mutex_lock(&summary_lock);
+        /* Unless submit pushed it out meanwhile */
+        if (summary_count > 0 && summaries[0].start == bucket.start && summaries[0].level == bucket.level) {
+            memmove(summaries, summaries + 1, (summary_count - 1) * sizeof(summaries[0]));
+            summary_count--;
+        }
+        pthread_mutex_unlock(&summary_lock);
+    }
+}
+
+/* Check that the library reports what is in flight, returns ms until the next check or -1 */
+static int check_reports(void) {
+    uint32_t oldest = uplink_batch_oldest_ms();
+    if (oldest == 0) {
+        return -1;
+    }
+    if (oldest < UPLOADER_REPORT_TIMEOUT_MS) {
+        return (int)(UPLOADER_REPORT_TIMEOUT_MS - oldest) + 1;
+    }
+    if (!atomic_exchange(&reports_missing, 1)) {
+        log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs: Error, no delivery report for %u secs, readings are spooled until one comes\n",
+                oldest / 1000);
+    }
+    atomic_store(&uplink_down, 1);
+    return -1;
+}
+
+static int earliest(int a, int b) {
+    if (a < 0) {
+        return b;
+    }
+    return b < 0 || a < b ? a : b;
+}
+
+/* Bring up the uplink, returns 0 when uploads can start */
+static int connect_and_prepare(void) {
+    if (connect_uplink(!batching, &device_handle) != 0 || (!batching && device_handle == NULL)) {
+        return -1;
+    }
+    if (batching && uplink_batch_init(config.format, config.batch_size, config.batch_age_ms) != 0) {
+        log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, bad upload batch settings, uploads are off\n");
+        return -1;
+    }
+    if (!batching) {
+        uplink_batch_track_updates();
+    }
+    if (spooling) {
+        uplink_batch_set_handlers(on_delivered, on_failed);
+    }
+    uplink_batch_set_summary_format(config.summary_format);
+    return 0;
+}
+
+static void* connect_main(void* arg) {
+    (void)arg;
+    atomic_store(&connected, connect_and_prepare() == 0 ? 1 : -1);
+    reading_ring_wake(&ring);
+    return NULL;
+}
+
+/* Move what was sampled to the spool, without one it waits in the ring */
+static void spool_ring(void) {
+    sensor_reading reading;
+    while (spooling && reading_ring_pop(&ring, &reading)) {
+        if (deadband_check(&filter, &reading)) {
+            spool_append(&reading);
+        }
+    }
+}
+
+static void* uploader_main(void* arg) {
+    (void)arg;
+    TRACE_THREAD("upload");
+    sensor_reading reading;
+    pthread_t connector;
+    /* Connecting can take minutes, the ring only holds a few readings */
+    if (pthread_create(&connector, NULL, connect_main, NULL) == 0) {
+        while (atomic_load(&connected) == 0) {
+            spool_ring();
+            reading_ring_wait(&ring, -1);
+        }
+        pthread_join(connector, NULL);
+    } else {
+        connect_main(NULL);
+    }
+    if (atomic_load(&connected) < 0) {
+        uint64_t one = 1;
+        if (write(failed_fd, &one, sizeof(one)) != sizeof(one)) {
+            log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not signal the failed uplink\n");
+        }
+        /* Never connected, keep what is sampled until stopped for the next run */
+        for (;;) {
+            spool_ring();
+            if (!atomic_load(&running)) {
+                break;
+            }
+            reading_ring_wait(&ring, -1);
+        }
+        return NULL;
+    }
+    for (;;) {
+        while (reading_ring_pop(&ring, &reading)) {
+            if (!deadband_check(&filter, &reading)) {
+                continue;
+            }
+            if (spooling && (atomic_load(&uplink_down) || spool_pending() > 0)) {
+                /* Behind the spooled readings, replay keeps the order */
+                spool_append(&reading);
+            } else if (batching) {
+                if (uplink_batch_add(&reading)) {
+                    uplink_batch_flush();
+                }
+            } else if (upload(&reading) == 0) {
+                atomic_fetch_add(&sent, 1);
+            } else {
+                atomic_fetch_add(&failed, 1);
+            }
+        }
+        if (batching && uplink_batch_timeout_ms() == 0) {
+            uplink_batch_flush();
+        }
+        int replay_ms = spooling ? replay() : -1;
+        int summary_ms = config.summary_format ? send_summaries() : -1;
+        int check_ms = spooling ? check_reports() : -1;
+        /* Drain before checking so readings queued before stop are sent */
+        if (!atomic_load(&running)) {
+            break;
+        }
+        reading_ring_wait(&ring, earliest(earliest(earliest(batching ? uplink_batch_timeout_ms() : -1, replay_ms), summary_ms),
+                check_ms));
+    }
+    if (batching) {
+        uplink_batch_flush();
+        if (config.summary_format) {
+            send_summaries();
+        }
+        uplink_batch_finalize(UPLOADER_DRAIN_MS);
+    }
+    return NULL;
+}
+
+int uploader_start(uploader_connect connect, const uploader_config* uploader) {
+    connect_uplink = connect;
+    device_handle = NULL;
+    config = *uploader;
+    atomic_store(&sent, 0);
+    atomic_store(&failed, 0);
+    spooling = 0;
+    if (config.spool.dir) {
+        if (spool_open(&config.spool) == 0) {
+            spooling = 1;
+        } else {
+            log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not open spool %s, readings are lost while offline\n", config.spool.dir);
+        }
+    }
+    atomic_store(&connected, 0);
+    atomic_store(&uplink_down, 0);
+    atomic_store(&reports_missing, 0);
+    retry_ms = UPLOADER_RETRY_MIN_MS;
+    replay_tokens = 0;
+    replay_refilled = monotonic_nanoseconds();
+    replay_sent = replay_reported = replay_consumed = 0;
+    summary_count = 0;
+    summaries_dropped = 0;
+    /* Replay and summaries need data messages, they keep the original event time */
+    batching = config.batch_size > 1 || spooling || config.summary_format;
+    deadband_init(&filter, &config.deadband);
+    failed_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (failed_fd < 0) {
+        return -1;
+    }
+    if (reading_ring_init(&ring, config.overflow) != 0) {
+        close(failed_fd);
+        failed_fd = -1;
+        return -1;
+    }
+    atomic_store(&running, 1);
+    if (pthread_create(&thread, NULL, uploader_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        reading_ring_destroy(&ring);
+        close(failed_fd);
+        failed_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int uploader_failed_fd(void) {
+    return failed_fd;
+}
+
+int uploader_stopping(void) {
+    return !atomic_load(&running);
+}
+
+void uploader_submit(const sensor_reading* reading) {
+    reading_ring_push(&ring, reading);
+}
+
+void uploader_submit_summary(const rollup_bucket* bucket) {
+    pthread_mutex_lock(&summary_lock);
+    if (summary_count == UPLOADER_SUMMARY_QUEUE) {
+        memmove(summaries, summaries + 1, (UPLOADER_SUMMARY_QUEUE - 1) * sizeof(summaries[0]));
+        summary_count--;
+        summaries_dropped++;
+    }
+    summaries[summary_count++] = *bucket;
+    pthread_mutex_unlock(&summary_lock);
+    reading_ring_wake(&ring);
+}
+
+void uploader_get_stats(uploader_stats* stats) {
+    stats->sent = atomic_load(&sent);
+    stats->failed = atomic_load(&failed);
+    reading_ring_get_stats(&ring, &stats->ring);
+    deadband_get_stats(&filter, &stats->deadband);
+    memset(&stats->batch, 0, sizeof(stats->batch));
+    if (batching) {
+        uplink_batch_get_stats(&stats->batch);
+        stats->sent += stats->batch.delivered;
+        stats->failed += stats->batch.failed;
+    }
+    memset(&stats->spool, 0, sizeof(stats->spool));
+    if (spooling) {
+        spool_get_stats(&stats->spool);
+    }
+    stats->uplink_down = atomic_load(&uplink_down);
+    stats->reports_missing = atomic_load(&reports_missing);
+    pthread_mutex_lock(&summary_lock);
+    stats->summaries_pending = summary_count;
+    stats->summaries_dropped = summaries_dropped;
+    pthread_mutex_unlock(&summary_lock);
+}
+
+void uploader_stop(void) {
+    if (!atomic_load(&running)) {
+        return;
+    }
+    /* A coalesced reading still held back is lost if the ring stays full */
+    reading_ring_flush_pending(&ring);
+    atomic_store(&running, 0);
+    reading_ring_wake(&ring);
+    pthread_join(thread, NULL);
+    reading_ring_destroy(&ring);
+    close(failed_fd);
+    failed_fd = -1;
+    if (spooling) {
+        spool_close();
+    }
+}
@@ -0,0 +1,116 @@
+/*
+ * Upload thread.
+ *
+ * Sending to the cloud service can take seconds when the network is slow,
+ * so readings are handed to a thread of their own and the event loop goes
+ * straight back to sampling. Readings inside the deadband are dropped
+ * here, before they cost any uplink.
+ *
+ * With a spool configured, readings the uplink fails to deliver are kept
+ * on disk and replayed in order of arrival, with their original event
+ * time, once messages get through again. A replayed reading leaves the
+ * spool only when the server accepted it and all before it, so a crash
+ * or a failure during replay sends some readings twice, never loses them.
+ *
+ * With a summary format configured, rollup summaries can be queued as
+ * well, they go out as data messages as soon as a message slot is free.
+ * Summaries are not spooled, the rollup keeps them on the device.
+ */
+
+#ifndef UPLOADER_H
+#define UPLOADER_H
+
+#include "iotcs_virtual_device.h"
+#include "deadband.h"
+#include "reading.h"
+#include "reading_ring.h"
+#include "rollup.h"
+#include "spool.h"
+#include "uplink_batch.h"
+
+/* Rollup summaries waiting for the upload thread, the oldest go first */
+#define UPLOADER_SUMMARY_QUEUE 16
+/*
+ * The spool relies on the library reporting every message delivered or
+ * failed. A message in flight this long without a report means it does
+ * not, the uplink is then taken as down so readings are kept on disk.
+ */
+#define UPLOADER_REPORT_TIMEOUT_MS 300000
+
+typedef struct {
+    reading_ring_policy overflow;   /* what to do when the upload falls behind */
+    size_t batch_size;              /* readings per batch, 1 sends each through the virtual device */
+    uint32_t batch_age_ms;          /* longest a reading waits in a batch */
+    const char* format;             /* data message format used for batches */
+    deadband_config deadband;       /* which readings are worth reporting */
+    spool_config spool;             /* where readings wait while the uplink is down */
+    unsigned int replay_rate;       /* spooled readings sent per second on reconnect */
+    const char* summary_format;     /* data message format of rollup summaries, NULL = none */
+} uploader_config;
+
+typedef struct {
+    unsigned long sent;         /* readings sent to the cloud service */
+    unsigned long failed;       /* readings the library refused */
+    reading_ring_stats ring;    /* hand over between the two threads */
+    uplink_batch_stats batch;   /* batched uplink, all zero when not batching */
+    deadband_stats deadband;    /* readings reported and suppressed */
+    spool_stats spool;          /* store and forward, all zero without a spool */
+    int uplink_down;            /* last message failed, readings go to the spool */
+    int reports_missing;        /* messages in flight went unreported past UPLOADER_REPORT_TIMEOUT_MS */
+    unsigned long summaries_pending;    /* rollup summaries waiting for a message slot */
+    unsigned long summaries_dropped;    /* pushed out while waiting */
+} uploader_stats;
+
+/*
+ * Called on a thread of the uploader's before anything is sent, so a slow
+ * network or library start never holds up sampling. Meanwhile the upload
+ * thread keeps what is sampled in the spool. need_device is 0 when all
+ * uploads go out as data messages, which need no virtual device, and the
+ * callback may then leave *device NULL. Returns 0 when uploads can start,
+ * -1 to give up; uploader_failed_fd then becomes readable and readings
+ * go to the spool until uploader_stop.
+ */
+typedef int (*uploader_connect)(int need_device, iotcs_virtual_device_handle* device);
+
+/*
+ * Start the upload thread, which connects with connect.
+ * Returns 0 on success, -1 if the thread could not be created.
+ */
+int uploader_start(uploader_connect connect, const uploader_config* config);
+
+/*
+ * Event file descriptor that becomes readable when the upload thread gave
+ * up connecting. Nothing is uploaded after that, the caller should stop.
+ */
+int uploader_failed_fd(void);
+
+/*
+ * Returns 1 once uploader_stop was called, for a connect callback that
+ * waits.
+ */
+int uploader_stopping(void);
+
+/*
+ * Queue a reading for upload. Must always be called from the same thread,
+ * only blocks with READING_RING_BLOCK.
+ */
+void uploader_submit(const sensor_reading* reading);
+
+/*
+ * Queue a rollup summary for upload, thread safe. Needs a summary format,
+ * only the newest UPLOADER_SUMMARY_QUEUE are kept while the uplink is
+ * not connected.
+ */
+void uploader_submit_summary(const rollup_bucket* bucket);
+
+/*
+ * Copy the upload counters into stats.
+ */
+void uploader_get_stats(uploader_stats* stats);
+
+/*
+ * Send what is still queued, then stop and join the upload thread.
+ */
+void uploader_stop(void);
+
+#endif /* UPLOADER_H */
@@ -0,0 +1,88 @@
+/*
+ * Warm-start cache, see warm_start.h
+ *
+ * The file is plain key=value lines so it can be read and removed by hand.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "warm_start.h"
+
+#define WARM_START_PATH_MAX 256
+
+static void copy_field(char* field, const char* value) {
+    strncpy(field, value, WARM_START_FIELD - 1);
+    field[WARM_START_FIELD - 1] = '\0';
+}
+
+int warm_start_load(const char* path, warm_start_cache* cache) {
+    char line[WARM_START_FIELD + 32];
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    memset(cache, 0, sizeof(*cache));
+    while (fgets(line, sizeof(line), file)) {
+        char* value = strchr(line, '=');
+        if (line[0] == '#' || value == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        value[strcspn(value, "\r\n")] = '\0';
+        if (strcmp(line, "urn") == 0) {
+            copy_field(cache->urn, value);
+        } else if (strcmp(line, "format") == 0) {
+            copy_field(cache->format, value);
+        } else if (strcmp(line, "endpoint") == 0) {
+            copy_field(cache->endpoint, value);
+        } else if (strcmp(line, "attributes") == 0) {
+            copy_field(cache->attributes, value);
+        } else if (strcmp(line, "validated") == 0) {
+            cache->validated = strtol(value, NULL, 10);
+        }
+    }
+    fclose(file);
+    if (!cache->urn[0] || !cache->format[0] || !cache->endpoint[0] || !cache->attributes[0]) {
+        return -1;
+    }
+    return 0;
+}
+
+int warm_start_save(const char* path, const warm_start_cache* cache) {
+    char directory[WARM_START_PATH_MAX], temporary[WARM_START_PATH_MAX];
+    strncpy(directory, path, sizeof(directory) - 1);
+    directory[sizeof(directory) - 1] = '\0';
+    char* slash = strrchr(directory, '/');
+    if (slash && slash != directory) {
+        *slash = '\0';
+        if (mkdir(directory, 0700) != 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE* file = fopen(temporary, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "# iotclient warm start cache, delete to force a cold start\n");
+    fprintf(file, "urn=%s\nformat=%s\nendpoint=%s\nattributes=%s\nvalidated=%ld\n",
+            cache->urn, cache->format, cache->endpoint, cache->attributes, cache->validated);
+    int ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temporary, path) != 0) {
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+int warm_start_invalidate(const char* path) {
+    if (unlink(path) != 0 && errno != ENOENT) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Warm-start cache of what the last run resolved at startup.
+ *
+ * The client library build has no device model directory, so every start
+ * fetches the device model from the server before a virtual device can be
+ * used. Data messages do not need the model though, only an activated
+ * device. When the cache says this endpoint was activated with this model
+ * before, uploads start right after iotcs_init and the model is resolved
+ * again in the background. If that fails, or the model lacks one of the
+ * attributes, the cache is removed and the next start is a cold one.
+ */
+
+#ifndef WARM_START_H
+#define WARM_START_H
+
+#define WARM_START_FIELD 192
+
+typedef struct {
+    char urn[WARM_START_FIELD];         /* device model URN */
+    char format[WARM_START_FIELD];      /* data message format for its attributes */
+    char endpoint[WARM_START_FIELD];    /* endpoint id the device was activated as */
+    char attributes[WARM_START_FIELD];  /* name:type list of the attributes uploaded */
+    long validated;                     /* wall clock secs the model last resolved */
+} warm_start_cache;
+
+/*
+ * Read the cache file at path.
+ * Returns 0 on success, -1 if it is missing or incomplete.
+ */
+int warm_start_load(const char* path, warm_start_cache* cache);
+
+/*
+ * Write the cache file at path, creating its directory if needed. The file
+ * is replaced atomically. Returns 0 on success, -1 on failure.
+ */
+int warm_start_save(const char* path, const warm_start_cache* cache);
+
+/*
+ * Remove the cache file at path, so the next start is a cold one.
+ * Returns 0 on success or if there was none, -1 on failure.
+ */
+int warm_start_invalidate(const char* path);
+
+#endif /* WARM_START_H */
@@ -19,8 +19,10 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 #include <errno.h>
+#include <pthread.h>
 #include <sched.h>
 #include <string.h>
+#include <sys/prctl.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -42,6 +44,53 @@ void busy_wait_milliseconds(uint32_t millis) {
   }
 }
 
+// Number of sleeps timed by precise_delay_calibrate, and the shortest tail that is
+// busy waited regardless of the measured wake up latency.
+#define PRECISE_CALIBRATION_ROUNDS 20
+#define PRECISE_MIN_SPIN_NS 20000ULL
+
+// Time before a precise deadline at which to stop sleeping and start spinning.  The
+// default is conservative until precise_delay_calibrate has measured the real latency.
+static uint64_t precise_spin_ns = 1000000ULL;
+
+static void sleep_until(uint64_t deadline) {
+  struct timespec wake;
+  wake.tv_sec = deadline / 1000000000ULL;
+  wake.tv_nsec = deadline % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+}
+
+void precise_wait_until(uint64_t deadline) {
+  uint64_t now = monotonic_nanoseconds();
+  if (now + precise_spin_ns < deadline) {
+    sleep_until(deadline - precise_spin_ns);
+  }
+  // Spin the last part for accuracy.
+  while (monotonic_nanoseconds() < deadline) {
+  }
+}
+
+void precise_delay_milliseconds(uint32_t millis) {
+  precise_wait_until(monotonic_nanoseconds() + millis * 1000000ULL);
+}
+
+void precise_delay_calibrate(void) {
+  // Timer slack defaults to 50 microseconds, ask for the tightest wake ups instead.
+  prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+  uint64_t worst = 0;
+  int i;
+  for (i = 0; i < PRECISE_CALIBRATION_ROUNDS; ++i) {
+    uint64_t deadline = monotonic_nanoseconds() + 1000000ULL;
+    sleep_until(deadline);
+    uint64_t late = monotonic_nanoseconds() - deadline;
+    if (late > worst) {
+      worst = late;
+    }
+  }
+  // Leave headroom over the worst overshoot seen.
+  precise_spin_ns = worst + worst / 2 + PRECISE_MIN_SPIN_NS;
+}
+
 void sleep_milliseconds(uint32_t millis) {
   struct timespec sleep;
   sleep.tv_sec = millis / 1000;
@@ -53,8 +102,9 @@ void set_max_priority(void) {
   struct sched_param sched;
   memset(&sched, 0, sizeof(sched));
   // Use FIFO scheduler with highest priority for the lowest chance of the kernel context switching.
+  // Only the calling thread is promoted, other threads of the process keep their priority.
   sched.sched_priority = sched_get_priority_max(SCHED_FIFO);
-  sched_setscheduler(0, SCHED_FIFO, &sched);
+  pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
 }
 
 void set_default_priority(void) {
@@ -62,5 +112,147 @@ void set_default_priority(void) {
   memset(&sched, 0, sizeof(sched));
   // Go back to default scheduler with default 0 priority.
   sched.sched_priority = 0;
-  sched_setscheduler(0, SCHED_OTHER, &sched);
+  pthread_setschedparam(pthread_self(), SCHED_OTHER, &sched);
+}
+
+uint64_t monotonic_nanoseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Thread local details of the last frame decoded on each thread.
+static __thread dht_decode_info lastDecode;
+
+const dht_decode_info* dht_last_decode_info(void) {
+  return &lastDecode;
+}
+
+// Convert the 5 frame bytes to humidity and temperature for the sensor type.
+static void convert_frame(int type, const uint8_t* data, float* humidity, float* temperature) {
+  if (type == DHT11) {
+    // Get humidity and temp for DHT11 sensor.
+    *humidity = (float)data[0];
+    *temperature = (float)data[2];
+  }
+  else if (type == DHT22) {
+    // Calculate humidity and temp for DHT22 sensor.
+    *humidity = (data[0] * 256 + data[1]) / 10.0f;
+    *temperature = ((data[2] & 0x7F) * 256 + data[3]) / 10.0f;
+    if (data[2] & 0x80) {
+      *temperature *= -1.0f;
+    }
+  }
+}
+
+static int checksum_ok(const uint8_t* data) {
+  return data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF);
+}
+
+// Whether a repaired frame holds values the sensor can actually report.
+static int plausible(int type, const uint8_t* data) {
+  float humidity = 0.0f, temperature = 0.0f;
+  convert_frame(type, data, &humidity, &temperature);
+  if (type == DHT11) {
+    return humidity >= 0.0f && humidity <= 100.0f && temperature >= 0.0f && temperature <= 60.0f;
+  }
+  return humidity >= 0.0f && humidity <= 100.0f && temperature >= -40.0f && temperature <= 80.0f;
+}
+
+int dht_decode_pulses(int type, const uint32_t* pulse_widths, float* humidity, float* temperature) {
+  memset(&lastDecode, 0, sizeof(lastDecode));
+
+  // Compute the average low pulse width to use as a 50 microsecond reference threshold.
+  // Ignore the first two readings because they are a constant 80 microsecond pulse.
+  uint32_t threshold = 0;
+  int i;
+  for (i=2; i < DHT_PULSES*2; i+=2) {
+    threshold += pulse_widths[i];
+  }
+  threshold /= DHT_PULSES-1;
+
+  // Interpret each high pulse as a 0 or 1 by comparing it to the 50us reference.
+  // If the width is less than 50us it must be a ~28us 0 pulse, and if it's higher
+  // then it must be a ~70us 1 pulse.  Keep how far each pulse was from the threshold
+  // as the confidence in that bit.
+  uint8_t data[5] = {0};
+  uint32_t margins[DHT_DATA_BITS];
+  for (i=3; i < DHT_PULSES*2; i+=2) {
+    int bit = (i-3)/2;
+    int index = bit/8;
+    data[index] <<= 1;
+    if (pulse_widths[i] >= threshold) {
+      // One bit for long pulse.
+      data[index] |= 1;
+      margins[bit] = pulse_widths[i] - threshold;
+    }
+    else {
+      // Else zero bit for short pulse.
+      margins[bit] = threshold - pulse_widths[i];
+    }
+  }
+
+  // Useful debug info:
+  //printf("Data: 0x%x 0x%x 0x%x 0x%x 0x%x\n", data[0], data[1], data[2], data[3], data[4]);
+
+  // On a checksum mismatch, flip each of the least confident bits in turn.  A repair is
+  // only accepted if exactly one candidate passes both the checksum and the plausibility
+  // check, and that bit was close enough to the threshold to be in doubt.
+  int repairedBit = -1;
+  if (!checksum_ok(data)) {
+    int candidates[DHT_REPAIR_CANDIDATES];
+    int found = 0;
+    int c;
+    for (c = 0; c < DHT_REPAIR_CANDIDATES; ++c) {
+      int best = -1;
+      for (i = 0; i < DHT_DATA_BITS; ++i) {
+        int taken = 0;
+        int k;
+        for (k = 0; k < c; ++k) {
+          taken |= candidates[k] == i;
+        }
+        if (!taken && (best < 0 || margins[i] < margins[best])) {
+          best = i;
+        }
+      }
+      candidates[c] = best;
+      if (margins[best] * 100 > threshold * DHT_REPAIR_MAX_MARGIN_PERCENT) {
+        break;
+      }
+      uint8_t flipped[5];
+      memcpy(flipped, data, sizeof(flipped));
+      flipped[best/8] ^= 0x80 >> (best%8);
+      if (checksum_ok(flipped) && plausible(type, flipped)) {
+        ++found;
+        repairedBit = best;
+      }
+    }
+    if (found != 1) {
+      return DHT_ERROR_CHECKSUM;
+    }
+    data[repairedBit/8] ^= 0x80 >> (repairedBit%8);
+    lastDecode.repaired_bits = 1;
+  }
+
+  // Quality is the weakest remaining bit's margin against the nominal margin, with a
+  // repaired frame never scoring above half.
+  uint32_t minMargin = UINT32_MAX;
+  for (i = 0; i < DHT_DATA_BITS; ++i) {
+    if (i != repairedBit && margins[i] < minMargin) {
+      minMargin = margins[i];
+    }
+  }
+  uint32_t nominal = threshold * DHT_NOMINAL_MARGIN_PERCENT / 100;
+  int quality = nominal ? (int)(minMargin * 100 / nominal) : 0;
+  if (quality > 100) {
+    quality = 100;
+  }
+  if (repairedBit >= 0) {
+    quality /= 2;
+  }
+  lastDecode.min_margin = minMargin;
+  lastDecode.quality = quality;
+
+  convert_frame(type, data, humidity, temperature);
+  return DHT_SUCCESS;
 }
@@ -35,17 +35,70 @@
 #define DHT22 22
 #define AM2302 22
 
+// Number of bit pulses to expect from the DHT.  Note that this is 41 because
+// the first pulse is a constant 50 microsecond pulse, with 40 pulses to represent
+// the data afterwards.
+#define DHT_PULSES 41
+
+// Number of data bits in a frame: humidity, temperature and checksum bytes.
+#define DHT_DATA_BITS 40
+
+// Soft decision decoding.  On a checksum mismatch up to DHT_REPAIR_CANDIDATES of the least
+// confident bits are tried flipped, but only bits whose high pulse was within
+// DHT_REPAIR_MAX_MARGIN_PERCENT of the threshold.  A clean bit is typically
+// DHT_NOMINAL_MARGIN_PERCENT of the threshold away from it.
+#define DHT_REPAIR_CANDIDATES 3
+#define DHT_REPAIR_MAX_MARGIN_PERCENT 20
+#define DHT_NOMINAL_MARGIN_PERCENT 40
+
+// Maximum time in microseconds to wait for the DHT to answer the start signal, and
+// the maximum length of any single low or high pulse after that.  The longest valid
+// pulse is ~80 microseconds, so anything past these limits is a timeout.
+#define DHT_RESPONSE_TIMEOUT_US 1000
+#define DHT_PULSE_TIMEOUT_US 1000
+
 // Busy wait delay for most accurate timing, but high CPU usage.
 // Only use this for short periods of time (a few hundred milliseconds at most)!
 void busy_wait_milliseconds(uint32_t millis);
 
+// Precise delay that sleeps for most of the interval and only busy waits for the last
+// stretch, so it is as accurate as busy_wait_milliseconds at a fraction of the CPU cost.
+void precise_delay_milliseconds(uint32_t millis);
+
+// Sleep and then spin until the monotonic clock reaches deadline (in nanoseconds).
+void precise_wait_until(uint64_t deadline);
+
+// Lower the timer slack of the calling thread and measure how late it wakes up from
+// clock_nanosleep, to size the busy waited tail of precise delays.  Call once at startup
+// from the thread that will read the sensor, ideally at the priority it reads with.
+void precise_delay_calibrate(void);
+
 // General delay that sleeps so CPU usage is low, but accuracy is potentially bad.
 void sleep_milliseconds(uint32_t millis);
 
-// Increase scheduling priority and algorithm to try to get 'real time' results.
+// Increase scheduling priority and algorithm of the calling thread to try to get 'real time' results.
 void set_max_priority(void);
 
-// Drop scheduling priority back to normal/default.
+// Drop scheduling priority of the calling thread back to normal/default.
 void set_default_priority(void);
 
+// Current time of the monotonic clock in nanoseconds.
+uint64_t monotonic_nanoseconds(void);
+
+// How confidently the last frame was decoded.
+typedef struct {
+  int quality;          // 0-100, 100 means every bit was a nominal margin away from the threshold
+  uint32_t min_margin;  // smallest distance in microseconds of a data bit from the threshold
+  int repaired_bits;    // number of bits flipped to make the checksum pass
+} dht_decode_info;
+
+// Decode the DHT_PULSES*2 alternating low/high pulse widths (in microseconds) of a
+// response into humidity and temperature.  The first two widths are the constant
+// ~80 microsecond response pulses.  A frame with one marginal bit wrong is repaired if
+// that can be done unambiguously.  Returns DHT_SUCCESS or DHT_ERROR_CHECKSUM.
+int dht_decode_pulses(int type, const uint32_t* pulse_widths, float* humidity, float* temperature);
+
+// Details of the last frame decoded by the calling thread, valid after DHT_SUCCESS.
+const dht_decode_info* dht_last_decode_info(void);
+
 #endif
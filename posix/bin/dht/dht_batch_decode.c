@@ -0,0 +1,225 @@
+#include "dht_batch_decode.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DHT_BATCH_NEON
+#endif
+
+// Number of low pulses averaged into the threshold.
+#define THRESHOLD_PULSES (DHT_PULSES-1)
+
+// Decode the frame bytes of lanes [first, first+count) starting at frame f.
+static void decode_scalar(int type, const uint16_t* pulses, size_t stride, size_t first,
+                          size_t count, float* humidity, float* temperature, uint8_t* valid) {
+  size_t f;
+  for (f = first; f < first + count; ++f) {
+    // Average low pulse width as the 50 microsecond reference, skipping the response.
+    uint32_t threshold = 0;
+    int i;
+    for (i = 2; i < DHT_PULSES*2; i += 2) {
+      threshold += pulses[i*stride + f];
+    }
+    threshold /= THRESHOLD_PULSES;
+
+    uint8_t data[5] = {0};
+    for (i = 3; i < DHT_PULSES*2; i += 2) {
+      int index = (i-3)/16;
+      data[index] <<= 1;
+      if (pulses[i*stride + f] >= threshold) {
+        data[index] |= 1;
+      }
+    }
+
+    valid[f] = data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF);
+    if (type == DHT11) {
+      humidity[f] = (float)data[0];
+      temperature[f] = (float)data[2];
+    }
+    else {
+      humidity[f] = (data[0] * 256 + data[1]) / 10.0f;
+      temperature[f] = ((data[2] & 0x7F) * 256 + data[3]) / 10.0f;
+      if (data[2] & 0x80) {
+        temperature[f] *= -1.0f;
+      }
+    }
+  }
+}
+
+static size_t count_valid(const uint8_t* valid, size_t count) {
+  size_t total = 0;
+  size_t f;
+  for (f = 0; f < count; ++f) {
+    total += valid[f];
+  }
+  return total;
+}
+
+size_t dht_batch_decode_scalar(int type, const uint16_t* pulses, size_t stride, size_t count,
+                               float* humidity, float* temperature, uint8_t* valid) {
+  decode_scalar(type, pulses, stride, 0, count, humidity, temperature, valid);
+  return count_valid(valid, count);
+}
+
+// The vector kernels work on 4 frames at a time in 32 bit lanes.  Instead of dividing the
+// low pulse sum by THRESHOLD_PULSES, a high pulse is a 1 bit when
+//   high >= sum / 40  <=>  sum <= 40 * high + 39
+// which gives exactly the same decisions as the integer division of the scalar code.
+
+#if defined(__SSE2__)
+
+const char* dht_batch_decode_kernel(void) {
+  return "sse2";
+}
+
+// Checksum and convert the frame bytes of 4 frames starting at frame f.
+static inline void finish4(int type, const __m128i* data, size_t f, float* humidity,
+                           float* temperature, uint8_t* valid) {
+  const __m128i one = _mm_set1_epi32(1);
+  const __m128 ten = _mm_set1_ps(10.0f);
+  __m128i check = _mm_and_si128(_mm_add_epi32(_mm_add_epi32(data[0], data[1]),
+                                              _mm_add_epi32(data[2], data[3])), _mm_set1_epi32(0xFF));
+  __m128i ok = _mm_and_si128(_mm_cmpeq_epi32(check, data[4]), one);
+  // Narrow the four 0/1 lanes to bytes.
+  __m128i okBytes = _mm_packus_epi16(_mm_packs_epi32(ok, ok), ok);
+  uint32_t packed = (uint32_t)_mm_cvtsi128_si32(okBytes);
+  valid[f] = packed & 0xFF;
+  valid[f+1] = (packed >> 8) & 0xFF;
+  valid[f+2] = (packed >> 16) & 0xFF;
+  valid[f+3] = packed >> 24;
+
+  if (type == DHT11) {
+    _mm_storeu_ps(humidity + f, _mm_cvtepi32_ps(data[0]));
+    _mm_storeu_ps(temperature + f, _mm_cvtepi32_ps(data[2]));
+  }
+  else {
+    __m128i rawHumidity = _mm_or_si128(_mm_slli_epi32(data[0], 8), data[1]);
+    __m128i rawTemperature = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(data[2], _mm_set1_epi32(0x7F)), 8), data[3]);
+    // Move the sign flag of the temperature into the float sign bit.
+    __m128i sign = _mm_slli_epi32(_mm_and_si128(data[2], _mm_set1_epi32(0x80)), 24);
+    __m128 t = _mm_div_ps(_mm_cvtepi32_ps(rawTemperature), ten);
+    _mm_storeu_ps(humidity + f, _mm_div_ps(_mm_cvtepi32_ps(rawHumidity), ten));
+    _mm_storeu_ps(temperature + f, _mm_xor_ps(t, _mm_castsi128_ps(sign)));
+  }
+}
+
+// 40 * high + 39 without a 32 bit multiply: (high << 5) + (high << 3) + 39.
+static inline __m128i scale_high(__m128i high) {
+  return _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(high, 5), _mm_slli_epi32(high, 3)),
+                       _mm_set1_epi32(THRESHOLD_PULSES - 1));
+}
+
+size_t dht_batch_decode(int type, const uint16_t* pulses, size_t stride, size_t count,
+                        float* humidity, float* temperature, uint8_t* valid) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi32(1);
+  size_t f;
+  // 8 frames per iteration, one 128 bit load per pulse row split into two 32 bit halves.
+  for (f = 0; f + 8 <= count; f += 8) {
+    __m128i sumLow = zero, sumHigh = zero;
+    int i;
+    for (i = 2; i < DHT_PULSES*2; i += 2) {
+      __m128i row = _mm_loadu_si128((const __m128i*)(pulses + i*stride + f));
+      sumLow = _mm_add_epi32(sumLow, _mm_unpacklo_epi16(row, zero));
+      sumHigh = _mm_add_epi32(sumHigh, _mm_unpackhi_epi16(row, zero));
+    }
+
+    __m128i dataLow[5], dataHigh[5];
+    int b;
+    for (b = 0; b < 5; ++b) {
+      dataLow[b] = zero;
+      dataHigh[b] = zero;
+    }
+    for (i = 3; i < DHT_PULSES*2; i += 2) {
+      __m128i row = _mm_loadu_si128((const __m128i*)(pulses + i*stride + f));
+      // All ones where the pulse is short (0 bit), so the bit is (mask + 1) & 1.
+      __m128i bitLow = _mm_and_si128(_mm_add_epi32(_mm_cmpgt_epi32(sumLow, scale_high(_mm_unpacklo_epi16(row, zero))), one), one);
+      __m128i bitHigh = _mm_and_si128(_mm_add_epi32(_mm_cmpgt_epi32(sumHigh, scale_high(_mm_unpackhi_epi16(row, zero))), one), one);
+      int index = (i-3)/16;
+      dataLow[index] = _mm_or_si128(_mm_slli_epi32(dataLow[index], 1), bitLow);
+      dataHigh[index] = _mm_or_si128(_mm_slli_epi32(dataHigh[index], 1), bitHigh);
+    }
+
+    finish4(type, dataLow, f, humidity, temperature, valid);
+    finish4(type, dataHigh, f + 4, humidity, temperature, valid);
+  }
+  decode_scalar(type, pulses, stride, f, count - f, humidity, temperature, valid);
+  return count_valid(valid, count);
+}
+
+#elif defined(DHT_BATCH_NEON)
+
+const char* dht_batch_decode_kernel(void) {
+  return "neon";
+}
+
+size_t dht_batch_decode(int type, const uint16_t* pulses, size_t stride, size_t count,
+                        float* humidity, float* temperature, uint8_t* valid) {
+  const uint32x4_t one = vdupq_n_u32(1);
+  const uint32x4_t bias = vdupq_n_u32(THRESHOLD_PULSES - 1);
+  const uint32x4_t scale = vdupq_n_u32(THRESHOLD_PULSES);
+  size_t f;
+  for (f = 0; f + 4 <= count; f += 4) {
+    uint32x4_t sum = vdupq_n_u32(0);
+    int i;
+    for (i = 2; i < DHT_PULSES*2; i += 2) {
+      sum = vaddw_u16(sum, vld1_u16(pulses + i*stride + f));
+    }
+
+    uint32x4_t data[5];
+    int b;
+    for (b = 0; b < 5; ++b) {
+      data[b] = vdupq_n_u32(0);
+    }
+    for (i = 3; i < DHT_PULSES*2; i += 2) {
+      uint32x4_t high = vmovl_u16(vld1_u16(pulses + i*stride + f));
+      uint32x4_t scaled = vmlaq_u32(bias, high, scale);
+      // All ones where the pulse is long enough for a 1 bit.
+      uint32x4_t bit = vandq_u32(vcleq_u32(sum, scaled), one);
+      int index = (i-3)/16;
+      data[index] = vorrq_u32(vshlq_n_u32(data[index], 1), bit);
+    }
+
+    uint32x4_t check = vandq_u32(vaddq_u32(vaddq_u32(data[0], data[1]), vaddq_u32(data[2], data[3])),
+                                 vdupq_n_u32(0xFF));
+    uint32_t ok[4];
+    vst1q_u32(ok, vandq_u32(vceqq_u32(check, data[4]), one));
+
+    // Convert in scalar code, ARMv7 NEON has no exact float division.
+    uint32_t bytes[5][4];
+    for (b = 0; b < 5; ++b) {
+      vst1q_u32(bytes[b], data[b]);
+    }
+    int lane;
+    for (lane = 0; lane < 4; ++lane) {
+      valid[f+lane] = (uint8_t)ok[lane];
+      if (type == DHT11) {
+        humidity[f+lane] = (float)bytes[0][lane];
+        temperature[f+lane] = (float)bytes[2][lane];
+      }
+      else {
+        humidity[f+lane] = (bytes[0][lane] * 256 + bytes[1][lane]) / 10.0f;
+        temperature[f+lane] = ((bytes[2][lane] & 0x7F) * 256 + bytes[3][lane]) / 10.0f;
+        if (bytes[2][lane] & 0x80) {
+          temperature[f+lane] *= -1.0f;
+        }
+      }
+    }
+  }
+  decode_scalar(type, pulses, stride, f, count - f, humidity, temperature, valid);
+  return count_valid(valid, count);
+}
+
+#else
+
+const char* dht_batch_decode_kernel(void) {
+  return "scalar";
+}
+
+size_t dht_batch_decode(int type, const uint16_t* pulses, size_t stride, size_t count,
+                        float* humidity, float* temperature, uint8_t* valid) {
+  return dht_batch_decode_scalar(type, pulses, stride, count, humidity, temperature, valid);
+}
+
+#endif
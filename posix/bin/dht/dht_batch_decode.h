@@ -0,0 +1,28 @@
+// Batch decoding of recorded DHT pulse traces, e.g. raw traces collected from the field
+// for offline diagnosis.  Uses the same threshold and bit packing as dht_decode_pulses,
+// without the single bit repair, vectorized with SSE2 or NEON where available.
+#ifndef DHT_BATCH_DECODE_H
+#define DHT_BATCH_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common_dht_read.h"
+
+// Decode count frames of sensor type.  The traces are laid out as structure of arrays:
+// pulses[p*stride + f] is pulse width p (0 to DHT_PULSES*2-1, alternating low and high
+// like pulseCounts in pi_2_dht_read) of frame f, with stride >= count.  Widths can be in
+// any unit as long as it is the same for the whole frame.  For every frame valid[f] is
+// set to 1 if the checksum matched, and humidity[f] and temperature[f] are filled in.
+// Returns the number of valid frames.
+size_t dht_batch_decode(int type, const uint16_t* pulses, size_t stride, size_t count,
+                        float* humidity, float* temperature, uint8_t* valid);
+
+// Same as dht_batch_decode using plain scalar code only.
+size_t dht_batch_decode_scalar(int type, const uint16_t* pulses, size_t stride, size_t count,
+                               float* humidity, float* temperature, uint8_t* valid);
+
+// Name of the vector kernel dht_batch_decode uses: "sse2", "neon" or "scalar".
+const char* dht_batch_decode_kernel(void);
+
+#endif
@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dht_sim.h"
+#include "pi_2_mmio.h"
+
+// Edges of a frame: the response low and high pulses, 40 bits of low and high pulses,
+// then the trailing low pulse before the sensor releases the line.
+#define SIM_EDGES (DHT_PULSES*2+2)
+
+typedef struct {
+  int attached;
+  dht_sim_sensor sensor;
+  int output;                 // pin direction
+  int latch;                  // output value
+  int playing;                // a frame is being played
+  uint64_t edges[SIM_EDGES];  // monotonic time of each edge, starting with a falling one
+  int next;                   // first edge not yet passed
+} sim_pin;
+
+static sim_pin pins[32];
+static uint32_t random_state = 0x2545f491;
+
+static uint32_t sim_random(void) {
+  // xorshift32, plenty for jitter and glitch decisions.
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+// Random value in [-range, range].
+static int sim_spread(uint32_t range) {
+  if (range == 0) {
+    return 0;
+  }
+  return (int)(sim_random() % (2*range + 1)) - (int)range;
+}
+
+static uint64_t sim_pulse(uint32_t micros, uint32_t jitter_us) {
+  int width = (int)micros + sim_spread(jitter_us);
+  return (uint64_t)(width > 1 ? width : 1) * 1000ULL;
+}
+
+static void encode_frame(const dht_sim_sensor* sensor, uint8_t* data) {
+  if (sensor->type == DHT11) {
+    data[0] = (uint8_t)sensor->humidity;
+    data[1] = 0;
+    data[2] = (uint8_t)sensor->temperature;
+    data[3] = 0;
+  }
+  else {
+    uint16_t humidity = (uint16_t)(sensor->humidity * 10.0f + 0.5f);
+    float temperature = sensor->temperature < 0.0f ? -sensor->temperature : sensor->temperature;
+    uint16_t magnitude = (uint16_t)(temperature * 10.0f + 0.5f);
+    data[0] = humidity >> 8;
+    data[1] = humidity & 0xFF;
+    data[2] = ((magnitude >> 8) & 0x7F) | (sensor->temperature < 0.0f ? 0x80 : 0);
+    data[3] = magnitude & 0xFF;
+  }
+  data[4] = (data[0] + data[1] + data[2] + data[3]) & 0xFF;
+}
+
+// The host released the line after a start signal, schedule the sensor's answer.
+static void start_frame(sim_pin* pin, uint64_t released) {
+  dht_sim_sensor* sensor = &pin->sensor;
+  pin->playing = 0;
+  if ((int)(sim_random() % 100) < sensor->drop_percent) {
+    return;
+  }
+  sensor->humidity += sensor->walk * sim_spread(100) / 100.0f;
+  sensor->temperature += sensor->walk * sim_spread(100) / 100.0f;
+  if (sensor->humidity < 0.0f) {
+    sensor->humidity = 0.0f;
+  }
+  if (sensor->humidity > 99.9f) {
+    sensor->humidity = 99.9f;
+  }
+
+  uint8_t data[5];
+  encode_frame(sensor, data);
+  int glitch = (int)(sim_random() % 100) < sensor->glitch_percent ? (int)(sim_random() % DHT_DATA_BITS) : -1;
+
+  uint64_t t = released + sensor->response_delay_us * 1000ULL;
+  int e = 0;
+  pin->edges[e++] = t;
+  t += sim_pulse(sensor->response_us, sensor->jitter_us);
+  pin->edges[e++] = t;
+  t += sim_pulse(sensor->response_us, sensor->jitter_us);
+  int bit;
+  for (bit = 0; bit < DHT_DATA_BITS; ++bit) {
+    pin->edges[e++] = t;
+    t += sim_pulse(sensor->bit_low_us, sensor->jitter_us);
+    pin->edges[e++] = t;
+    uint32_t high = (data[bit/8] & (0x80 >> (bit%8))) ? sensor->one_high_us : sensor->zero_high_us;
+    if (bit == glitch) {
+      // Sit right on the threshold so the bit is a coin toss for the decoder.
+      high = sensor->bit_low_us;
+    }
+    t += sim_pulse(high, sensor->jitter_us);
+  }
+  pin->edges[e++] = t;
+  t += sim_pulse(sensor->bit_low_us, sensor->jitter_us);
+  pin->edges[e++] = t;
+  pin->next = 0;
+  pin->playing = 1;
+}
+
+static int sim_init(void) {
+  return MMIO_SUCCESS;
+}
+
+static void sim_set_input(int gpio_number) {
+  sim_pin* pin = &pins[gpio_number];
+  if (pin->output && !pin->latch && pin->attached) {
+    start_frame(pin, monotonic_nanoseconds());
+  }
+  pin->output = 0;
+}
+
+static void sim_set_output(int gpio_number) {
+  pins[gpio_number].output = 1;
+  pins[gpio_number].playing = 0;
+}
+
+static void sim_set_pullup(int gpio_number) {
+  // Undriven inputs always read high in the simulation.
+  (void)gpio_number;
+}
+
+static void sim_set_high_mask(uint32_t gpio_mask) {
+  int i;
+  for (i = 0; i < 32; ++i) {
+    if (gpio_mask & (1u << i)) {
+      pins[i].latch = 1;
+    }
+  }
+}
+
+static void sim_set_low_mask(uint32_t gpio_mask) {
+  int i;
+  for (i = 0; i < 32; ++i) {
+    if (gpio_mask & (1u << i)) {
+      pins[i].latch = 0;
+    }
+  }
+}
+
+// Compute the emulated GPLEV0 register for the current time.
+static uint32_t sim_levels(void) {
+  uint64_t now = monotonic_nanoseconds();
+  uint32_t levels = 0;
+  int i;
+  for (i = 0; i < 32; ++i) {
+    sim_pin* pin = &pins[i];
+    int level = 1;
+    if (pin->output) {
+      level = pin->latch;
+    }
+    else if (pin->playing) {
+      while (pin->next < SIM_EDGES && pin->edges[pin->next] <= now) {
+        ++pin->next;
+      }
+      if (pin->next >= SIM_EDGES) {
+        pin->playing = 0;
+      }
+      else {
+        // Edges alternate falling and rising, starting with a falling one.
+        level = (pin->next & 1) == 0 ? 1 : 0;
+      }
+    }
+    levels |= (uint32_t)level << i;
+  }
+  return levels;
+}
+
+static const pi_2_gpio_backend sim_backend = {
+  "dht_sim",
+  sim_init,
+  sim_set_input,
+  sim_set_output,
+  sim_set_pullup,
+  sim_set_high_mask,
+  sim_set_low_mask,
+  sim_levels
+};
+
+void dht_sim_default_sensor(dht_sim_sensor* sensor, int type) {
+  memset(sensor, 0, sizeof(*sensor));
+  sensor->type = type;
+  sensor->humidity = 45.0f;
+  sensor->temperature = 21.5f;
+  sensor->response_delay_us = 30;
+  sensor->response_us = 80;
+  sensor->bit_low_us = 50;
+  sensor->zero_high_us = 27;
+  sensor->one_high_us = 70;
+}
+
+void dht_sim_set_sensor(int pin, const dht_sim_sensor* sensor) {
+  if (pin < 0 || pin > 31) {
+    return;
+  }
+  pins[pin].attached = sensor != NULL;
+  pins[pin].playing = 0;
+  if (sensor != NULL) {
+    pins[pin].sensor = *sensor;
+  }
+}
+
+void dht_sim_install(void) {
+  pi_2_mmio_set_backend(&sim_backend);
+}
+
+static void env_float(const char* name, float* value) {
+  const char* text = getenv(name);
+  if (text != NULL) {
+    *value = (float)atof(text);
+  }
+}
+
+static void env_uint(const char* name, uint32_t* value) {
+  const char* text = getenv(name);
+  if (text != NULL) {
+    *value = (uint32_t)atoi(text);
+  }
+}
+
+static void env_int(const char* name, int* value) {
+  const char* text = getenv(name);
+  if (text != NULL) {
+    *value = atoi(text);
+  }
+}
+
+int dht_sim_install_from_env(int pin) {
+  if (getenv("DHT_SIM") == NULL) {
+    return 0;
+  }
+  dht_sim_sensor sensor;
+  int type = DHT22;
+  env_int("DHT_SIM_TYPE", &type);
+  dht_sim_default_sensor(&sensor, type);
+  env_float("DHT_SIM_TEMPERATURE", &sensor.temperature);
+  env_float("DHT_SIM_HUMIDITY", &sensor.humidity);
+  env_float("DHT_SIM_WALK", &sensor.walk);
+  env_uint("DHT_SIM_JITTER_US", &sensor.jitter_us);
+  env_int("DHT_SIM_GLITCH_PERCENT", &sensor.glitch_percent);
+  env_int("DHT_SIM_DROP_PERCENT", &sensor.drop_percent);
+  dht_sim_set_sensor(pin, &sensor);
+  dht_sim_install();
+  return 1;
+}
@@ -0,0 +1,42 @@
+// Simulated DHT sensors behind the pluggable GPIO backend of pi_2_mmio.h.  Pins with a
+// simulated sensor answer the start signal by playing a DHT11/DHT22 waveform into the
+// emulated level register, with configurable pulse widths, jitter and glitches, so the
+// acquisition path can run and be benchmarked on machines without GPIO hardware.
+#ifndef DHT_SIM_H
+#define DHT_SIM_H
+
+#include <stdint.h>
+
+#include "common_dht_read.h"
+
+typedef struct {
+  int type;                   // DHT11 or DHT22
+  float humidity;             // values reported by the sensor
+  float temperature;
+  float walk;                 // each frame moves the values by up to +/- this much
+  uint32_t response_delay_us; // from the host releasing the line to the sensor pulling it low
+  uint32_t response_us;       // length of the low and the high response pulse
+  uint32_t bit_low_us;        // low pulse before every data bit
+  uint32_t zero_high_us;      // high pulse of a 0 bit
+  uint32_t one_high_us;       // high pulse of a 1 bit
+  uint32_t jitter_us;         // every pulse is randomly stretched or shortened by up to this
+  int glitch_percent;         // chance a frame has one bit sitting right on the threshold
+  int drop_percent;           // chance the sensor does not answer at all
+} dht_sim_sensor;
+
+// Fill sensor with the nominal timing of the given sensor type, no jitter or glitches.
+void dht_sim_default_sensor(dht_sim_sensor* sensor, int type);
+
+// Attach a simulated sensor to a GPIO pin (0-31), or detach it with NULL.
+void dht_sim_set_sensor(int pin, const dht_sim_sensor* sensor);
+
+// Route all GPIO access through the simulation.
+void dht_sim_install(void);
+
+// Install the simulation if the DHT_SIM environment variable is set, with one sensor on
+// the given pin.  DHT_SIM_TYPE, DHT_SIM_TEMPERATURE, DHT_SIM_HUMIDITY, DHT_SIM_WALK,
+// DHT_SIM_JITTER_US, DHT_SIM_GLITCH_PERCENT and DHT_SIM_DROP_PERCENT override the
+// defaults.  Returns 1 if the simulation was installed.
+int dht_sim_install_from_env(int pin);
+
+#endif
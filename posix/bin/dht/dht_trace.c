@@ -0,0 +1,175 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dht_trace.h"
+
+#ifdef DHT_TRACE
+
+// One event.  The fields are atomic because the dump may read a slot while its thread
+// reuses it, a slot read like that is recognised from the ring head and left out.
+typedef struct {
+  _Atomic uint64_t time;
+  _Atomic uint64_t duration;
+  _Atomic(const char*) name;
+  _Atomic int32_t value;
+  _Atomic uint32_t phase;
+} trace_event;
+
+typedef struct {
+  atomic_int ready;              // tid is set
+  long tid;
+  _Atomic(const char*) name;
+  _Atomic uint64_t head;         // events ever written, by the owning thread only
+  trace_event events[DHT_TRACE_EVENTS];
+} trace_ring;
+
+// Plain copy of an event taken by the dump.
+typedef struct {
+  uint64_t time;
+  uint64_t duration;
+  const char* name;
+  int32_t value;
+  uint32_t phase;
+} trace_copy;
+
+static trace_ring rings[DHT_TRACE_THREADS];
+static atomic_int ringCount;
+static __thread trace_ring* threadRing;
+
+// Claim a ring for the calling thread, NULL if all are taken and the thread goes untraced.
+static trace_ring* claim_ring(const char* name) {
+  int index = atomic_load(&ringCount);
+  do {
+    if (index >= DHT_TRACE_THREADS) {
+      return NULL;
+    }
+  } while (!atomic_compare_exchange_weak(&ringCount, &index, index + 1));
+  trace_ring* ring = &rings[index];
+  ring->tid = (long)syscall(SYS_gettid);
+  atomic_store(&ring->name, name);
+  atomic_store_explicit(&ring->ready, 1, memory_order_release);
+  threadRing = ring;
+  return ring;
+}
+
+void dht_trace_thread(const char* name) {
+  if (threadRing != NULL) {
+    atomic_store(&threadRing->name, name);
+  }
+  else {
+    claim_ring(name);
+  }
+}
+
+void dht_trace_event(char phase, const char* name, uint64_t time, uint64_t duration, int32_t value) {
+  trace_ring* ring = threadRing;
+  if (ring == NULL && (ring = claim_ring(name)) == NULL) {
+    return;
+  }
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  trace_event* event = &ring->events[head % DHT_TRACE_EVENTS];
+  // A dump that sees any of the stores below also sees the head that makes the slot's
+  // previous event stale.
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&event->time, time, memory_order_relaxed);
+  atomic_store_explicit(&event->duration, duration, memory_order_relaxed);
+  atomic_store_explicit(&event->name, name, memory_order_relaxed);
+  atomic_store_explicit(&event->value, value, memory_order_relaxed);
+  atomic_store_explicit(&event->phase, (uint32_t)phase, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Copy the events of ring that are still intact into copies, oldest first.  Returns how
+// many were copied.
+static int copy_ring(trace_ring* ring, trace_copy* copies) {
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  uint64_t first = head > DHT_TRACE_EVENTS ? head - DHT_TRACE_EVENTS : 0;
+  uint64_t s;
+  for (s = first; s < head; ++s) {
+    trace_event* event = &ring->events[s % DHT_TRACE_EVENTS];
+    trace_copy* copy = &copies[s - first];
+    copy->time = atomic_load_explicit(&event->time, memory_order_relaxed);
+    copy->duration = atomic_load_explicit(&event->duration, memory_order_relaxed);
+    copy->name = atomic_load_explicit(&event->name, memory_order_relaxed);
+    copy->value = atomic_load_explicit(&event->value, memory_order_relaxed);
+    copy->phase = atomic_load_explicit(&event->phase, memory_order_relaxed);
+  }
+  // Event s shares its slot with event s+DHT_TRACE_EVENTS, which may have been written
+  // while copying if the head got that far.
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t after = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint64_t stale = after > DHT_TRACE_EVENTS ? after - DHT_TRACE_EVENTS + 1 : 0;
+  if (stale <= first) {
+    return (int)(head - first);
+  }
+  if (stale >= head) {
+    return 0;
+  }
+  uint64_t kept = head - stale;
+  uint64_t i;
+  for (i = 0; i < kept; ++i) {
+    copies[i] = copies[stale - first + i];
+  }
+  return (int)kept;
+}
+
+// Microseconds with three decimals, the unit of the trace event format.
+static void write_time(FILE* file, const char* key, uint64_t ns) {
+  fprintf(file, ",\"%s\":%llu.%03u", key, (unsigned long long)(ns / 1000), (unsigned)(ns % 1000));
+}
+
+int dht_trace_dump(const char* path) {
+  trace_copy* copies = malloc(DHT_TRACE_EVENTS * sizeof(trace_copy));
+  FILE* file = fopen(path, "w");
+  if (copies == NULL || file == NULL) {
+    free(copies);
+    if (file != NULL) {
+      fclose(file);
+    }
+    return -1;
+  }
+  int pid = (int)getpid();
+  int written = 0;
+  int threads = 0;
+  int count = atomic_load(&ringCount);
+  int r;
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (r = 0; r < count && r < DHT_TRACE_THREADS; ++r) {
+    trace_ring* ring = &rings[r];
+    if (!atomic_load_explicit(&ring->ready, memory_order_acquire)) {
+      continue;
+    }
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+            threads++ > 0 ? "," : "", pid, ring->tid, atomic_load(&ring->name));
+    int events = copy_ring(ring, copies);
+    int e;
+    for (e = 0; e < events; ++e) {
+      trace_copy* copy = &copies[e];
+      fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%ld", copy->name, (char)copy->phase, pid,
+              ring->tid);
+      write_time(file, "ts", copy->time);
+      if (copy->phase == 'X') {
+        write_time(file, "dur", copy->duration);
+      }
+      else if (copy->phase == 'i') {
+        fprintf(file, ",\"s\":\"t\"");
+      }
+      if (copy->phase != 'B') {
+        fprintf(file, ",\"args\":{\"value\":%d}", copy->value);
+      }
+      fprintf(file, "}");
+    }
+    written += events;
+  }
+  fprintf(file, "\n]}\n");
+  free(copies);
+  if (fclose(file) != 0) {
+    return -1;
+  }
+  return written;
+}
+
+#endif
@@ -0,0 +1,56 @@
+// Tracepoints for the sensor read and the client's cycle, compiled in with -DDHT_TRACE and
+// to nothing otherwise.  Each thread writes timestamped events into a ring of its own, a
+// few stores and a release of the ring head per event, no lock, no allocation and no
+// system call, so they can sit inside the timing critical part of a read.  When a ring
+// wraps the oldest events are overwritten.  dht_trace_dump writes what the rings hold as
+// Chrome trace event JSON, which chrome://tracing and ui.perfetto.dev open.
+//
+// Event names must be string literals or otherwise outlive the dump.
+#ifndef DHT_TRACE_H
+#define DHT_TRACE_H
+
+#include <stdint.h>
+
+#include "common_dht_read.h"
+
+// Threads that can trace, and events kept per thread.
+#define DHT_TRACE_THREADS 8
+#define DHT_TRACE_EVENTS 2048
+
+#ifdef DHT_TRACE
+
+// Name the calling thread in the trace.  A thread that traces without calling this is
+// named after its first event.
+#define TRACE_THREAD(name) dht_trace_thread(name)
+// Open and close a span on the calling thread, spans nest.  The end carries a value,
+// such as a result code.
+#define TRACE_BEGIN(name) dht_trace_event('B', (name), monotonic_nanoseconds(), 0, 0)
+#define TRACE_END(name, value) dht_trace_event('E', (name), monotonic_nanoseconds(), 0, (value))
+// A point in time with a value.
+#define TRACE_INSTANT(name, value) dht_trace_event('i', (name), monotonic_nanoseconds(), 0, (value))
+// A span between two monotonic times (nanoseconds) taken earlier, for timing critical
+// code that only keeps timestamps and traces them afterwards.
+#define TRACE_SPAN(name, start, end, value) \
+  dht_trace_event('X', (name), (start), (end) - (start), (value))
+
+void dht_trace_thread(const char* name);
+
+// Record one event on the calling thread's ring.  Use the macros above.
+void dht_trace_event(char phase, const char* name, uint64_t time, uint64_t duration, int32_t value);
+
+// Write the events of all threads to path as Chrome trace event JSON, replacing the file.
+// Safe to call while other threads trace, events overwritten during the dump are left
+// out.  Returns the number of events written, or -1 if the file could not be written.
+int dht_trace_dump(const char* path);
+
+#else
+
+#define TRACE_THREAD(name) ((void)0)
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END(name, value) ((void)0)
+#define TRACE_INSTANT(name, value) ((void)0)
+#define TRACE_SPAN(name, start, end, value) ((void)0)
+
+#endif
+
+#endif
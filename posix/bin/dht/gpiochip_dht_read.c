@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/gpio.h>
+
+#include "gpiochip_dht_read.h"
+
+// Overall time to wait for the complete response once the pin is released.  A full
+// frame takes ~5 milliseconds.
+#define DHT_GPIOCHIP_FRAME_TIMEOUT_MS 50
+
+#ifdef GPIO_V2_GET_LINE_IOCTL
+
+// Collect the kernel timestamps of the response edges into edges[0..DHT_PULSES*2].
+// Edge 0 is the first falling edge, the rising edge from releasing the pin is skipped.
+static int read_edges(int line_fd, uint64_t* edges) {
+  struct gpio_v2_line_event events[16];
+  uint64_t deadline = monotonic_nanoseconds() + DHT_GPIOCHIP_FRAME_TIMEOUT_MS*1000000ULL;
+  uint32_t last_seqno = 0;
+  int count = 0;
+  while (count <= DHT_PULSES*2) {
+    uint64_t now = monotonic_nanoseconds();
+    if (now >= deadline) {
+      return DHT_ERROR_TIMEOUT;
+    }
+    struct pollfd pfd = { .fd = line_fd, .events = POLLIN };
+    int ready = poll(&pfd, 1, (int)((deadline - now) / 1000000ULL) + 1);
+    if (ready < 0 && errno != EINTR) {
+      return DHT_ERROR_GPIO;
+    }
+    if (ready <= 0) {
+      continue;
+    }
+    ssize_t len = read(line_fd, events, sizeof(events));
+    if (len < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return DHT_ERROR_GPIO;
+    }
+    int n = len / sizeof(events[0]);
+    int i;
+    for (i = 0; i < n && count <= DHT_PULSES*2; ++i) {
+      int falling = events[i].id == GPIO_V2_LINE_EVENT_FALLING_EDGE;
+      if (count == 0 && !falling) {
+        continue;
+      }
+      // Edges must alternate and none may have been dropped by the kernel buffer.
+      if ((count & 1) == falling || (count > 0 && events[i].line_seqno != last_seqno + 1)) {
+        return DHT_ERROR_TIMEOUT;
+      }
+      last_seqno = events[i].line_seqno;
+      edges[count++] = events[i].timestamp_ns;
+    }
+  }
+  return DHT_SUCCESS;
+}
+
+int gpiochip_dht_read(int type, int pin, float* humidity, float* temperature) {
+  // Validate humidity and temperature arguments and set them to zero.
+  if (humidity == NULL || temperature == NULL) {
+    return DHT_ERROR_ARGUMENT;
+  }
+  *temperature = 0.0f;
+  *humidity = 0.0f;
+
+  int chip_fd = open(DHT_GPIOCHIP_PATH, O_RDWR | O_CLOEXEC);
+  if (chip_fd < 0) {
+    return DHT_ERROR_GPIO;
+  }
+
+  // Request the line as an output driven high.
+  struct gpio_v2_line_request request;
+  memset(&request, 0, sizeof(request));
+  request.offsets[0] = pin;
+  request.num_lines = 1;
+  strncpy(request.consumer, "dht", sizeof(request.consumer) - 1);
+  request.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+  request.config.num_attrs = 1;
+  request.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+  request.config.attrs[0].attr.values = 1;
+  request.config.attrs[0].mask = 1;
+  // Room for every edge of a frame plus stray ones, the default is only 16 per line.
+  request.event_buffer_size = 2 * (DHT_PULSES*2 + 2);
+  int result = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &request);
+  close(chip_fd);
+  if (result < 0) {
+    return DHT_ERROR_GPIO;
+  }
+  int line_fd = request.fd;
+
+  // Set pin high for ~500 milliseconds.
+  sleep_milliseconds(500);
+
+  // Set pin low for ~20 milliseconds.  The sensor only needs the line held low for at
+  // least that long, so a plain sleep is accurate enough here.
+  struct gpio_v2_line_values values;
+  memset(&values, 0, sizeof(values));
+  values.mask = 1;
+  values.bits = 0;
+  if (ioctl(line_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
+    close(line_fd);
+    return DHT_ERROR_GPIO;
+  }
+  sleep_milliseconds(20);
+
+  // Release the pin as a pulled up input and let the kernel timestamp both edges.
+  struct gpio_v2_line_config config;
+  memset(&config, 0, sizeof(config));
+  config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_BIAS_PULL_UP |
+                 GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+  if (ioctl(line_fd, GPIO_V2_LINE_SET_CONFIG_IOCTL, &config) < 0) {
+    close(line_fd);
+    return DHT_ERROR_GPIO;
+  }
+
+  uint64_t edges[DHT_PULSES*2+1];
+  result = read_edges(line_fd, edges);
+  close(line_fd);
+  if (result != DHT_SUCCESS) {
+    return result;
+  }
+
+  // Convert edge times to pulse widths in microseconds, alternating low and high.
+  uint32_t pulseWidths[DHT_PULSES*2];
+  int i;
+  for (i = 0; i < DHT_PULSES*2; ++i) {
+    pulseWidths[i] = (uint32_t)((edges[i+1] - edges[i]) / 1000);
+  }
+
+  return dht_decode_pulses(type, pulseWidths, humidity, temperature);
+}
+
+#else
+
+// Kernel headers without the GPIO v2 character device API.
+int gpiochip_dht_read(int type, int pin, float* humidity, float* temperature) {
+  (void)type;
+  (void)pin;
+  (void)humidity;
+  (void)temperature;
+  return DHT_ERROR_GPIO;
+}
+
+#endif
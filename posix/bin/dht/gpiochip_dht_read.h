@@ -0,0 +1,17 @@
+#ifndef GPIOCHIP_DHT_READ_H
+#define GPIOCHIP_DHT_READ_H
+
+#include "common_dht_read.h"
+
+// GPIO character device the sensor pin is requested from.
+#ifndef DHT_GPIOCHIP_PATH
+#define DHT_GPIOCHIP_PATH "/dev/gpiochip0"
+#endif
+
+// Read DHT sensor connected to GPIO pin (line offset on DHT_GPIOCHIP_PATH) through the
+// Linux GPIO character device.  The response is decoded from edge events timestamped by
+// the kernel interrupt handler, so no busy waiting or real-time priority is needed.
+// Return values are the same as pi_2_dht_read.
+int gpiochip_dht_read(int type, int pin, float* humidity, float* temperature);
+
+#endif
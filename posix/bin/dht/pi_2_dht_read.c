@@ -22,53 +22,171 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include "dht_trace.h"
+#include "gpiochip_dht_read.h"
 #include "pi_2_dht_read.h"
 #include "pi_2_mmio.h"
 
-// This is the only processor specific magic value, the maximum amount of time to
-// spin in a loop before bailing out and considering the read a timeout.  This should
-// be a high value, but if you're running on a much faster platform than a Raspberry
-// Pi or Beaglebone Black then it might need to be increased.
-#define DHT_MAXCOUNT 32000
+static int dht_backend = DHT_BACKEND_MMIO;
 
-// Number of bit pulses to expect from the DHT.  Note that this is 41 because
-// the first pulse is a constant 50 microsecond pulse, with 40 pulses to represent
-// the data afterwards.
-#define DHT_PULSES 41
+void pi_2_dht_set_backend(int backend) {
+  dht_backend = backend;
+}
+
+// Fast read mode state: pins with the pull-up enabled, and the monotonic time each pin
+// was released after its last read (0 if unknown).
+static int fastRead = 0;
+static uint32_t pullupPins = 0;
+static uint64_t pinIdleSince[32];
+
+void pi_2_dht_set_fast_read(int enable) {
+  fastRead = enable;
+}
+
+// Bring the pins in mask high before the start signal.  If in fast read mode every pin has
+// been parked high, only whatever is left of the pre-charge time is waited out, otherwise
+// the pins are driven high for the full time.  Leaves the pins as outputs.
+static void precharge(uint32_t mask) {
+  uint64_t ready = 0;
+  int parked = fastRead;
+  int pin;
+  for (pin = 0; pin < 32; ++pin) {
+    if (!(mask & (1u << pin))) {
+      continue;
+    }
+    if (fastRead && !(pullupPins & (1u << pin))) {
+      pi_2_mmio_set_pullup(pin);
+      pullupPins |= 1u << pin;
+    }
+    if (pinIdleSince[pin] == 0) {
+      parked = 0;
+    }
+    else if (pinIdleSince[pin] > ready) {
+      ready = pinIdleSince[pin];
+    }
+  }
+  if (parked) {
+    ready += DHT_PRECHARGE_MS*1000000ULL;
+    uint64_t now = monotonic_nanoseconds();
+    if (now < ready) {
+      sleep_milliseconds((uint32_t)((ready - now + 999999) / 1000000));
+    }
+  }
+  else {
+    pi_2_mmio_set_high_mask(mask);
+  }
+  // A parked pin goes straight from idle high to the low start signal.
+  if (parked) {
+    pi_2_mmio_set_low_mask(mask);
+  }
+  for (pin = 0; pin < 32; ++pin) {
+    if (mask & (1u << pin)) {
+      pi_2_mmio_set_output(pin);
+    }
+  }
+  if (!parked) {
+    sleep_milliseconds(DHT_PRECHARGE_MS);
+  }
+}
+
+// Remember when the pins in mask were released as inputs after a read.
+static void mark_idle(uint32_t mask) {
+  uint64_t now = monotonic_nanoseconds();
+  int pin;
+  for (pin = 0; pin < 32; ++pin) {
+    if (mask & (1u << pin)) {
+      pinIdleSince[pin] = now;
+    }
+  }
+}
+
+// Wait for the pin to reach the given level, polling until the monotonic clock passes
+// deadline.  Returns the time the new level was first seen, or 0 on timeout.
+static inline uint64_t wait_for_level(int pin, int level, uint64_t deadline) {
+  uint64_t now;
+  do {
+    now = monotonic_nanoseconds();
+    if (now >= deadline) {
+      return 0;
+    }
+  } while ((pi_2_mmio_input(pin) != 0) != level);
+  return now;
+}
+
+#ifdef DHT_TRACE
+static const char* bitNames[DHT_DATA_BITS] = {
+  "bit 0", "bit 1", "bit 2", "bit 3", "bit 4", "bit 5", "bit 6", "bit 7", "bit 8", "bit 9",
+  "bit 10", "bit 11", "bit 12", "bit 13", "bit 14", "bit 15", "bit 16", "bit 17", "bit 18", "bit 19",
+  "bit 20", "bit 21", "bit 22", "bit 23", "bit 24", "bit 25", "bit 26", "bit 27", "bit 28", "bit 29",
+  "bit 30", "bit 31", "bit 32", "bit 33", "bit 34", "bit 35", "bit 36", "bit 37", "bit 38", "bit 39"
+};
+
+// Trace the first count edges of a response once the timing critical part is over: the
+// wait from releasing the pin to the response, the response pulses, then one span per
+// complete bit with its high pulse width in microseconds.
+static void trace_edges(uint64_t released, const uint64_t* edges, int count) {
+  if (count < 1) {
+    return;
+  }
+  TRACE_SPAN("wait_response", released, edges[0], 0);
+  if (count < 3) {
+    return;
+  }
+  TRACE_SPAN("response", edges[0], edges[2], (int32_t)((edges[2] - edges[1]) / 1000));
+  int bit;
+  for (bit = 0; bit < DHT_DATA_BITS && 4 + 2*bit < count; ++bit) {
+    TRACE_SPAN(bitNames[bit], edges[2 + 2*bit], edges[4 + 2*bit],
+               (int32_t)((edges[4 + 2*bit] - edges[3 + 2*bit]) / 1000));
+  }
+}
+#endif
 
 int pi_2_dht_read(int type, int pin, float* humidity, float* temperature) {
   // Validate humidity and temperature arguments and set them to zero.
   if (humidity == NULL || temperature == NULL) {
     return DHT_ERROR_ARGUMENT;
   }
+  if (pin < 0 || pin > 31) {
+    return DHT_ERROR_ARGUMENT;
+  }
   *temperature = 0.0f;
   *humidity = 0.0f;
 
+  TRACE_BEGIN("dht_read");
+  if (dht_backend == DHT_BACKEND_GPIOCHIP) {
+    int result = gpiochip_dht_read(type, pin, humidity, temperature);
+    TRACE_END("dht_read", result);
+    return result;
+  }
+
   // Initialize GPIO library.
   if (pi_2_mmio_init() < 0) {
+    TRACE_END("dht_read", DHT_ERROR_GPIO);
     return DHT_ERROR_GPIO;
   }
-  
-  // Store the count that each DHT bit pulse is low and high.
-  // Make sure array is initialized to start at zero.
-  int pulseCounts[DHT_PULSES*2] = {0};
 
-  // Set pin to output.
-  pi_2_mmio_set_output(pin);
+  // Store the monotonic time in nanoseconds of every edge of the response.  Edge 0 is
+  // the DHT pulling the pin low, after that the edges alternate rising and falling.
+  uint64_t edges[DHT_PULSES*2+1];
 
   // Bump up process priority and change scheduler to try to try to make process more 'real time'.
+  TRACE_BEGIN("set_max_priority");
   set_max_priority();
+  TRACE_END("set_max_priority", 0);
 
-  // Set pin high for ~500 milliseconds.
-  pi_2_mmio_set_high(pin);
-  sleep_milliseconds(500);
+  // Set pin to output and high for ~500 milliseconds, or less in fast read mode.
+  TRACE_BEGIN("precharge");
+  precharge(1u << pin);
+  TRACE_END("precharge", fastRead);
 
   // The next calls are timing critical and care should be taken
   // to ensure no unnecssary work is done below.
 
   // Set pin low for ~20 milliseconds.
+  TRACE_BEGIN("start_pulse");
   pi_2_mmio_set_low(pin);
-  busy_wait_milliseconds(20);
+  precise_delay_milliseconds(20);
+  TRACE_END("start_pulse", 0);
 
   // Set pin at input.
   pi_2_mmio_set_input(pin);
@@ -77,87 +195,178 @@ int pi_2_dht_read(int type, int pin, float* humidity, float* temperature) {
   for (i1 = 0; i1 < 50; ++i1) {
   }
 
-  // Wait for DHT to pull pin low.
-  uint32_t count = 0;
-  while (pi_2_mmio_input(pin)) {
-    if (++count >= DHT_MAXCOUNT) {
+  // Wait for DHT to pull pin low, then record when each following edge happens.
+  uint64_t released = monotonic_nanoseconds();
+  uint64_t deadline = released + DHT_RESPONSE_TIMEOUT_US*1000ULL;
+  int i2;
+  for (i2=0; i2 <= DHT_PULSES*2; ++i2) {
+    edges[i2] = wait_for_level(pin, i2 & 1, deadline);
+    if (edges[i2] == 0) {
       // Timeout waiting for response.
+      mark_idle(1u << pin);
       set_default_priority();
+#ifdef DHT_TRACE
+      // Which edge never came tells the phase that went wrong: 0 no response at all,
+      // 1-2 a broken response, later ones the bit (i2-3)/2.
+      trace_edges(released, edges, i2);
+      TRACE_INSTANT("timeout", i2);
+#endif
+      TRACE_END("dht_read", DHT_ERROR_TIMEOUT);
       return DHT_ERROR_TIMEOUT;
     }
+    deadline = edges[i2] + DHT_PULSE_TIMEOUT_US*1000ULL;
   }
-
-  // Record pulse widths for the expected result bits.
-  int i2;
-  for (i2=0; i2 < DHT_PULSES*2; i2+=2) {
-    // Count how long pin is low and store in pulseCounts[i]
-    while (!pi_2_mmio_input(pin)) {
-      if (++pulseCounts[i2] >= DHT_MAXCOUNT) {
-        // Timeout waiting for response.
-        set_default_priority();
-        return DHT_ERROR_TIMEOUT;
-      }
-    }
-    // Count how long pin is high and store in pulseCounts[i+1]
-    while (pi_2_mmio_input(pin)) {
-      if (++pulseCounts[i2+1] >= DHT_MAXCOUNT) {
-        // Timeout waiting for response.
-        set_default_priority();
-        return DHT_ERROR_TIMEOUT;
-      }
-    }
-  }
+  mark_idle(1u << pin);
 
   // Done with timing critical code, now interpret the results.
 
   // Drop back to normal priority.
+  TRACE_BEGIN("set_default_priority");
   set_default_priority();
+  TRACE_END("set_default_priority", 0);
+#ifdef DHT_TRACE
+  trace_edges(released, edges, DHT_PULSES*2+1);
+#endif
 
-  // Compute the average low pulse width to use as a 50 microsecond reference threshold.
-  // Ignore the first two readings because they are a constant 80 microsecond pulse.
-  uint32_t threshold = 0;
+  // Convert edge times to pulse widths in microseconds, alternating low and high.
+  uint32_t pulseWidths[DHT_PULSES*2];
   int i3;
-  for (i3=2; i3 < DHT_PULSES*2; i3+=2) {
-    threshold += pulseCounts[i3];
-  }
-  threshold /= DHT_PULSES-1;
-
-  // Interpret each high pulse as a 0 or 1 by comparing it to the 50us reference.
-  // If the count is less than 50us it must be a ~28us 0 pulse, and if it's higher
-  // then it must be a ~70us 1 pulse.
-  uint8_t data[5] = {0};
-  int i4;
-  for (i4=3; i4 < DHT_PULSES*2; i4+=2) {
-    int index = (i4-3)/16;
-    data[index] <<= 1;
-    if (pulseCounts[i4] >= threshold) {
-      // One bit for long pulse.
-      data[index] |= 1;
-    }
-    // Else zero bit for short pulse.
-  }
-
-  // Useful debug info:
-  //printf("Data: 0x%x 0x%x 0x%x 0x%x 0x%x\n", data[0], data[1], data[2], data[3], data[4]);
-
-  // Verify checksum of received data.
-  if (data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF)) {
-    if (type == DHT11) {
-      // Get humidity and temp for DHT11 sensor.
-      *humidity = (float)data[0];
-      *temperature = (float)data[2];
-    }
-    else if (type == DHT22) {
-      // Calculate humidity and temp for DHT22 sensor.
-      *humidity = (data[0] * 256 + data[1]) / 10.0f;
-      *temperature = ((data[2] & 0x7F) * 256 + data[3]) / 10.0f;
-      if (data[2] & 0x80) {
-        *temperature *= -1.0f;
+  for (i3=0; i3 < DHT_PULSES*2; ++i3) {
+    pulseWidths[i3] = (uint32_t)((edges[i3+1] - edges[i3]) / 1000);
+  }
+
+  TRACE_BEGIN("decode");
+  int result = dht_decode_pulses(type, pulseWidths, humidity, temperature);
+  TRACE_END("decode", result);
+  TRACE_END("dht_read", result);
+  return result;
+}
+
+// One sample of the level register, recorded whenever a sensor pin changed.
+typedef struct {
+  uint64_t time;
+  uint32_t levels;
+} level_change;
+
+// Room for every edge of every sensor, plus the rising edge when the pins are released.
+static level_change trace[DHT_MULTI_MAX_SENSORS*(DHT_PULSES*2+2)];
+
+int pi_2_dht_read_multi(int count, const int* types, const int* pins, float* humidity,
+                        float* temperature, int* results) {
+  // Validate arguments, every pin must be in GPLEV0 and appear only once.
+  if (count <= 0 || count > DHT_MULTI_MAX_SENSORS || types == NULL || pins == NULL ||
+      humidity == NULL || temperature == NULL || results == NULL) {
+    return DHT_ERROR_ARGUMENT;
+  }
+  uint32_t mask = 0;
+  int s;
+  for (s = 0; s < count; ++s) {
+    if (pins[s] < 0 || pins[s] > 31 || (mask & (1u << pins[s]))) {
+      return DHT_ERROR_ARGUMENT;
+    }
+    mask |= 1u << pins[s];
+    humidity[s] = 0.0f;
+    temperature[s] = 0.0f;
+    results[s] = DHT_ERROR_TIMEOUT;
+  }
+
+  // Initialize GPIO library.
+  if (pi_2_mmio_init() < 0) {
+    return DHT_ERROR_GPIO;
+  }
+
+  set_max_priority();
+
+  // Set all pins to output and high for ~500 milliseconds, or less in fast read mode.
+  precharge(mask);
+
+  // Set all pins low for ~20 milliseconds.
+  pi_2_mmio_set_low_mask(mask);
+  precise_delay_milliseconds(20);
+
+  for (s = 0; s < count; ++s) {
+    pi_2_mmio_set_input(pins[s]);
+  }
+  volatile int i1;
+  for (i1 = 0; i1 < 50; ++i1) {
+  }
+
+  // Sample the level register until every sensor has sent a full frame or timed out,
+  // recording each sample in which a pending sensor changed.  Per sensor only the edge
+  // count is tracked here to know when it is done.
+  uint64_t released = monotonic_nanoseconds();
+  uint32_t initial = pi_2_mmio_levels();
+  uint32_t previous = initial;
+  uint32_t pending = mask;
+  uint32_t started = 0;
+  int edgeCount[DHT_MULTI_MAX_SENSORS] = {0};
+  uint64_t lastEdge[DHT_MULTI_MAX_SENSORS] = {0};
+  int traceLength = 0;
+  while (pending) {
+    uint64_t now = monotonic_nanoseconds();
+    uint32_t levels = pi_2_mmio_levels();
+    uint32_t changed = (levels ^ previous) & pending;
+    previous = levels;
+    if (changed && traceLength < (int)(sizeof(trace)/sizeof(trace[0]))) {
+      trace[traceLength].time = now;
+      trace[traceLength].levels = levels;
+      ++traceLength;
+    }
+    for (s = 0; s < count; ++s) {
+      uint32_t bit = 1u << pins[s];
+      if (!(pending & bit)) {
+        continue;
+      }
+      if (changed & bit) {
+        // A frame starts with the sensor pulling the pin low.
+        if ((started & bit) || !(levels & bit)) {
+          started |= bit;
+          lastEdge[s] = now;
+          if (++edgeCount[s] == DHT_PULSES*2+1) {
+            pending &= ~bit;
+          }
+        }
+      }
+      else if (now - ((started & bit) ? lastEdge[s] : released) >=
+               ((started & bit) ? DHT_PULSE_TIMEOUT_US : DHT_RESPONSE_TIMEOUT_US)*1000ULL) {
+        pending &= ~bit;
       }
     }
-	return DHT_SUCCESS;
   }
-  else {
-    return DHT_ERROR_CHECKSUM;
+  mark_idle(mask);
+
+  set_default_priority();
+
+  // Demultiplex each sensor's edges from the trace and decode its frame.
+  for (s = 0; s < count; ++s) {
+    uint32_t bit = 1u << pins[s];
+    if (edgeCount[s] != DHT_PULSES*2+1) {
+      continue;
+    }
+    uint64_t edges[DHT_PULSES*2+1];
+    uint32_t level = initial & bit;
+    int edge = 0;
+    int t;
+    for (t = 0; t < traceLength && edge <= DHT_PULSES*2; ++t) {
+      uint32_t pinLevel = trace[t].levels & bit;
+      if (pinLevel == level) {
+        continue;
+      }
+      level = pinLevel;
+      if (edge == 0 && level) {
+        continue;
+      }
+      edges[edge++] = trace[t].time;
+    }
+    if (edge != DHT_PULSES*2+1) {
+      continue;
+    }
+    uint32_t pulseWidths[DHT_PULSES*2];
+    int i;
+    for (i = 0; i < DHT_PULSES*2; ++i) {
+      pulseWidths[i] = (uint32_t)((edges[i+1] - edges[i]) / 1000);
+    }
+    results[s] = dht_decode_pulses(types[s], pulseWidths, &humidity[s], &temperature[s]);
   }
+  return DHT_SUCCESS;
 }
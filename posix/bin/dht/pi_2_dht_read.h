@@ -29,4 +29,34 @@
 // be returned.  Some errors can be ignored and retried, specifically DHT_ERROR_TIMEOUT or DHT_ERROR_CHECKSUM.
 int pi_2_dht_read(int sensor, int pin, float* humidity, float* temperature);
 
+// Time in milliseconds the data line is held high before the start signal.
+#define DHT_PRECHARGE_MS 500
+
+// Enable or disable fast reads.  In fast read mode the pin is parked as a pulled up input
+// between reads and the time it went idle is remembered, so the DHT_PRECHARGE_MS high
+// period before the start signal is skipped when the line has already been idle that
+// long.  A read then takes ~25 milliseconds.  Applies to the memory mapped backend.
+void pi_2_dht_set_fast_read(int enable);
+
+// Maximum number of sensors pi_2_dht_read_multi can read at once.
+#define DHT_MULTI_MAX_SENSORS 8
+
+// Read count DHT sensors (types[i] on GPIO pins[i], BCM numbering 0-31) at the same time.
+// All pins get the start signal together and the responses are captured from one sweep of
+// the GPIO level register, so reading N sensors takes about as long as reading one.  The
+// outcome for each sensor is stored in results[i] and, on DHT_SUCCESS, humidity[i] and
+// temperature[i].  Returns DHT_SUCCESS if the read was attempted, otherwise
+// DHT_ERROR_ARGUMENT or DHT_ERROR_GPIO.  Always uses the memory mapped GPIO registers.
+int pi_2_dht_read_multi(int count, const int* types, const int* pins, float* humidity,
+                        float* temperature, int* results);
+
+// Backends pi_2_dht_read can use to talk to the sensor.  DHT_BACKEND_MMIO polls the
+// memory mapped GPIO registers, DHT_BACKEND_GPIOCHIP uses kernel timestamped edge
+// events from the GPIO character device (see gpiochip_dht_read.h).
+#define DHT_BACKEND_MMIO 0
+#define DHT_BACKEND_GPIOCHIP 1
+
+// Select the backend used by pi_2_dht_read.  Default is DHT_BACKEND_MMIO.
+void pi_2_dht_set_backend(int backend);
+
 #endif
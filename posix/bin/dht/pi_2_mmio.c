@@ -33,9 +33,24 @@
 #define GPIO_BASE_OFFSET 0x200000
 #define GPIO_LENGTH 4096
 
+// Pull-up/down registers, as word offsets from the GPIO base.
+#define GPIO_GPPUD 37
+#define GPIO_GPPUDCLK0 38
+#define GPIO_PUP_PDN_CNTRL0 57
+// Older chips read this value back from the BCM2711 pull register location.
+#define GPIO_PUP_PDN_LEGACY_MAGIC 0x6770696f
+
 volatile uint32_t* pi_2_mmio_gpio = NULL;
+const pi_2_gpio_backend* pi_2_gpio = NULL;
+
+void pi_2_mmio_set_backend(const pi_2_gpio_backend* backend) {
+  pi_2_gpio = backend;
+}
 
 int pi_2_mmio_init(void) {
+  if (pi_2_gpio != NULL) {
+    return pi_2_gpio->init();
+  }
   if (pi_2_mmio_gpio == NULL) {
     // Check for GPIO and peripheral addresses from device tree.
     // Adapted from code in the RPi.GPIO library at:
@@ -69,3 +84,31 @@ int pi_2_mmio_init(void) {
   }
   return MMIO_SUCCESS;
 }
+
+// The legacy pull-up sequence needs the control signal held for 150 cycles.
+static void short_wait(void) {
+  volatile int i;
+  for (i = 0; i < 150; ++i) {
+  }
+}
+
+void pi_2_mmio_set_pullup(const int gpio_number) {
+  if (pi_2_gpio != NULL) {
+    pi_2_gpio->set_pullup(gpio_number);
+  }
+  else if (*(pi_2_mmio_gpio+GPIO_PUP_PDN_CNTRL0+3) == GPIO_PUP_PDN_LEGACY_MAGIC) {
+    // BCM2835-7: latch the pull-up into the pin with the clock register.
+    *(pi_2_mmio_gpio+GPIO_GPPUD) = 2;
+    short_wait();
+    *(pi_2_mmio_gpio+GPIO_GPPUDCLK0) = 1 << gpio_number;
+    short_wait();
+    *(pi_2_mmio_gpio+GPIO_GPPUD) = 0;
+    *(pi_2_mmio_gpio+GPIO_GPPUDCLK0) = 0;
+  }
+  else {
+    // BCM2711: two bits per pin, 01 selects the pull-up.
+    volatile uint32_t* reg = pi_2_mmio_gpio+GPIO_PUP_PDN_CNTRL0+(gpio_number/16);
+    int shift = (gpio_number%16)*2;
+    *reg = (*reg & ~(3 << shift)) | (1 << shift);
+  }
+}
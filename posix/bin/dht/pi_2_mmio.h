@@ -33,30 +33,86 @@
 
 extern volatile uint32_t* pi_2_mmio_gpio;
 
+// Pluggable GPIO backend.  When one is set, every pi_2_mmio_* call goes through it instead
+// of the memory mapped registers, e.g. to run the sensor code against a simulated sensor
+// (see dht_sim.h) on machines without GPIO hardware.
+typedef struct {
+  const char* name;
+  int (*init)(void);
+  void (*set_input)(int gpio_number);
+  void (*set_output)(int gpio_number);
+  void (*set_pullup)(int gpio_number);
+  void (*set_high_mask)(uint32_t gpio_mask);
+  void (*set_low_mask)(uint32_t gpio_mask);
+  uint32_t (*levels)(void);
+} pi_2_gpio_backend;
+
+extern const pi_2_gpio_backend* pi_2_gpio;
+
+// Use backend for all GPIO access, or NULL for the memory mapped registers (the default).
+// Must be called before pi_2_mmio_init.
+void pi_2_mmio_set_backend(const pi_2_gpio_backend* backend);
+
 int pi_2_mmio_init(void);
 
+// Enable the internal pull-up resistor of a GPIO so the line idles high as an input.
+// Handles both the BCM2835-7 (GPPUD/GPPUDCLK) and the BCM2711 pull register layouts.
+void pi_2_mmio_set_pullup(const int gpio_number);
+
 static inline void pi_2_mmio_set_input(const int gpio_number) {
+  if (pi_2_gpio != NULL) {
+    pi_2_gpio->set_input(gpio_number);
+    return;
+  }
   // Set GPIO register to 000 for specified GPIO number.
   *(pi_2_mmio_gpio+((gpio_number)/10)) &= ~(7<<(((gpio_number)%10)*3));
 }
 
 static inline void pi_2_mmio_set_output(const int gpio_number) {
+  if (pi_2_gpio != NULL) {
+    pi_2_gpio->set_output(gpio_number);
+    return;
+  }
   // First set to 000 using input function.
   pi_2_mmio_set_input(gpio_number);
   // Next set bit 0 to 1 to set output.
   *(pi_2_mmio_gpio+((gpio_number)/10)) |=  (1<<(((gpio_number)%10)*3));
 }
 
+static inline void pi_2_mmio_set_high_mask(const uint32_t gpio_mask) {
+  if (pi_2_gpio != NULL) {
+    pi_2_gpio->set_high_mask(gpio_mask);
+    return;
+  }
+  *(pi_2_mmio_gpio+7) = gpio_mask;
+}
+
+static inline void pi_2_mmio_set_low_mask(const uint32_t gpio_mask) {
+  if (pi_2_gpio != NULL) {
+    pi_2_gpio->set_low_mask(gpio_mask);
+    return;
+  }
+  *(pi_2_mmio_gpio+10) = gpio_mask;
+}
+
 static inline void pi_2_mmio_set_high(const int gpio_number) {
-  *(pi_2_mmio_gpio+7) = 1 << gpio_number;
+  pi_2_mmio_set_high_mask(1 << gpio_number);
 }
 
 static inline void pi_2_mmio_set_low(const int gpio_number) {
-  *(pi_2_mmio_gpio+10) = 1 << gpio_number;
+  pi_2_mmio_set_low_mask(1 << gpio_number);
+}
+
+// Level of GPIO 0-31 in one read of the GPLEV0 register.
+static inline uint32_t pi_2_mmio_levels(void) {
+  if (pi_2_gpio != NULL) {
+    return pi_2_gpio->levels();
+  }
+  return *(pi_2_mmio_gpio+13);
 }
 
 static inline uint32_t pi_2_mmio_input(const int gpio_number) {
-  return *(pi_2_mmio_gpio+13) & (1 << gpio_number);
+  return pi_2_mmio_levels() & (1 << gpio_number);
 }
 
 #endif
@@ -0,0 +1,119 @@
+/*
+ * Benchmark for the batch DHT decoder: decodes a set of synthetic pulse
+ * traces with the vector kernel, the scalar batch code and frame by frame
+ * with dht_decode_pulses, and reports frames per second for each.
+ *
+ * Usage: dht_batch_bench.out [frames] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common_dht_read.h"
+#include "dht_batch_decode.h"
+
+static uint32_t seed = 12345;
+
+static uint32_t next_random(void) {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/* Pulse width in microseconds with +-4 us of jitter */
+static uint16_t jittered(int micros) {
+	return (uint16_t)(micros + (int)(next_random() % 9) - 4);
+}
+
+/* Fill frame f of the structure of arrays trace with a random DHT22 reading */
+static void make_frame(uint16_t* pulses, size_t stride, size_t f) {
+	uint16_t humidity = next_random() % 1000;
+	uint16_t temperature = next_random() % 800;
+	uint8_t data[5];
+	data[0] = humidity >> 8;
+	data[1] = humidity & 0xFF;
+	data[2] = (temperature >> 8) | ((next_random() & 7) == 0 ? 0x80 : 0);
+	data[3] = temperature & 0xFF;
+	data[4] = (data[0] + data[1] + data[2] + data[3]) & 0xFF;
+	/* Every 16th frame gets a corrupted checksum */
+	if ((next_random() & 15) == 0) {
+		data[4] ^= 0x10;
+	}
+	pulses[0*stride + f] = jittered(80);
+	pulses[1*stride + f] = jittered(80);
+	int bit;
+	for (bit = 0; bit < DHT_DATA_BITS; ++bit) {
+		int one = data[bit/8] & (0x80 >> (bit%8));
+		pulses[(2 + 2*bit)*stride + f] = jittered(50);
+		pulses[(3 + 2*bit)*stride + f] = jittered(one ? 70 : 27);
+	}
+}
+
+static double seconds(uint64_t start) {
+	return (monotonic_nanoseconds() - start) / 1e9;
+}
+
+int main(int argc, char** argv) {
+	size_t frames = argc > 1 ? (size_t)atol(argv[1]) : 1000000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 10;
+	size_t stride = frames;
+
+	uint16_t* pulses = malloc(sizeof(uint16_t) * DHT_PULSES*2 * stride);
+	float* humidity = malloc(sizeof(float) * frames * 2);
+	float* temperature = malloc(sizeof(float) * frames * 2);
+	uint8_t* valid = malloc(frames * 2);
+	if (pulses == NULL || humidity == NULL || temperature == NULL || valid == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	size_t f;
+	for (f = 0; f < frames; ++f) {
+		make_frame(pulses, stride, f);
+	}
+
+	/* Vector kernel */
+	size_t good = 0;
+	int r;
+	uint64_t start = monotonic_nanoseconds();
+	for (r = 0; r < rounds; ++r) {
+		good = dht_batch_decode(DHT22, pulses, stride, frames, humidity, temperature, valid);
+	}
+	double vector_time = seconds(start);
+
+	/* Scalar batch code, results go in the second half of the buffers */
+	start = monotonic_nanoseconds();
+	for (r = 0; r < rounds; ++r) {
+		dht_batch_decode_scalar(DHT22, pulses, stride, frames, humidity + frames, temperature + frames, valid + frames);
+	}
+	double scalar_time = seconds(start);
+
+	if (memcmp(humidity, humidity + frames, sizeof(float) * frames) != 0 ||
+			memcmp(temperature, temperature + frames, sizeof(float) * frames) != 0 ||
+			memcmp(valid, valid + frames, frames) != 0) {
+		fprintf(stderr, "Vector and scalar results differ!\n");
+		return 1;
+	}
+
+	/* Frame by frame through the live decoder, including its repair logic */
+	uint32_t widths[DHT_PULSES*2];
+	start = monotonic_nanoseconds();
+	for (f = 0; f < frames; ++f) {
+		int p;
+		for (p = 0; p < DHT_PULSES*2; ++p) {
+			widths[p] = pulses[p*stride + f];
+		}
+		dht_decode_pulses(DHT22, widths, &humidity[f], &temperature[f]);
+	}
+	double single_time = seconds(start);
+
+	printf("frames: %zu, valid: %zu, rounds: %d\n", frames, good, rounds);
+	printf("%-18s %12.0f frames/s\n", dht_batch_decode_kernel(), frames * rounds / vector_time);
+	printf("%-18s %12.0f frames/s\n", "scalar", frames * rounds / scalar_time);
+	printf("%-18s %12.0f frames/s\n", "dht_decode_pulses", frames / single_time);
+	printf("speedup vs scalar: %.2fx\n", scalar_time / vector_time);
+
+	free(pulses);
+	free(humidity);
+	free(temperature);
+	free(valid);
+	return 0;
+}
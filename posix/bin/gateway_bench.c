@@ -0,0 +1,183 @@
+/*
+ * Benchmark for the gateway runtime: registers a number of indirectly
+ * connected endpoints, then feeds every endpoint a synthetic reading per
+ * round for a while and reports the rate updates are queued at, the
+ * sustained rate the dispatcher delivers them at and the memory used per
+ * endpoint (resident set growth over registration).
+ *
+ * Needs an activated gateway trusted assets store and a reachable server.
+ *
+ * Usage: gateway_bench.out <trusted assets file> <password> [endpoints] [workers] [seconds]
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "iotcs.h"
+#include "iotcs_device.h"
+#include "advanced/iotcs_messaging.h"
+#include "common_dht_read.h"
+#include "gateway.h"
+
+static const char* device_urns[] = {
+	"urn:com:oracle:demo:esensor",
+	NULL
+};
+
+static atomic_ulong delivered;
+static atomic_ulong failed;
+
+#ifdef IOTCS_MESSAGE_DISPATCHER
+/*
+ * The library's own dispatcher callbacks free the virtual device messages
+ * through this, ours count and pass them on. Not declared in its headers.
+ */
+extern void device_model_handle_send(iotcs_message* message, iotcs_result result, const char* fail_reason);
+
+static void on_delivery(iotcs_message* message) {
+	atomic_fetch_add(&delivered, 1);
+	device_model_handle_send(message, IOTCS_RESULT_OK, NULL);
+}
+
+static void on_error(iotcs_message* message, iotcs_result result, const char* fail_reason) {
+	atomic_fetch_add(&failed, 1);
+	device_model_handle_send(message, result, fail_reason);
+}
+#endif
+
+/* Updates the server has, without the dispatcher finish_update sends them itself */
+static unsigned long deliveries(const gateway_stats* stats) {
+#ifdef IOTCS_MESSAGE_DISPATCHER
+	(void)stats;
+	return atomic_load(&delivered);
+#else
+	return stats->updates;
+#endif
+}
+
+static double seconds(void) {
+	return monotonic_nanoseconds() / 1e9;
+}
+
+/* Resident set size in kB */
+static long resident_kb(void) {
+	long pages = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f == NULL) {
+		return 0;
+	}
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+		resident = 0;
+	}
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(int argc, char** argv) {
+	iotcs_device_model_handle model = NULL;
+	gateway_config config;
+	gateway_stats before, after;
+	char hardware_id[GATEWAY_HARDWARE_ID_SIZE];
+	int* ids;
+	int endpoints, workers, duration, i;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <trusted assets file> <password> [endpoints] [workers] [seconds]\n", argv[0]);
+		return 1;
+	}
+	endpoints = argc > 3 ? atoi(argv[3]) : 500;
+	workers = argc > 4 ? atoi(argv[4]) : 8;
+	duration = argc > 5 ? atoi(argv[5]) : 30;
+	ids = malloc(endpoints * sizeof(int));
+	if (endpoints < 1 || ids == NULL) {
+		return 1;
+	}
+
+	if (iotcs_init(argv[1], argv[2]) != IOTCS_RESULT_OK) {
+		fprintf(stderr, "iotcs_init failed\n");
+		return 1;
+	}
+	if (!iotcs_is_activated() && iotcs_activate(device_urns) != IOTCS_RESULT_OK) {
+		fprintf(stderr, "iotcs_activate failed\n");
+		iotcs_finalize();
+		return 1;
+	}
+	if (iotcs_get_device_model_handle(device_urns[0], &model) != IOTCS_RESULT_OK) {
+		fprintf(stderr, "iotcs_get_device_model_handle failed\n");
+		iotcs_finalize();
+		return 1;
+	}
+#ifdef IOTCS_MESSAGE_DISPATCHER
+	iotcs_message_dispatcher_set_delivery_callback(on_delivery);
+	iotcs_message_dispatcher_set_error_callback(on_error);
+#endif
+
+	config.max_endpoints = endpoints;
+	config.workers = workers;
+	config.device_urn = device_urns[0];
+	config.device_model = model;
+	config.restricted = 0;
+	long rss_start = resident_kb();
+	if (gateway_start(&config) != 0) {
+		fprintf(stderr, "gateway_start failed\n");
+		iotcs_free_device_model_handle(model);
+		iotcs_finalize();
+		return 1;
+	}
+
+	double t0 = seconds();
+	for (i = 0; i < endpoints; i++) {
+		snprintf(hardware_id, sizeof(hardware_id), "%s-dht-%05d", iotcs_get_endpoint_id(), i);
+		ids[i] = gateway_add_endpoint(hardware_id);
+	}
+	size_t registered = gateway_wait_registered(600 * 1000);
+	double registration = seconds() - t0;
+	long rss_registered = resident_kb();
+	printf("registered %zu/%d endpoints with %d workers in %.2f s (%.1f/s)\n",
+		registered, endpoints, workers, registration, registered / registration);
+	printf("memory: %ld kB total, %.2f kB per endpoint\n",
+		rss_registered - rss_start, registered ? (double)(rss_registered - rss_start) / registered : 0.0);
+
+	/* One reading per endpoint per round, rounds 10 ms apart; what the workers
+	 * cannot keep up with is coalesced */
+	struct timespec pause = { 0, 10 * 1000000L };
+	sensor_reading reading;
+	memset(&reading, 0, sizeof(reading));
+	gateway_get_stats(&before);
+	unsigned long delivered_before = deliveries(&before);
+	t0 = seconds();
+	unsigned long round = 0;
+	while (seconds() - t0 < duration) {
+		for (i = 0; i < endpoints; i++) {
+			reading.temperature = 20.0f + (float)((round + i) % 100) / 10.0f;
+			reading.humidity = 40.0f + (float)((round * 7 + i) % 200) / 10.0f;
+			gateway_submit(ids[i], &reading);
+		}
+		round++;
+		nanosleep(&pause, NULL);
+	}
+	double elapsed = seconds() - t0;
+	gateway_get_stats(&after);
+	unsigned long delivered_after = deliveries(&after);
+
+	/* finish_update only queues, the rate it returns at is not what the server gets */
+	unsigned long updates = after.updates - before.updates;
+	unsigned long sustained = delivered_after - delivered_before;
+	unsigned long reported = delivered_after + atomic_load(&failed);
+	printf("queued: %lu updates in %.2f s, %.1f/s enqueue rate\n", updates, elapsed, updates / elapsed);
+	printf("delivered: %lu in %.2f s, %.1f updates/s sustained, %.2f per endpoint per s, %lu pending at the end\n",
+		sustained, elapsed, sustained / elapsed, registered ? sustained / elapsed / registered : 0.0,
+		after.updates > reported ? after.updates - reported : 0);
+	printf("submitted %lu, coalesced %lu, update failures %lu, delivery failures %lu, registration failures %lu\n",
+		after.submitted - before.submitted, after.coalesced - before.coalesced,
+		after.update_failures - before.update_failures, atomic_load(&failed), after.registration_failures);
+
+	gateway_stop();
+	iotcs_free_device_model_handle(model);
+	iotcs_finalize();
+	free(ids);
+	return 0;
+}
@@ -22,12 +22,30 @@
  * 
  */
  
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include "pi_2_dht_read.h"
+#include "acquisition.h"
+#include "adaptive_rate.h"
+#include "dht_trace.h"
+#include "event_loop.h"
+#include "log_sink.h"
+#include "metrics.h"
+#include "uploader.h"
+#include "dht_sim.h"
+#include "netready.h"
+#include "query_server.h"
+#include "rollup.h"
+#include "startup_timing.h"
+#include "tsdb.h"
+#include "warm_start.h"
  
 /* include common public types */
 #include "iotcs.h"
@@ -35,49 +53,729 @@
 #include "iotcs_virtual_device.h"
 /* include methods for device client*/
 #include "iotcs_device.h"
+
+/*
+** Settings
+*/
+// Set sensor type DHT11=11, DHT22=22, GPIO pin=4
+static const int sensor_type = 22;
+static const int gpio_pin = 4;
+// CPU core the sensor thread is pinned to, -1 = any core
+static const int acquisition_cpu = 3;
+// Skip the 500 ms pre-charge when the sensor line is known to be idle
+static const int fast_read = 1;
+// Number of retries when the sensor gives bad data
+static const int retries=3;
+// Time (secs) before trying to read the sensor again
+static const int retry_timer = 10;
+// Read interval in secs
+static const int read_interval = 300;
+static const int read_interval_testing = 10; // For testing
+// Adapt the read interval to how fast the readings change, between the
+// bounds below (secs) and the read interval above. Never below 2 secs.
+static const int adaptive_sampling = 1;
+static const int adaptive_min_interval = 10;
+static const int adaptive_min_interval_testing = 2;
+// Change (degrees Celsius, percent humidity) that is worth a new reading
+static const float adaptive_temperature_step = 0.2f;
+static const float adaptive_humidity_step = 1.0f;
+// What to do with readings when uploads fall behind: READING_RING_DROP_OLDEST,
+// READING_RING_BLOCK (stalls sampling) or READING_RING_COALESCE (keep the newest)
+static const reading_ring_policy upload_overflow = READING_RING_DROP_OLDEST;
+// Readings sent together as data messages, 1 = one virtual device update each
+// unless the spool or summary uploads are on, which send every reading as a
+// data message. Raise when sampling fast, the library packs
+// IOTCS_MAX_MESSAGES_FOR_SEND per request
+static const size_t upload_batch_size = 1;
+// Longest time (secs) a reading waits for its batch to fill up
+static const int upload_batch_age = 60;
+// Readings wait on disk while the uplink is down, NULL = no spool.
+// 4096 readings per segment file (128 KB), at most 64 segments (8 MB).
+// Replayed readings keep their sample time, so with a spool all uploads go
+// out as data messages in device_attributes_format, not virtual device updates
+static const spool_config upload_spool = { "/var/spool/iotclient", 4096, 64 };
+// Time (secs) to wait for the network at startup before trying anyway
+static const int startup_timeout = 300;
+// Spooled readings sent per second once the uplink is back
+static const unsigned int replay_rate = 100;
+// Cache of what the last start resolved, lets data message uploads start
+// before the device model is fetched again (NULL = always start cold)
+static const char* warm_start_path = "/var/lib/iotclient/warm_start";
+// Longest time (secs) since the cached model last resolved for a warm start
+static const long warm_start_max_age = 7 * 24 * 3600;
+// Report by exception: only upload when temperature or humidity moved more
+// than these (absolute, percent; 0 = off), but at least every max_silence secs
+// and never more often than every min_interval secs (0 = off)
+static const deadband_config upload_deadband = {
+	{ 0.2f, 0.0f },		// temperature, degrees Celsius
+	{ 1.0f, 0.0f },		// humidity, percent relative humidity
+	1800,				// max_silence
+	0					// min_interval
+};
+// Every good reading is kept in a local history, NULL = none.
+// Times are kept to the second, a year of 10 sec readings is some 3.5 MB
+static const char* history_dir = "/var/lib/iotclient/history";
+static const int history_resolution_ms = 1000;
+// Readings are summed up per minute, hour and day (min, max, mean, stddev),
+// NULL = none. The summaries of the rollup_upload level are uploaded in place
+// of the readings, ROLLUP_LEVELS uploads the readings
+static const char* rollup_dir = "/var/lib/iotclient/rollups";
+static const rollup_level rollup_upload = ROLLUP_LEVELS;
+// Local processes get the latest reading, the history and the rollups from
+// this UNIX domain socket, NULL = none. See query_server.h for the protocol
+static const char* query_socket = "/run/iotclient.sock";
+// Action of the device model that asks for a reading right away, NULL = none.
+// A reading younger than read_now_max_age (secs) answers it at once, otherwise
+// the sensor is read out of the sampling schedule
+static const char* read_now_action = "readNow";
+static const int read_now_max_age = 30;
+// Log level of the client and the library, SIGUSR1/SIGUSR2 raise/lower it
+// at run time (IOTCS_LOG_LEVEL_ERROR to IOTCS_LOG_LEVEL_DEBUG)
+static const iotcs_log_level log_level = IOTCS_LOG_LEVEL_INFO;
+// Port on 127.0.0.1 serving Prometheus metrics at /metrics, 0 = none
+static const uint16_t metrics_port = 9464;
+// Time (secs) between statistics reports
+static const int housekeeping_interval = 60;
+#ifdef DHT_TRACE
+// The tracepoints of a TRACE=1 build are written here as Chrome trace JSON
+// on SIGHUP and at exit, open it in ui.perfetto.dev or chrome://tracing
+static const char* trace_path = "/tmp/iotclient-trace.json";
+#endif
+
+#define NS_PER_SEC 1000000000ULL
  
+/* This is the URN of your device model. */
+static const char* device_urns[] = {
+    "urn:com:oracle:demo:esensor",
+    NULL
+};
+/* Format of the data messages carrying the model's attributes */
+static const char* device_attributes_format = "urn:com:oracle:demo:esensor:attributes";
+/* Attributes uploaded, as name:type, the device model must have them */
+static const char* device_attributes = "temperature:number,humidity:number";
+/* Format of the data messages carrying rollup summaries */
+static const char* device_summary_format = "urn:com:oracle:demo:esensor:summary";
+
+/* Trusted assets store */
+static const char* ts_path;
+static const char* ts_password;
+
 /* Device model handle */
 static iotcs_device_model_handle device_model_handle = NULL;
 /* Device handle */
 static iotcs_virtual_device_handle device_handle = NULL;
+/* Set once iotcs_init succeeded */
+static int iotcs_initialized;
+/* Resolves the device model in the background after a warm start */
+static pthread_t model_thread;
+static int model_thread_started;
+
+/* Timers and state of the sampling cycle */
+static int sample_timer = -1;
+static int retry_timer_fd = -1;
+static int housekeeping_timer = -1;
+static int read_now_timer = -1;
+static int signal_fd = -1;
+static uint64_t sample_period;
+static uint64_t next_sample;
+static adaptive_rate sample_rate;
+static int attempt;
+static int reading_pending;
+static sensor_reading last_reading;
+static uint64_t last_read_ns;
+/* Reading history, when history_dir is set and could be opened */
+static tsdb history;
+static int history_open;
+/* Minute, hour and day summaries, when rollup_dir is set and could be opened */
+static rollup rollups;
+static int rollups_open;
+static int upload_summaries;
+static int query_server_started;
+static int metrics_started;
+
+/*
+ * readNow requests, the action callback runs on a library thread and
+ * hands the request time over to the loop through read_now_fd
+ */
+static int read_now_fd = -1;
+static pthread_mutex_t read_now_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t read_now_requested;
+/* Request the next reading answers, 0 = none */
+static uint64_t read_now_waiting;
+/* The reading in flight was taken out of the schedule */
+static int read_now_reading;
+static int read_now_attempt;
+/* A sampling period started while it ran, it counts as that period's sample */
+static int sample_due;
+/* This period's read waits for the sensor's minimum gap after a readNow read */
+static int sample_deferred;
+
+typedef struct {
+	unsigned long count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+} latency_stats;
+
+/* Counters for the housekeeping report */
+static latency_stats read_now_cached;
+static latency_stats read_now_sensed;
+static unsigned long read_now_failed;
+/* Set when the uplink never came up */
+static int exit_status = EXIT_SUCCESS;
  
 /* print error message and terminate the program execution */
 static void error(const char* message) {
-    fprintf(stderr,"iotcs: Error occurred: %s\n", message);
+    log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs: Error occurred: %s\n", message);
+    log_sink_stop();
     exit(EXIT_FAILURE);
 }
 
+static void request_reading(void) {
+	TRACE_INSTANT("request_reading", attempt);
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Reading from the DHT%u sensor!\n", sensor_type);
+	reading_pending = 1;
+	acquisition_request();
+}
+
+/* A sampling period started, timer deadlines are absolute so they never drift */
+static void on_sample_timer(int fd, void* arg) {
+	(void)arg;
+	uint64_t expirations = timer_expirations(fd);
+	if (expirations == 0) {
+		return;
+	}
+	next_sample += expirations * sample_period;
+	if (expirations > 1) {
+		metrics_add(METRIC_MISSED_PERIODS, expirations - 1);
+		log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, missed %llu sampling periods\n", (unsigned long long)(expirations - 1));
+	}
+	if (reading_pending && read_now_reading && !sample_due) {
+		/* A readNow reading is running, it is this period's sample */
+		timer_disarm(retry_timer_fd);
+		attempt = 1;
+		metrics_add(METRIC_SAMPLES, 1);
+		sample_due = 1;
+		return;
+	}
+	if (reading_pending) {
+		/* The last reading (or its retries) is still running, skip this period */
+		metrics_add(METRIC_MISSED_PERIODS, 1);
+		return;
+	}
+	timer_disarm(retry_timer_fd);
+	attempt = 1;
+	metrics_add(METRIC_SAMPLES, 1);
+	uint64_t earliest = last_read_ns + (uint64_t)ADAPTIVE_RATE_SENSOR_MIN_SECS * NS_PER_SEC;
+	if (last_read_ns && earliest > monotonic_nanoseconds()) {
+		/* A readNow read just ended, pending so a new readNow waits for this one */
+		reading_pending = 1;
+		sample_deferred = 1;
+		timer_arm(retry_timer_fd, earliest, 0);
+		return;
+	}
+	request_reading();
+}
+
+static void on_retry_timer(int fd, void* arg) {
+	(void)arg;
+	if (timer_expirations(fd) == 0) {
+		return;
+	}
+	if (sample_deferred) {
+		sample_deferred = 0;
+		request_reading();
+		return;
+	}
+	if (reading_pending) {
+		return;
+	}
+	attempt++;
+	metrics_add(METRIC_RETRIES, 1);
+	request_reading();
+}
+
+/* Log what we report to IOT, then hand it to the upload thread */
+static void report(const sensor_reading* reading) {
+	TRACE_BEGIN("report");
+	/* The log sink stamps every line with the time */
+	log_printf(IOTCS_LOG_LEVEL_INFO, "<*******************************************************************>\n");
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: result = %u, humidity = %2.2f, temperature= %2.2f, quality = %d%s\n", reading->result,
+			reading->humidity, reading->temperature,
+			reading->quality, reading->repaired_bits ? " (repaired)" : "");
+	log_printf(IOTCS_LOG_LEVEL_INFO, "<*******************************************************************>\n");
+
+	startup_mark(STARTUP_FIRST_READING);
+	query_server_publish(reading);
+	if (history_open) {
+		tsdb_append(&history, reading->event_time, reading->temperature, reading->humidity);
+	}
+	if (rollups_open) {
+		rollup_add(&rollups, reading->event_time, reading->temperature, reading->humidity);
+	}
+	/* Summaries replace the readings, but a readNow is still answered */
+	if (!upload_summaries || reading->on_demand) {
+		uploader_submit(reading);
+	}
+	TRACE_END("report", 0);
+}
+
+/* A rollup bucket closed, from report or housekeeping */
+static void on_rollup_closed(const rollup_bucket* bucket, void* arg) {
+	(void)arg;
+	log_printf(IOTCS_LOG_LEVEL_DEBUG, "iotcs: %s from %lld, %u readings, temperature %.2f/%.2f/%.2f, humidity %.2f/%.2f/%.2f (min/mean/max)\n",
+			rollup_level_name(bucket->level), (long long)bucket->start, bucket->count,
+			bucket->temperature.min, bucket->temperature.mean, bucket->temperature.max,
+			bucket->humidity.min, bucket->humidity.mean, bucket->humidity.max);
+	if (upload_summaries && bucket->level == rollup_upload) {
+		uploader_submit_summary(bucket);
+	}
+}
+
+/* Action callback, runs on a library thread */
+static void on_read_now_action(iotcs_virtual_device_handle handle, iotcs_typed_value argument) {
+	(void)handle;
+	(void)argument;
+	uint64_t now = monotonic_nanoseconds();
+	uint64_t one = 1;
+	pthread_mutex_lock(&read_now_lock);
+	/* Requests close together share one answer, timed from the first */
+	if (read_now_requested == 0) {
+		read_now_requested = now;
+	}
+	pthread_mutex_unlock(&read_now_lock);
+	if (write(read_now_fd, &one, sizeof(one)) != sizeof(one)) {
+		log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not signal %s request\n", read_now_action);
+	}
+}
+
+static void answer_read_now(latency_stats* stats, const char* source) {
+	uint64_t latency = monotonic_nanoseconds() - read_now_waiting;
+	stats->count++;
+	stats->total_ns += latency;
+	if (latency > stats->max_ns) {
+		stats->max_ns = latency;
+	}
+	read_now_waiting = 0;
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: %s answered %s in %.1f ms\n", read_now_action, source, latency / 1e6);
+}
+
+static void request_read_now_reading(void) {
+	uint64_t earliest = last_read_ns + (uint64_t)ADAPTIVE_RATE_SENSOR_MIN_SECS * NS_PER_SEC;
+	uint64_t now = monotonic_nanoseconds();
+	/* Keep the sensor's minimum gap between reads */
+	timer_arm(read_now_timer, earliest > now ? earliest : now, 0);
+}
+
+static void on_read_now(int fd, void* arg) {
+	(void)arg;
+	uint64_t count, requested;
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+		return;
+	}
+	pthread_mutex_lock(&read_now_lock);
+	requested = read_now_requested;
+	read_now_requested = 0;
+	pthread_mutex_unlock(&read_now_lock);
+	if (requested == 0 || read_now_waiting) {
+		/* Already waiting for a reading, that one answers this too */
+		return;
+	}
+	read_now_waiting = requested;
+	if (last_reading.sample_ns &&
+			monotonic_nanoseconds() - last_reading.sample_ns < (uint64_t)read_now_max_age * NS_PER_SEC) {
+		sensor_reading reading = last_reading;
+		reading.on_demand = 1;
+		uploader_submit(&reading);
+		answer_read_now(&read_now_cached, "from the last reading");
+		return;
+	}
+	if (!reading_pending) {
+		read_now_attempt = 1;
+		request_read_now_reading();
+	}
+	/* else the reading in flight answers it */
+}
+
+static void on_read_now_timer(int fd, void* arg) {
+	(void)arg;
+	if (timer_expirations(fd) == 0 || reading_pending || !read_now_waiting) {
+		return;
+	}
+	read_now_reading = 1;
+	request_reading();
+}
+
+/* Move the sample grid to a new period, keeping the sensor's minimum gap */
+static void change_sample_period(uint32_t period) {
+	uint64_t now = monotonic_nanoseconds();
+	sample_period = (uint64_t)period * NS_PER_SEC;
+	next_sample = timer_next_grid_point(sample_period);
+	if (next_sample < now + (uint64_t)ADAPTIVE_RATE_SENSOR_MIN_SECS * NS_PER_SEC) {
+		next_sample += sample_period;
+	}
+	timer_arm(sample_timer, next_sample, sample_period);
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Reading every %u secs now\n", period);
+}
+
+static void on_reading(int fd, void* arg) {
+	(void)fd;
+	(void)arg;
+	sensor_reading reading;
+	if (!acquisition_take(&reading)) {
+		return;
+	}
+	TRACE_INSTANT("reading", reading.result);
+	reading_pending = 0;
+	last_read_ns = reading.sample_ns;
+	if (read_now_reading) {
+		read_now_reading = 0;
+		if (!sample_due) {
+			/* Out of the schedule, only answers the action */
+			reading.attempts = read_now_attempt;
+			if (reading.result == DHT_SUCCESS) {
+				last_reading = reading;
+				reading.on_demand = 1;
+				report(&reading);
+				answer_read_now(&read_now_sensed, "by the sensor");
+			} else if (read_now_attempt < retries) {
+				read_now_attempt++;
+				metrics_add(METRIC_RETRIES, 1);
+				request_read_now_reading();
+			} else {
+				read_now_failed++;
+				read_now_waiting = 0;
+				log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, %s failed after %u reads\n", read_now_action, read_now_attempt);
+			}
+			return;
+		}
+		sample_due = 0;
+	}
+	reading.attempts = attempt;
+
+	// Only report successful sensor readings
+	if (reading.result == DHT_SUCCESS) {
+		last_reading = reading;
+		reading.on_demand = read_now_waiting != 0;
+		report(&reading);
+		if (read_now_waiting) {
+			answer_read_now(&read_now_sensed, "by the sensor");
+		}
+		if (adaptive_sampling) {
+			uint32_t period = adaptive_rate_update(&sample_rate, &reading);
+			if ((uint64_t)period * NS_PER_SEC != sample_period) {
+				change_sample_period(period);
+			}
+		}
+		return;
+	}
+
+	// PK: Retry on bad data, unless the retry would run into the next period
+	uint64_t retry_at = monotonic_nanoseconds() + (uint64_t)retry_timer * NS_PER_SEC;
+	if (attempt < retries && retry_at < next_sample) {
+		log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, Bad data from the DHT%u sensor, trying again %u/%u times.\n", sensor_type, attempt, retries);
+		timer_arm(retry_timer_fd, retry_at, 0);
+	} else {
+		metrics_add(METRIC_FAILED_SAMPLES, 1);
+		log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, failed to read %u times from the DHT%u sensor, skipping to next cycle!\n", attempt, sensor_type);
+		if (read_now_waiting) {
+			read_now_failed++;
+			read_now_waiting = 0;
+		}
+	}
+}
+
+static void on_housekeeping(int fd, void* arg) {
+	(void)arg;
+	uploader_stats upload;
+	log_sink_stats log;
+	metrics_histogram_stats latency;
+	if (timer_expirations(fd) == 0) {
+		return;
+	}
+	uploader_get_stats(&upload);
+	log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: samples %lu, failed %lu, missed periods %lu, uploaded %lu, upload failures %lu\n",
+			metrics_counter_value(METRIC_SAMPLES), metrics_counter_value(METRIC_FAILED_SAMPLES),
+			metrics_counter_value(METRIC_MISSED_PERIODS), upload.sent, upload.failed);
+	if (adaptive_sampling) {
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: sampling every %u secs, period changes %lu\n", sample_rate.period, sample_rate.changes);
+	}
+	if (read_now_action) {
+		log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: %s from the last reading %lu (avg %.1f ms, max %.1f ms), by the sensor %lu (avg %.1f ms, max %.1f ms), failed %lu\n",
+				read_now_action,
+				read_now_cached.count, read_now_cached.count ? read_now_cached.total_ns / 1e6 / read_now_cached.count : 0.0,
+				read_now_cached.max_ns / 1e6,
+				read_now_sensed.count, read_now_sensed.count ? read_now_sensed.total_ns / 1e6 / read_now_sensed.count : 0.0,
+				read_now_sensed.max_ns / 1e6, read_now_failed);
+	}
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: reported %lu, suppressed %lu (rate limited %lu), heartbeats %lu\n",
+			upload.deadband.reported, upload.deadband.suppressed, upload.deadband.rate_limited, upload.deadband.heartbeats);
+	if (upload_batch_size > 1) {
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: upload batches %lu, messages %lu, deferred %lu, dropped %lu\n",
+				upload.batch.batches, upload.batch.queued, upload.batch.deferred, upload.batch.dropped);
+	}
+	if (upload_spool.dir) {
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: uplink %s, spooled %lu, replayed %lu, pending %lu, dropped %lu, segments %u\n",
+				upload.reports_missing ? "down (no delivery reports)" : upload.uplink_down ? "down" : "up", upload.spool.appended, upload.spool.replayed,
+				upload.spool.pending, upload.spool.dropped, upload.spool.segments);
+	}
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: upload ring %u/%u (high water %u), dropped %lu, coalesced %lu, blocked %lu\n",
+			upload.ring.occupancy, READING_RING_CAPACITY, upload.ring.high_water,
+			upload.ring.dropped, upload.ring.coalesced, upload.ring.blocked);
+	if (history_open) {
+		tsdb_stats stored;
+		tsdb_get_stats(&history, &stored);
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: history %lu readings, rejected %lu, %lu blocks sealed in %lu bytes\n",
+				stored.points, stored.rejected, stored.blocks, stored.bytes);
+	}
+	if (rollups_open) {
+		struct timespec now;
+		rollup_stats summed;
+		/* Close the buckets readings have stopped coming for */
+		clock_gettime(CLOCK_REALTIME, &now);
+		rollup_tick(&rollups, (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+		rollup_get_stats(&rollups, &summed);
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: rollups of %lu readings, rejected %lu, closed %lu minutes, %lu hours, %lu days\n",
+				summed.samples, summed.rejected, summed.closed[ROLLUP_MINUTE], summed.closed[ROLLUP_HOUR], summed.closed[ROLLUP_DAY]);
+	}
+	if (upload_summaries) {
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: %s summaries uploaded %lu, pending %lu, dropped %lu\n",
+				rollup_level_name(rollup_upload), upload.batch.summaries, upload.summaries_pending, upload.summaries_dropped);
+	}
+	if (query_server_started) {
+		query_server_stats queries;
+		query_server_get_stats(&queries);
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: queries latest %lu, ranges %lu (%lu records), errors %lu, connections %lu, refused %lu\n",
+				queries.latest, queries.ranges, queries.records, queries.errors, queries.connections, queries.refused);
+	}
+	metrics_get_histogram(METRIC_DHT_READ, &latency);
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: sensor reads %lu, median %.1f ms, 99%% %.1f ms, max %.1f ms\n",
+			latency.count, latency.p50 / 1e6, latency.p99 / 1e6, latency.max / 1e6);
+	metrics_get_histogram(METRIC_SAMPLE_TO_DELIVERY, &latency);
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: delivered %lu, sample to delivery median %.0f ms, 99%% %.0f ms, max %.0f ms\n",
+			latency.count, latency.p50 / 1e6, latency.p99 / 1e6, latency.max / 1e6);
+	log_sink_get_stats(&log);
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: log lines %lu in %lu writes, held back %lu, dropped %lu, write errors %lu\n",
+			log.lines, log.batches, log.suppressed, log.dropped, log.errors);
+}
+
+/* Metrics of the other modules, on the metrics thread at each scrape */
+static void collect_metrics(metrics_writer* writer) {
+	static const char* depth_help = "Items waiting in the client's queues";
+	uploader_stats upload;
+	log_sink_stats log;
+	uploader_get_stats(&upload);
+	log_sink_get_stats(&log);
+	metrics_write(writer, "iotclient_uploaded_total", "counter", "Readings delivered to the server", NULL, upload.sent);
+	metrics_write(writer, "iotclient_upload_failures_total", "counter", "Readings the library refused or gave up on", NULL, upload.failed);
+	metrics_write(writer, "iotclient_deadband_total", "counter", "Readings by deadband decision", "decision=\"reported\"",
+			upload.deadband.reported);
+	metrics_write(writer, "iotclient_deadband_total", "counter", NULL, "decision=\"suppressed\"", upload.deadband.suppressed);
+	metrics_write(writer, "iotclient_deadband_total", "counter", NULL, "decision=\"heartbeat\"", upload.deadband.heartbeats);
+	metrics_write(writer, "iotclient_queue_depth", "gauge", depth_help, "queue=\"upload_ring\"", upload.ring.occupancy);
+	metrics_write(writer, "iotclient_queue_depth", "gauge", NULL, "queue=\"in_flight\"",
+			upload.batch.queued - upload.batch.delivered - upload.batch.failed);
+	metrics_write(writer, "iotclient_queue_depth", "gauge", NULL, "queue=\"spool\"", upload.spool.pending);
+	metrics_write(writer, "iotclient_queue_depth", "gauge", NULL, "queue=\"summaries\"", upload.summaries_pending);
+	metrics_write(writer, "iotclient_queue_dropped_total", "counter", "Items pushed out of a full queue", "queue=\"upload_ring\"",
+			upload.ring.dropped);
+	metrics_write(writer, "iotclient_queue_dropped_total", "counter", NULL, "queue=\"spool\"", upload.spool.dropped);
+	metrics_write(writer, "iotclient_queue_dropped_total", "counter", NULL, "queue=\"summaries\"", upload.summaries_dropped);
+	metrics_write(writer, "iotclient_queue_dropped_total", "counter", NULL, "queue=\"log\"", log.dropped);
+	metrics_write(writer, "iotclient_uplink_up", "gauge", "1 while messages get through", NULL, !upload.uplink_down);
+	metrics_write(writer, "iotclient_delivery_reports_missing", "gauge", "1 while messages in flight go unreported by the library",
+			NULL, upload.reports_missing);
+}
+
+#ifdef DHT_TRACE
+static void dump_trace(void) {
+	int events = dht_trace_dump(trace_path);
+	if (events < 0) {
+		log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not write the trace to %s\n", trace_path);
+	} else {
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Wrote %d trace events to %s\n", events, trace_path);
+	}
+}
+#endif
+
+static void on_signal(int fd, void* arg) {
+	(void)arg;
+	struct signalfd_siginfo info;
+	if (read(fd, &info, sizeof(info)) != sizeof(info)) {
+		return;
+	}
+	/* SIGUSR1 logs more, SIGUSR2 less */
+	if (info.ssi_signo == SIGUSR1 || info.ssi_signo == SIGUSR2) {
+		int level = log_sink_level() + (info.ssi_signo == SIGUSR1 ? 1 : -1);
+		if (level > IOTCS_LOG_LEVEL_DEBUG) {
+			level = IOTCS_LOG_LEVEL_DEBUG;
+		} else if (level < IOTCS_LOG_LEVEL_ERROR) {
+			level = IOTCS_LOG_LEVEL_ERROR;
+		}
+		log_sink_set_level((iotcs_log_level)level);
+		log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs: Log level %d now\n", level);
+		return;
+	}
+#ifdef DHT_TRACE
+	if (info.ssi_signo == SIGHUP) {
+		dump_trace();
+		return;
+	}
+#endif
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Stopping on signal %u\n", info.ssi_signo);
+	event_loop_stop();
+}
+
+/* The upload thread could not connect, stop and let the supervisor restart us */
+static void on_uplink_failed(int fd, void* arg) {
+	(void)arg;
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+		return;
+	}
+	log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs: Error occurred: Connecting the uplink failed, stopping\n");
+	exit_status = EXIT_FAILURE;
+	event_loop_stop();
+}
+
+/* The resolved model has every attribute of the name:type list */
+static int model_has_attributes(const char* attributes) {
+	char list[WARM_START_FIELD];
+	char* saveptr = NULL;
+	char* name;
+	snprintf(list, sizeof(list), "%s", attributes);
+	for (name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+		char* type = strchr(name, ':');
+		iotcs_result rv;
+		float number;
+		int integer;
+		const char* string;
+		if (type == NULL) {
+			return 0;
+		}
+		*type++ = '\0';
+		if (strcmp(type, "number") == 0) {
+			rv = iotcs_virtual_device_get_float(device_handle, name, &number);
+		} else if (strcmp(type, "integer") == 0) {
+			rv = iotcs_virtual_device_get_integer(device_handle, name, &integer);
+		} else if (strcmp(type, "string") == 0) {
+			rv = iotcs_virtual_device_get_string(device_handle, name, &string);
+		} else {
+			return 0;
+		}
+		/* IOTCS_RESULT_FAIL only means no value was set yet */
+		if (rv == IOTCS_RESULT_INVALID_ARGUMENT) {
+			log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs: Error occurred: Device model has no %s attribute %s\n", type, name);
+			return 0;
+		}
+	}
+	return 1;
+}
+
 /*
-** Main
-*/
-int main(int argc, char** argv) {
-    /* This is the URN of your device model. */
-    const char* device_urns[] = {
-        "urn:com:oracle:demo:esensor",
-        NULL
-    };
-	
-	/*
-	** Define Variables
-	*/
-    iotcs_result rv;
-	// Set sensor type DHT11=11, DHT22=22, GPIO pin=4
-	const int sensor_type = 22;
-	const int gpio_pin = 4;
-	
-    if (argc < 3) {
-        error("Too few parameters.\n"
-                "\nUsage:"
-                "\n\tiotclient.out path password"
-                "\n\tpath is a path to trusted assets store."
-                "\n\tpassword is a password for trusted assets store.");
+ * Resolve the device model and virtual device handles, then remember what
+ * was resolved for the next warm start.
+ * Returns 0 on success, -1 on failure.
+ */
+static int resolve_device(void) {
+    /* get device model handle */
+    if (iotcs_get_device_model_handle(device_urns[0], &device_model_handle) != IOTCS_RESULT_OK) {
+        log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs_get_device_model_handle method failed\n");
+        return -1;
     }
-    const char* ts_path = argv[1];
-    const char* ts_password = argv[2];
+	startup_mark(STARTUP_DEVICE_MODEL);
+ 
+    /* get device handle */
+    if (iotcs_get_virtual_device_handle(iotcs_get_endpoint_id(), device_model_handle, &device_handle) != IOTCS_RESULT_OK) {
+        log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs_get_device_handle method failed\n");
+        return -1;
+    }
+	startup_mark(STARTUP_DEVICE);
+
+	if (!model_has_attributes(device_attributes)) {
+		return -1;
+	}
+
+	if (read_now_action &&
+			iotcs_virtual_device_set_callback(device_handle, read_now_action, on_read_now_action) != IOTCS_RESULT_OK) {
+		log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, device model has no %s action\n", read_now_action);
+	}
+
+	if (warm_start_path) {
+		warm_start_cache cache;
+		memset(&cache, 0, sizeof(cache));
+		snprintf(cache.urn, sizeof(cache.urn), "%s", device_urns[0]);
+		snprintf(cache.format, sizeof(cache.format), "%s", device_attributes_format);
+		snprintf(cache.endpoint, sizeof(cache.endpoint), "%s", iotcs_get_endpoint_id());
+		snprintf(cache.attributes, sizeof(cache.attributes), "%s", device_attributes);
+		cache.validated = (long)time(NULL);
+		if (warm_start_save(warm_start_path, &cache) != 0) {
+			log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not save warm start cache %s\n", warm_start_path);
+		}
+	}
+	return 0;
+}
+
+/* The model did not resolve, whatever is wrong the next start is a cold one */
+static void forget_warm_start(void) {
+	if (warm_start_path && warm_start_invalidate(warm_start_path) != 0) {
+		log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs: Error occurred: Could not remove warm start cache %s\n", warm_start_path);
+	}
+}
+
+/* Revalidate the cached device model while uploads already run */
+static void* resolve_device_main(void* arg) {
+	(void)arg;
+	if (resolve_device() == 0) {
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Device model revalidated after %ld ms\n", startup_elapsed_ms(STARTUP_DEVICE));
+	} else {
+		log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, device model could not be revalidated, the next start is cold\n");
+		forget_warm_start();
+	}
+	return NULL;
+}
+
+/* The cache matches this device and what it uploads, and was validated lately */
+static int warm_start_usable(void) {
+	warm_start_cache cache;
+	if (warm_start_path == NULL || warm_start_load(warm_start_path, &cache) != 0) {
+		return 0;
+	}
+	long age = (long)time(NULL) - cache.validated;
+	return cache.validated > 0 && age >= 0 && age <= warm_start_max_age &&
+			strcmp(cache.urn, device_urns[0]) == 0 &&
+			strcmp(cache.format, device_attributes_format) == 0 &&
+			strcmp(cache.endpoint, iotcs_get_endpoint_id()) == 0 &&
+			strcmp(cache.attributes, device_attributes) == 0;
+}
+
+/*
+ * Runs on the uploader's connect thread: wait for the network, then bring
+ * up the library. Sampling carries on meanwhile and readings wait in the
+ * spool.
+ */
+static int connect_uplink(int need_device, iotcs_virtual_device_handle* device) {
+	int warm = 0;
+	int waited = 0;
+
+	netready_open(getenv(NETREADY_HOST_ENV));
+	if (!netready_check()) {
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Wait for network services to start\n");
+		while (netready_wait(1000) != 0) {
+			if (uploader_stopping()) {
+				netready_close();
+				return -1;
+			}
+			/* The probe may miss a route that only leads to the server */
+			if (++waited >= startup_timeout) {
+				log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, network not ready after %d secs, trying anyway\n", startup_timeout);
+				break;
+			}
+		}
+	}
+	netready_close();
+	startup_mark(STARTUP_NETWORK);
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Network ready, loading configuration from: %s\n" ,ts_path);
 
-	fprintf(stderr,"iotcs: device starting!\n");
-	fprintf(stderr,"iotcs: Loading configuration from: %s\n" ,ts_path);
-  
     /*
      * Initialize the library before any other calls.
      * Initiate all subsystems like ssl, TAM, request dispatcher,
@@ -85,8 +783,11 @@ int main(int argc, char** argv) {
      */
   
     if (iotcs_init(ts_path, ts_password) != IOTCS_RESULT_OK) {
-        error("Initialization failed");
+        log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs: Error occurred: Initialization failed\n");
+        return -1;
     }
+    iotcs_initialized = 1;
+	startup_mark(STARTUP_LIBRARY);
  
     /*
      * Activate the device, if it's not already activated.
@@ -98,117 +799,235 @@ int main(int argc, char** argv) {
  
     if (!iotcs_is_activated()) {
         if (iotcs_activate(device_urns) != IOTCS_RESULT_OK) {
-            error("Sending activation request failed");
+            log_printf(IOTCS_LOG_LEVEL_ERROR, "iotcs: Error occurred: Sending activation request failed\n");
+            return -1;
         }
-    }
- 
-    /* get device model handle */
-    if (iotcs_get_device_model_handle(device_urns[0], &device_model_handle) != IOTCS_RESULT_OK) {
-        fprintf(stderr,"iotcs_get_device_model_handle method failed\n");
-        return IOTCS_RESULT_FAIL;
-    }
- 
-    /* get device handle */
-    if (iotcs_get_virtual_device_handle(iotcs_get_endpoint_id(), device_model_handle, &device_handle) != IOTCS_RESULT_OK) {
-        fprintf(stderr,"iotcs_get_device_handle method failed\n");
-        return IOTCS_RESULT_FAIL;
-    }
- 
-	/* Init vars for main loop */
-	int i = 0;
-	int result;
-	float humidity, temperature;
-
-    /* Main loop - Read the sensor and send messages to IOT */
-	while(i++ < 5)
-	{
-		int ix=0;
-		time_t mytime;
-
-		humidity = 0; 
-		temperature = 0;
-		result = -1;
-		
-		// PK: Read values from the sensor. Retry on bad data
-		while ((result != DHT_SUCCESS) && (ix < retries)) {
-			fprintf(stderr,"iotcs: Reading from the DHT%u sensor!\n", sensor_type);
-			result = pi_2_dht_read(sensor_type, gpio_pin, &humidity, &temperature);
-			if (result != DHT_SUCCESS) {
-				fprintf(stderr,"iotcs: Warning, Bad data from the DHT%u sensor, trying again %u/%u times.\n", sensor_type, ix+1, retries);
-
-				ix++;
-
-				if (ix == retries) {
-					fprintf(stderr,"iotcs: Warning, failed to read %u times from the DHT%u sensor, skipping to next cycle!\n", retries, sensor_type);
-				} else {
-					// wait for sensor for "retry_timer" secs	
-					sleep (retry_timer);
-				}
-			}
+    } else {
+		/* Only a device activated before can have a valid cache */
+		warm = !need_device && warm_start_usable();
+	}
+	startup_mark(STARTUP_ACTIVATION);
+
+	if (warm && pthread_create(&model_thread, NULL, resolve_device_main, NULL) == 0) {
+		model_thread_started = 1;
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Warm start, device model is revalidated in the background\n");
+		*device = NULL;
+	} else {
+		if (resolve_device() != 0) {
+			forget_warm_start();
+			return -1;
 		}
+		*device = device_handle;
+	}
+	startup_mark(STARTUP_UPLINK_READY);
+	startup_report();
+    return 0;
+}
 
-		// Only report successful sensor readings
-		if (result == DHT_SUCCESS) {
-		
-			mytime = time(NULL);
-			printf(ctime(&mytime));
-			
-			// PK: print what we report to IOT
-			fprintf(stderr,"\n<*******************************************************************>\n");
-			fprintf(stderr, ctime(&mytime));
-			fprintf(stderr,"iotcs: result = %u, humidity = %2.2f, temperature= %2.2f\n", result, humidity, temperature);
-			fprintf(stderr,"<*******************************************************************>\n\n");
-			
-			// PK: Start setting attribute for IOT
-			iotcs_virtual_device_start_update(device_handle);
-			
-			// PK: Set attribute
-			rv = iotcs_virtual_device_set_float(device_handle, "temperature", temperature);
-			if (rv != IOTCS_RESULT_OK) {
-				fprintf(stderr,"iotcs_virtual_device_set_float method 1 failed\n");
-				return IOTCS_RESULT_FAIL;
-			}
+/*
+** Main
+*/
+int main(int argc, char** argv) {
+	startup_begin();
+	
+    if (argc < 3) {
+        error("Too few parameters.\n"
+                "\nUsage:"
+                "\n\tiotclient.out path password"
+                "\n\tpath is a path to trusted assets store."
+                "\n\tpassword is a password for trusted assets store.");
+    }
+    ts_path = argv[1];
+    ts_password = argv[2];
+    const char* ts_startmode = argc > 3 ? argv[3] : "prod";
 
-			// PK: Set attribute
-			rv = iotcs_virtual_device_set_float(device_handle, "humidity", humidity);
-			if (rv != IOTCS_RESULT_OK) {
-				fprintf(stderr,"iotcs_virtual_device_set_float method 2 failed\n");
-				return IOTCS_RESULT_FAIL;
-			}
-			
-			// PK: We are done. Send message to IOT
-			iotcs_virtual_device_finish_update(device_handle);		
+	/*
+	 * Stop cleanly on Ctrl-C or kill, SIGUSR1/SIGUSR2 change the log
+	 * level, SIGHUP dumps the trace of a TRACE=1 build, the signals are
+	 * read in the loop.
+	 * Blocked before any thread starts, the library ones included, so
+	 * every thread inherits the mask
+	 */
+	sigset_t stop_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	sigaddset(&stop_signals, SIGUSR1);
+	sigaddset(&stop_signals, SIGUSR2);
+#ifdef DHT_TRACE
+	sigaddset(&stop_signals, SIGHUP);
+#endif
+	pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+	signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	/* Everything logs through the sink from here, the library too */
+	if (log_sink_start(STDERR_FILENO, log_level) != 0) {
+		error("Starting the log writer failed");
+	}
+
+	log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: device starting!\n");
+	TRACE_THREAD("event loop");
+	// DHT_SIM=1 reads a simulated sensor instead of the GPIO hardware
+	if (dht_sim_install_from_env(gpio_pin)) {
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Using simulated DHT%u sensor\n", sensor_type);
+	}
 
+	/*
+	 * Sensor reads run on their own real-time thread, this thread
+	 * and the library threads stay at normal priority
+	 */
+	acquisition_config acquisition = { sensor_type, gpio_pin, acquisition_cpu, fast_read };
+	if (acquisition_start(&acquisition) != 0) {
+		error("Starting the sensor thread failed");
+	}
+
+	if (history_dir) {
+		if (tsdb_open(&history, history_dir, history_resolution_ms) == 0) {
+			history_open = 1;
+		} else {
+			log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not open history %s, readings are not kept\n", history_dir);
 		}
-		
-		// PK: How long to sleep before next sensor reading
-		if (argc > 3) {
-			if (strcmp (ts_startmode, "test") == 0) {
-				// Startmode = test mode
-				fprintf(stderr,"iotcs: Sleeping %u secs, startmode=test\n", read_interval_testing);
-				sleep(read_interval_testing);
-			} else {
-				// Startmode = production mode
-				fprintf(stderr,"iotcs: Sleeping %u secs, startmode=prod\n", read_interval);
-				sleep(read_interval);
-			}
+	}
+	if (rollup_dir) {
+		if (rollup_open(&rollups, rollup_dir, on_rollup_closed, NULL) == 0) {
+			rollups_open = 1;
+			upload_summaries = rollup_upload < ROLLUP_LEVELS;
 		} else {
-			// Startmode = production mode
-			fprintf(stderr,"iotcs: Sleeping %u secs, startmode=prod\n", read_interval);
-			sleep(read_interval);
+			log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not open rollups %s, readings are not summed up\n", rollup_dir);
 		}
 	}
+	if (query_socket) {
+		query_server_config queries = { query_socket, history_open ? &history : NULL, rollups_open ? &rollups : NULL };
+		if (query_server_start(&queries) == 0) {
+			query_server_started = 1;
+		} else {
+			log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not serve queries on %s\n", query_socket);
+		}
+	}
+
+	/* Before the uplink starts, it registers the readNow action */
+	read_now_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (read_now_fd < 0) {
+		error("Creating the readNow event failed");
+	}
+
+	uploader_config uploader = { upload_overflow, upload_batch_size, upload_batch_age * 1000, device_attributes_format, upload_deadband,
+			upload_spool, replay_rate, upload_summaries ? device_summary_format : NULL };
+	if (uploader_start(connect_uplink, &uploader) != 0) {
+		error("Starting the upload thread failed");
+	}
+	/* Scrapes read the upload counters */
+	if (metrics_port) {
+		if (metrics_server_start(metrics_port, collect_metrics) == 0) {
+			metrics_started = 1;
+		} else {
+			log_printf(IOTCS_LOG_LEVEL_WARNING, "iotcs: Warning, could not serve metrics on port %u\n", metrics_port);
+		}
+	}
+
+	// PK: How long between sensor readings
+	if (strcmp (ts_startmode, "test") == 0) {
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Reading every %u secs, startmode=test\n", read_interval_testing);
+		sample_period = (uint64_t)read_interval_testing * NS_PER_SEC;
+	} else {
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Reading every %u secs, startmode=prod\n", read_interval);
+		sample_period = (uint64_t)read_interval * NS_PER_SEC;
+	}
+	if (adaptive_sampling) {
+		/* Starts at the read interval and speeds up when readings move */
+		adaptive_rate_config rate = {
+			strcmp (ts_startmode, "test") == 0 ? adaptive_min_interval_testing : adaptive_min_interval,
+			(uint32_t)(sample_period / NS_PER_SEC),
+			adaptive_temperature_step, adaptive_humidity_step,
+			0.3f,		// smoothing, weight of the newest reading
+			1.5f		// growth, the period at most grows by half per reading
+		};
+		adaptive_rate_init(&sample_rate, &rate);
+		log_printf(IOTCS_LOG_LEVEL_INFO, "iotcs: Adaptive sampling between %u and %u secs\n", sample_rate.config.min_period, sample_rate.config.max_period);
+	}
+
+	sample_timer = timer_create_monotonic();
+	retry_timer_fd = timer_create_monotonic();
+	housekeeping_timer = timer_create_monotonic();
+	read_now_timer = timer_create_monotonic();
+	if (event_loop_init() != 0 || signal_fd < 0 || sample_timer < 0 || retry_timer_fd < 0 || housekeeping_timer < 0 ||
+			read_now_timer < 0) {
+		error("Creating the event loop failed");
+	}
+	event_loop_add(sample_timer, on_sample_timer, NULL);
+	event_loop_add(retry_timer_fd, on_retry_timer, NULL);
+	event_loop_add(housekeeping_timer, on_housekeeping, NULL);
+	event_loop_add(acquisition_fd(), on_reading, NULL);
+	event_loop_add(read_now_fd, on_read_now, NULL);
+	event_loop_add(read_now_timer, on_read_now_timer, NULL);
+	event_loop_add(signal_fd, on_signal, NULL);
+	event_loop_add(uploader_failed_fd(), on_uplink_failed, NULL);
+
+	/* Samples land on the wall clock grid, e.g. :00, :05, :10 with 300 secs */
+	next_sample = timer_next_grid_point(sample_period);
+	timer_arm(sample_timer, next_sample, sample_period);
+	timer_arm(housekeeping_timer, monotonic_nanoseconds() + (uint64_t)housekeeping_interval * NS_PER_SEC,
+			(uint64_t)housekeeping_interval * NS_PER_SEC);
+	/* Take the first reading right away rather than waiting for the grid */
+	attempt = 1;
+	metrics_add(METRIC_SAMPLES, 1);
+	request_reading();
+
+    /* Main loop - Read the sensor and send messages to IOT until stopped */
+	event_loop_run();
+
+	event_loop_finalize();
+	close(sample_timer);
+	close(retry_timer_fd);
+	close(housekeeping_timer);
+	close(read_now_timer);
+	close(signal_fd);
+
+	if (metrics_started) {
+		metrics_server_stop();
+	}
+	/* Stop sampling first, then let the uploader send what it holds */
+	acquisition_stop();
+	uploader_stop();
+	/* Before the history and rollups it reads go */
+	if (query_server_started) {
+		query_server_stop();
+	}
+	if (history_open) {
+		tsdb_close(&history);
+	}
+	if (rollups_open) {
+		rollup_close(&rollups);
+	}
+	if (model_thread_started) {
+		pthread_join(model_thread, NULL);
+	}
+#ifdef DHT_TRACE
+	/* Every thread that traces has stopped */
+	dump_trace();
+#endif
  
-    /* free device handle */
-    iotcs_free_virtual_device_handle(device_handle);
-    /* free device model handle */
-    iotcs_free_device_model_handle(device_model_handle);
- 
-    /*
-     * Calling finalization of the library ensures communications channels are closed,
-     * previously allocated temporary resources are released.
-     */
-    iotcs_finalize();
-    printf("OK\n");
-    return EXIT_SUCCESS;
+	/* The uplink may never have come up */
+	if (device_handle) {
+		/* free device handle */
+		iotcs_free_virtual_device_handle(device_handle);
+	}
+	if (device_model_handle) {
+		/* free device model handle */
+		iotcs_free_device_model_handle(device_model_handle);
+	}
+	if (iotcs_initialized) {
+		/*
+		 * Calling finalization of the library ensures communications channels are closed,
+		 * previously allocated temporary resources are released.
+		 */
+		iotcs_finalize();
+	}
+	/* Library threads may call the action until finalized */
+	close(read_now_fd);
+	log_sink_stop();
+	if (exit_status == EXIT_SUCCESS) {
+		printf("OK\n");
+	}
+	return exit_status;
 }
\ No newline at end of file
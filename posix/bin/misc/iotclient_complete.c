@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <time.h>
 #include "pi_2_dht_read.h"
+#include "netready.h"
  
 /* include common public types */
 #include "iotcs.h"
@@ -54,8 +55,8 @@ int main(int argc, char** argv) {
 	// Set sensor type DHT11=11, DHT22=22, GPIO pin=4
 	const int sensor_type = 22;
 	const int gpio_pin = 4;
-	// Startup delay to allow network to initialize
-	const int startup_delay=30;
+	// Longest wait (secs) for the network at startup, iotcs_init is tried anyway after it
+	const int startup_timeout=300;
 	// Number of retries when the sensor gives bad data
 	const int retries=3;
 	// Time (secs) before trying to read the sensor again
@@ -80,21 +81,20 @@ int main(int argc, char** argv) {
 	fprintf(stderr,"iotcs: Loading configuration from: %s\n" ,ts_path);
   
 	/*
-	 * PK: During prod startup wait startup_delay secs for all services to startup before trying to init IOT
+	 * PK: Wait until the network is usable before trying to init IOT, this returns
+	 * at once when it already is. Set IOTCS_SERVER_HOST to also wait for DNS.
 	*/
-	if (argc > 3) {
-		if (strcmp (ts_startmode, "test") == 0) {
-			fprintf(stderr,"iotcs: startmode=test\n");
-		} else {
-			// Wait for network services to start
-			fprintf(stderr,"iotcs: Wait for network services to start\n");
-			sleep(startup_delay);
-		}
-	} else {
-		// Wait for network services to start
+	if (argc > 3 && strcmp (ts_startmode, "test") == 0) {
+		fprintf(stderr,"iotcs: startmode=test\n");
+	}
+	netready_open(getenv(NETREADY_HOST_ENV));
+	if (!netready_check()) {
 		fprintf(stderr,"iotcs: Wait for network services to start\n");
-		sleep(startup_delay);
+		if (netready_wait(startup_timeout * 1000) != 0) {
+			fprintf(stderr,"iotcs: Warning, network not ready after %u secs, trying anyway\n", startup_timeout);
+		}
 	}
+	netready_close();
 
     /*
      * Initialize the library before any other calls.
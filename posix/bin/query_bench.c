@@ -0,0 +1,128 @@
+/*
+ * Benchmark and example client for the local query endpoint of a running
+ * iotclient: times latest reading queries one after the other, then
+ * streams the readings and the minute rollups of the last hours.
+ *
+ * Usage: query_bench.out [socket] [queries] [hours]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "common_dht_read.h"
+#include "query_server.h"
+
+static int read_fully(int fd, void* buffer, size_t size) {
+	size_t done = 0;
+	while (done < size) {
+		ssize_t got = read(fd, (char*)buffer + done, size - done);
+		if (got <= 0) {
+			return -1;
+		}
+		done += (size_t)got;
+	}
+	return 0;
+}
+
+static int compare_ns(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Stream a range query, returns the number of records or -1 */
+static long long stream(int fd, uint16_t type, uint16_t level, int64_t from, int64_t to, size_t record_size) {
+	query_request request = { type, level, 0, from, to };
+	query_frame frame;
+	char* records = malloc(QUERY_FRAME_POINTS * sizeof(query_rollup));
+	long long total = 0;
+	if (records == NULL || write(fd, &request, sizeof(request)) != sizeof(request)) {
+		free(records);
+		return -1;
+	}
+	do {
+		if (read_fully(fd, &frame, sizeof(frame)) != 0 || frame.count > QUERY_FRAME_POINTS ||
+				read_fully(fd, records, frame.count * record_size) != 0) {
+			free(records);
+			return -1;
+		}
+		if (frame.status != QUERY_OK) {
+			fprintf(stderr, "Query type %u failed with status %u\n", frame.type, frame.status);
+			free(records);
+			return -1;
+		}
+		total += frame.count;
+	} while (frame.count > 0);
+	free(records);
+	return total;
+}
+
+int main(int argc, char** argv) {
+	const char* path = argc > 1 ? argv[1] : "/run/iotclient.sock";
+	int queries = argc > 2 ? atoi(argv[2]) : 10000;
+	int hours = argc > 3 ? atoi(argv[3]) : 24;
+	struct sockaddr_un address;
+	struct timespec now;
+	int q;
+
+	if (queries <= 0 || strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Usage: %s [socket] [queries] [hours]\n", argv[0]);
+		return 1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path, strlen(path));
+	if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+		perror(path);
+		return 1;
+	}
+
+	/* Round trips of latest queries */
+	uint64_t* latency = malloc(queries * sizeof(uint64_t));
+	query_request request = { QUERY_LATEST, 0, 0, 0, 0 };
+	query_frame frame;
+	query_reading reading;
+	if (latency == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for (q = 0; q < queries; q++) {
+		uint64_t start = monotonic_nanoseconds();
+		if (write(fd, &request, sizeof(request)) != sizeof(request) || read_fully(fd, &frame, sizeof(frame)) != 0 ||
+				(frame.count == 1 && read_fully(fd, &reading, sizeof(reading)) != 0)) {
+			fprintf(stderr, "Connection lost after %d queries\n", q);
+			return 1;
+		}
+		latency[q] = monotonic_nanoseconds() - start;
+	}
+	qsort(latency, queries, sizeof(uint64_t), compare_ns);
+	if (frame.status == QUERY_OK) {
+		printf("latest: %.1f C, %.1f %% at %lld\n", reading.temperature, reading.humidity, (long long)reading.time);
+	} else {
+		printf("latest: no reading yet (status %u)\n", frame.status);
+	}
+	printf("latest query round trip: median %.1f us, 99%% %.1f us, max %.1f us (%d queries)\n",
+		latency[queries / 2] / 1e3, latency[queries * 99 / 100] / 1e3, latency[queries - 1] / 1e3, queries);
+	free(latency);
+
+	/* The last hours from the history and the rollups */
+	clock_gettime(CLOCK_REALTIME, &now);
+	int64_t to = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	int64_t from = to - (int64_t)hours * 3600 * 1000;
+	uint64_t start = monotonic_nanoseconds();
+	long long count = stream(fd, QUERY_RANGE, 0, from, to, sizeof(query_reading));
+	if (count >= 0) {
+		printf("range of %d hours: %lld readings in %.2f ms\n", hours, count, (monotonic_nanoseconds() - start) / 1e6);
+	}
+	start = monotonic_nanoseconds();
+	count = stream(fd, QUERY_ROLLUP, ROLLUP_MINUTE, from, to, sizeof(query_rollup));
+	if (count >= 0) {
+		printf("minute rollups of %d hours: %lld buckets in %.2f ms\n", hours, count, (monotonic_nanoseconds() - start) / 1e6);
+	}
+	close(fd);
+	return 0;
+}
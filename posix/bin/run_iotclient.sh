@@ -3,4 +3,6 @@
 # p1 = Provisioning File
 # p2 = Provisioning File Password
 # p3 = Start mode [test/prod]
+# Uploads wait for a default route, set IOTCS_SERVER_HOST to also wait for DNS
+#export IOTCS_SERVER_HOST=
 ./iotclient.out ./HJ Test Pi Device.conf Password1 welcome
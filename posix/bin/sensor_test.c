@@ -1,12 +1,25 @@
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include "pi_2_dht_read.h"
+#include "dht_sim.h"
+#include "dht_trace.h"
 
 
-int main()
+int main(int argc, char** argv)
 {
 	printf("Reading sensor\n");
 	
+	// DHT_SIM=1 reads a simulated sensor instead of the GPIO hardware
+	if (dht_sim_install_from_env(4)) {
+		printf("Using simulated sensor\n");
+	}
+	
+	// Optional argument "gpiochip" reads through the GPIO character device
+	if (argc > 1 && strcmp(argv[1], "gpiochip") == 0) {
+		pi_2_dht_set_backend(DHT_BACKEND_GPIOCHIP);
+	}
+	
 	float humidity = 0, temperature = 0;
 	
 	while (1)
@@ -15,9 +28,13 @@ int main()
 		int result = pi_2_dht_read(22, 4, &humidity, &temperature);
 
 		printf("result = %i, humidity = %2.2f, temperature= %2.2f\n", result, humidity, temperature);
+#ifdef DHT_TRACE
+		// A TRACE=1 build rewrites the trace of the reads so far after every read
+		dht_trace_dump("/tmp/sensor_test-trace.json");
+#endif
 		
 		sleep(5);
 	}
 	
 	return 0;
-}
\ No newline at end of file
+}
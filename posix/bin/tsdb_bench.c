@@ -0,0 +1,203 @@
+/*
+ * Benchmark for the reading history store: writes a span of simulated
+ * DHT22 readings (0.1 resolution random walks, a few ms of timing jitter)
+ * for several sensors, then reports the size on disk, the append rate,
+ * the full scan rate and the latency of one hour range queries. Every
+ * scanned reading is checked against what was written.
+ *
+ * Usage: tsdb_bench.out <dir> [sensors] [days] [interval secs] [resolution ms]
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "common_dht_read.h"
+#include "tsdb.h"
+
+/* 2024-01-01 00:00:00 UTC */
+#define BENCH_START_MS 1704067200000LL
+#define BENCH_CHUNK 4096
+
+typedef struct {
+	uint32_t seed;
+	int temperature;		/* tenths of degrees */
+	int humidity;			/* tenths of percent */
+} simulated_sensor;
+
+static uint32_t next_random(simulated_sensor* sensor) {
+	sensor->seed = sensor->seed * 1103515245 + 12345;
+	return sensor->seed >> 8;
+}
+
+static void simulate_start(simulated_sensor* sensor, int id) {
+	sensor->seed = 12345 + id;
+	sensor->temperature = 215;
+	sensor->humidity = 450;
+}
+
+/* Reading k of the sensor, values change by one step now and then like a real DHT22 */
+static void simulate(simulated_sensor* sensor, int64_t k, int interval, int64_t* time, float* temperature, float* humidity) {
+	uint32_t r = next_random(sensor);
+	*time = BENCH_START_MS + k * interval * 1000LL + 25 + (r & 3);
+	if ((r >> 4) % 4 == 0) {
+		sensor->temperature += (r >> 8) & 1 ? 1 : -1;
+	}
+	if ((r >> 10) % 3 == 0) {
+		sensor->humidity += (r >> 12) & 1 ? 1 : -1;
+	}
+	*temperature = sensor->temperature / 10.0f;
+	*humidity = sensor->humidity / 10.0f;
+}
+
+static double seconds(uint64_t start) {
+	return (monotonic_nanoseconds() - start) / 1e9;
+}
+
+static long long directory_bytes(const char* dir) {
+	char path[768];
+	struct dirent* entry;
+	struct stat st;
+	long long bytes = 0;
+	DIR* directory = opendir(dir);
+	if (directory == NULL) {
+		return 0;
+	}
+	while ((entry = readdir(directory)) != NULL) {
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		if (entry->d_name[0] != '.' && stat(path, &st) == 0) {
+			bytes += st.st_size;
+		}
+	}
+	closedir(directory);
+	return bytes;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <dir> [sensors] [days] [interval secs] [resolution ms]\n", argv[0]);
+		return 1;
+	}
+	const char* dir = argv[1];
+	int sensors = argc > 2 ? atoi(argv[2]) : 4;
+	int days = argc > 3 ? atoi(argv[3]) : 365;
+	int interval = argc > 4 ? atoi(argv[4]) : 10;
+	int resolution = argc > 5 ? atoi(argv[5]) : 1000;
+	int64_t points = (int64_t)days * 86400 / interval;
+	char path[512];
+	int s;
+
+	tsdb* dbs = calloc(sensors, sizeof(tsdb));
+	tsdb_cursor* cursor = malloc(sizeof(tsdb_cursor));
+	int64_t* times = malloc(BENCH_CHUNK * sizeof(int64_t));
+	float* temperature = malloc(BENCH_CHUNK * sizeof(float));
+	float* humidity = malloc(BENCH_CHUNK * sizeof(float));
+	if (dbs == NULL || cursor == NULL || times == NULL || temperature == NULL || humidity == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	mkdir(dir, 0700);
+	for (s = 0; s < sensors; s++) {
+		snprintf(path, sizeof(path), "%s/sensor-%d", dir, s);
+		if (tsdb_open(&dbs[s], path, resolution) != 0) {
+			fprintf(stderr, "Could not open %s\n", path);
+			return 1;
+		}
+	}
+
+	/* Sensors interleaved, as they would arrive */
+	simulated_sensor* simulated = calloc(sensors, sizeof(simulated_sensor));
+	for (s = 0; s < sensors; s++) {
+		simulate_start(&simulated[s], s);
+	}
+	uint64_t start = monotonic_nanoseconds();
+	int64_t k;
+	for (k = 0; k < points; k++) {
+		for (s = 0; s < sensors; s++) {
+			int64_t time;
+			float t, h;
+			simulate(&simulated[s], k, interval, &time, &t, &h);
+			if (tsdb_append(&dbs[s], time, t, h) != 0) {
+				fprintf(stderr, "Append failed at reading %lld of sensor %d\n", (long long)k, s);
+				return 1;
+			}
+		}
+	}
+	double append_time = seconds(start);
+	for (s = 0; s < sensors; s++) {
+		tsdb_close(&dbs[s]);
+	}
+	long long bytes = 0;
+	for (s = 0; s < sensors; s++) {
+		snprintf(path, sizeof(path), "%s/sensor-%d", dir, s);
+		bytes += directory_bytes(path);
+	}
+	int64_t total = points * sensors;
+	printf("readings: %lld (%d sensors, %d days every %d s, times to %d ms)\n", (long long)total, sensors, days,
+		interval, resolution);
+	printf("on disk: %.2f MB, %.2f bytes per reading (raw 16)\n", bytes / 1e6, (double)bytes / total);
+	printf("append: %.0f readings/s\n", total / append_time);
+
+	/* Full scan of every sensor, checked against the simulation */
+	for (s = 0; s < sensors; s++) {
+		snprintf(path, sizeof(path), "%s/sensor-%d", dir, s);
+		tsdb_open(&dbs[s], path, resolution);
+		simulate_start(&simulated[s], s);
+	}
+	start = monotonic_nanoseconds();
+	int64_t scanned = 0, mismatches = 0;
+	for (s = 0; s < sensors; s++) {
+		size_t n, i;
+		k = 0;
+		tsdb_cursor_open(cursor, &dbs[s], BENCH_START_MS, BENCH_START_MS + days * TSDB_DAY_MS);
+		while ((n = tsdb_cursor_next(cursor, times, temperature, humidity, BENCH_CHUNK)) > 0) {
+			for (i = 0; i < n; i++, k++) {
+				int64_t time;
+				float t, h;
+				simulate(&simulated[s], k, interval, &time, &t, &h);
+				if (time / resolution * resolution != times[i] || t != temperature[i] || h != humidity[i]) {
+					mismatches++;
+				}
+			}
+			scanned += n;
+		}
+		tsdb_cursor_close(cursor);
+	}
+	double scan_time = seconds(start);
+	printf("scan: %.0f readings/s, %.0f MB/s decoded (includes the check)\n",
+		scanned / scan_time, scanned * (sizeof(int64_t) + 2 * sizeof(float)) / scan_time / 1e6);
+	if (scanned != total || mismatches) {
+		fprintf(stderr, "Scan returned %lld readings, %lld wrong!\n", (long long)scanned, (long long)mismatches);
+		return 1;
+	}
+
+	/* One hour windows spread over the span */
+	int queries = 1000, q;
+	int64_t found = 0;
+	uint32_t seed = 1;
+	start = monotonic_nanoseconds();
+	for (q = 0; q < queries; q++) {
+		seed = seed * 1103515245 + 12345;
+		int64_t from = BENCH_START_MS + (int64_t)((seed >> 8) % (uint32_t)(days * 24)) * 3600 * 1000;
+		size_t n;
+		tsdb_cursor_open(cursor, &dbs[q % sensors], from, from + 3600 * 1000 - 1);
+		while ((n = tsdb_cursor_next(cursor, times, temperature, humidity, BENCH_CHUNK)) > 0) {
+			found += n;
+		}
+		tsdb_cursor_close(cursor);
+	}
+	double query_time = seconds(start);
+	printf("hour range query: %.1f us, %.1f readings each\n", query_time / queries * 1e6, (double)found / queries);
+
+	for (s = 0; s < sensors; s++) {
+		tsdb_close(&dbs[s]);
+	}
+	free(simulated);
+	free(dbs);
+	free(cursor);
+	free(times);
+	free(temperature);
+	free(humidity);
+	return 0;
+}